@@ -1,19 +1,157 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 
 #include "sdcard_interface.h"
 #include "motion_detector.h"
+#include "motion_tracker.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "camera_config.h"
 #include "camera_interface.h"
 #include "img_converters.h"
+#include "esp_jpg_decode.h"
+#include "frame_ring.h"
+#include "frame_queue.h"
 
 const char cameraTag[7] = "camera";
 
+#define BACKGROUND_SNAPSHOT_PATH MOUNT_POINT "/spaia/background.bin"
+#define BACKGROUND_SNAPSHOT_MAX_AGE_S (6 * 3600)  // Older snapshots no longer match the scene's lighting
+#define BACKGROUND_RETAIN_INTERVAL_MS 10000       // Copy to soft-reset-safe PSRAM
+#define BACKGROUND_SAVE_INTERVAL_MS (10 * 60000) // Write to the SD card
+#define HEATMAP_PERIOD_S 3600                     // One motion heatmap per wall-clock hour
+#define MOTION_FRAME_SIZE FRAMESIZE_QVGA          // Motion detection runs on QVGA luma decoded from the JPEG stream
+#define MOTION_FRAME_WIDTH 320
+#define MOTION_FRAME_HEIGHT 240
+#define CAPTURE_FRAME_SIZE FRAMESIZE_SXGA         // High-resolution photos; the driver's buffers are sized for it
+#define FRAMESIZE_SWITCH_MAX_FRAMES 6             // Frames to wait for the sensor to deliver a new size
+#define MOTION_THRESHOLD 50                       // Grey levels a pixel must change by
+#define FRAME_QUEUE_LENGTH 2                      // Frames waiting for detection; the driver keeps one more to fill
+#define CAPTURE_TASK_STACK_SIZE 3072
+#define STREAM_IDLE_WAKE_MS 500                   // Detection task wake-up when no frames arrive
+#define STREAM_STATS_INTERVAL_MS 10000            // Period the achieved frame rates are measured and logged over
+#define BURST_MAX_FRAMES 16                       // Frames in one burst, the Kconfig maximum
+#define BURST_RING_MAX_FRAMES (2 * BURST_MAX_FRAMES) // Room for a burst being written and the next one
+#define BURST_QUEUE_LENGTH 2                      // Bursts waiting for the SD writer
+#define BURST_WRITER_STACK_SIZE 4096
+#define BURST_CAPTURE_STACK_SIZE 3072
+#define SHARPNESS_DECODE_SCALE JPG_SCALE_4X       // At 1/8 only DC coefficients survive, and with them no edges
+#define WINDOW_GRID 16                            // Detection windows snap to whole JPEG MCUs
+#define WINDOW_ROI_SLOT 0                         // Detector ROI slot for the window, the lowest so it takes precedence
+
+// OV2640 CIF mode, which the driver uses for QVGA: the array read 4x subsampled into 400x296, cropped and
+// scaled by the DSP in steps of 8
+#define OV2640_MODE_CIF 2
+#define OV2640_CIF_WIDTH 400
+#define OV2640_CIF_HEIGHT 296
+#define OV2640_WINDOW_STEP 8
+
+// OV5640 4:3 timing from the driver: the 2560x1920 field QVGA is scaled from, with the array margins and
+// total line and frame sizes around it
+#define OV5640_FIELD_WIDTH 2560
+#define OV5640_FIELD_HEIGHT 1920
+#define OV5640_OFFSET_X 32
+#define OV5640_OFFSET_Y 16
+#define OV5640_TOTAL_X 2844
+#define OV5640_VBLANK (1968 - OV5640_FIELD_HEIGHT) // Frame rows beyond the field
+
+#if CONFIG_SPAIA_PREROLL
+#define STREAM_FRAME_SIZE FRAMESIZE_VGA           // The ring keeps VGA JPEGs, decoded at half size for detection
+#define STREAM_DECODE_SCALE JPG_SCALE_2X
+#define PREROLL_MAX_FRAMES 128                    // Frames the ring can index, several seconds at the VGA rate
+#define BURST_MAX_VIEWS PREROLL_MAX_FRAMES        // Frames the SD writer takes from the ring at once
+#else
+#define STREAM_FRAME_SIZE MOTION_FRAME_SIZE
+#define STREAM_DECODE_SCALE JPG_SCALE_NONE
+#define BURST_MAX_VIEWS BURST_MAX_FRAMES
+#endif
+
 SemaphoreHandle_t camera_semaphore;
 
+static MotionDetector *motion_detector = NULL;
+static camera_fb_t motion_luma;                 // Detection frame decoded from the JPEG stream, allocated once
+static capture_latency_stats_t capture_stats;
+static frame_queue_t *frame_queue = NULL; // Capture task to detection task
+static TaskHandle_t detection_task = NULL;
+// Each counter has one writing task: captured, dropped and queue_high_water the capture task, the
+// rest the detection task. Frames the detection task flushes are counted apart in stream_flushed and
+// added to dropped when reported.
+static camera_stream_stats_t stream_stats;
+static uint32_t stream_flushed;
+
+// A burst stored in burst_ring and waiting for the SD writer
+typedef struct
+{
+    uint32_t first; // Ring sequence of the first frame; the rest follow it
+    size_t count;
+    uint32_t key;   // Pre-roll bursts: sequence of the triggering frame, the one uploaded
+    time_t timestamp;
+} burst_job_t;
+
+// The frames the SD writer saves: with CONFIG_SPAIA_PREROLL the ring the VGA stream is recorded into,
+// otherwise one of high-resolution captures. NULL if the writer could not be started.
+static frame_ring_t *burst_ring = NULL;
+static SemaphoreHandle_t burst_lock = NULL; // Guards burst_ring, the burst_* state below and queueing jobs
+static bool burst_held;                     // Frames from the oldest unwritten burst on are held
+static bool burst_recording;                // A burst is being stored and is not queued yet
+static uint32_t burst_recording_first;      // Its first frame
+static QueueHandle_t burst_jobs = NULL;
+static camera_fb_t *burst_views = NULL;     // BURST_MAX_VIEWS of them, writer task only
+#if !CONFIG_SPAIA_PREROLL
+static camera_fb_t sharpness_luma; // Writer task only
+
+// A high-resolution burst the detection task asks the burst capture task for
+typedef struct
+{
+    time_t timestamp;
+    int64_t trigger_us;
+    size_t frames;
+    uint32_t interval_ms;
+} burst_request_t;
+
+static QueueHandle_t burst_requests = NULL; // Detection task to burst capture task
+#endif
+
+// Part of the detection frame the sensor reads out; the whole frame unless a window is set. Both are
+// guarded by camera_semaphore.
+static camera_window_t detection_window = {0, 0, MOTION_FRAME_WIDTH, MOTION_FRAME_HEIGHT};
+static int64_t detection_window_since_us; // When the sensor was last set to it; earlier frames may not match
+
+static esp_err_t start_detection_stream(sensor_t *s);
+#if !CONFIG_SPAIA_PREROLL
+static void burst_capture_task(void *pvParameters);
+#endif
+
+#if CONFIG_SPAIA_PREROLL
+// A burst being recorded around a detection: frames first..trigger are the pre-roll, and recording
+// stops with the first frame captured at or after until_us
+typedef struct
+{
+    bool recording;
+    uint32_t first;
+    uint32_t trigger;
+    int64_t until_us;
+    time_t timestamp;
+} preroll_burst_t;
+
+static preroll_burst_t preroll_burst; // Detection task only
+#endif
+
+// Source and destination of a JPEG decode into the detection frame, which the JPEG covers from
+// (x, y) on
+typedef struct
+{
+    const camera_fb_t *jpeg;
+    camera_fb_t *luma;
+    uint16_t x;
+    uint16_t y;
+} jpeg_luma_decoder_t;
+
 static custom_sensor_info_t *get_sensor_info()
 {
     sensor_t *s = esp_camera_sensor_get();
@@ -70,10 +208,12 @@ static camera_config_t get_default_camera_config(void)
         // Start with conservative settings
         .xclk_freq_hz = 10000000, // Will be updated based on sensor
         .fb_location = CAMERA_FB_IN_PSRAM,
-        .pixel_format = PIXFORMAT_GRAYSCALE,
-        .frame_size = FRAMESIZE_QVGA,
+        // The driver fixes its DMA mode at init, so it stays in JPEG and only the sensor's output size
+        // changes between detection and capture. Buffers are sized for the capture size.
+        .pixel_format = PIXFORMAT_JPEG,
+        .frame_size = CAPTURE_FRAME_SIZE,
         .jpeg_quality = 10,
-        .fb_count = 2,
+        .fb_count = FRAME_QUEUE_LENGTH + 1,
         .grab_mode = CAMERA_GRAB_LATEST // Changed from WHEN_EMPTY to reduce overflow
     };
     return config;
@@ -169,129 +309,1053 @@ esp_err_t initialize_camera(void)
         }
     }
 
-    // Configure sensor settings
-    configure_sensor_settings(esp_camera_sensor_get());
+    // Configure sensor settings and start the detection stream
+    sensor_t *sensor = esp_camera_sensor_get();
+    configure_sensor_settings(sensor);
+    if (sensor)
+    {
+        start_detection_stream(sensor);
+    }
+
+    if (motion_luma.buf == NULL)
+    {
+        motion_luma.buf = (uint8_t *)malloc(MOTION_FRAME_WIDTH * MOTION_FRAME_HEIGHT);
+        if (!motion_luma.buf)
+        {
+            ESP_LOGE(cameraTag, "Failed to allocate the detection frame");
+            return ESP_ERR_NO_MEM;
+        }
+        motion_luma.len = MOTION_FRAME_WIDTH * MOTION_FRAME_HEIGHT;
+        motion_luma.width = MOTION_FRAME_WIDTH;
+        motion_luma.height = MOTION_FRAME_HEIGHT;
+        motion_luma.format = PIXFORMAT_GRAYSCALE;
+    }
 
-    // Initialize motion detection
-    initialize_background_model(320, 240);
+    // Initialize motion detection, warm-starting from the soft-reset copy or the SD card if either is valid
+    if (motion_detector == NULL)
+    {
+        MotionDetectorConfig detector_config;
+        motion_detector_default_config(&detector_config, MOTION_FRAME_WIDTH, MOTION_FRAME_HEIGHT);
+        detector_config.threshold = MOTION_THRESHOLD;
+        ret = motion_detector_create(&detector_config, &motion_detector);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(cameraTag, "Motion detector init failed with error 0x%x", ret);
+            return ret;
+        }
+        if (motion_detector_restore_retained_snapshot(motion_detector, BACKGROUND_SNAPSHOT_MAX_AGE_S) != ESP_OK &&
+            motion_detector_load_snapshot(motion_detector, BACKGROUND_SNAPSHOT_PATH, BACKGROUND_SNAPSHOT_MAX_AGE_S) != ESP_OK)
+        {
+            ESP_LOGI(cameraTag, "No background snapshot, learning from scratch");
+        }
+    }
 
     ESP_LOGI(cameraTag, "Camera initialized successfully");
     return ESP_OK;
 }
-esp_err_t switch_camera_mode(camera_config_t *config)
+// Frame size from the SOF marker of a JPEG, without decoding it
+static bool jpeg_frame_size(const uint8_t *jpeg, size_t len, uint16_t *width, uint16_t *height)
 {
-    esp_err_t err = esp_camera_deinit();
-    if (err != ESP_OK)
+    if (len < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8)
+    {
+        return false;
+    }
+    size_t i = 2;
+    while (i + 9 <= len && jpeg[i] == 0xFF)
+    {
+        uint8_t marker = jpeg[i + 1];
+        if (marker >= 0xC0 && marker <= 0xC2)
+        {
+            *height = (uint16_t)((jpeg[i + 5] << 8) | jpeg[i + 6]);
+            *width = (uint16_t)((jpeg[i + 7] << 8) | jpeg[i + 8]);
+            return true;
+        }
+        i += 2 + ((jpeg[i + 2] << 8) | jpeg[i + 3]);
+    }
+    return false;
+}
+
+static size_t read_jpeg(void *arg, size_t index, uint8_t *buf, size_t len)
+{
+    const camera_fb_t *jpeg = ((const jpeg_luma_decoder_t *)arg)->jpeg;
+    if (index >= jpeg->len)
+    {
+        return 0;
+    }
+    if (len > jpeg->len - index)
+    {
+        len = jpeg->len - index;
+    }
+    if (buf)
     {
-        ESP_LOGE(cameraTag, "Camera deinit failed: %s", esp_err_to_name(err));
-        return err;
+        memcpy(buf, jpeg->buf + index, len);
     }
+    return len;
+}
 
-    err = esp_camera_init(config);
-    if (err != ESP_OK)
+// Convert each decoded RGB888 block to BT.601 luma, the same weights as the sensor's grayscale output
+static bool write_luma(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    const jpeg_luma_decoder_t *decoder = (const jpeg_luma_decoder_t *)arg;
+    camera_fb_t *luma = decoder->luma;
+    if (!data)
     {
-        ESP_LOGE(cameraTag, "Camera init failed: %s", esp_err_to_name(err));
-        return err;
+        // Start and end of the image; the size was checked before decoding
+        return true;
     }
+    x += decoder->x;
+    y += decoder->y;
+    if ((size_t)x + w > luma->width || (size_t)y + h > luma->height)
+    {
+        return false;
+    }
+    for (uint16_t row = 0; row < h; row++)
+    {
+        const uint8_t *rgb = data + (size_t)row * w * 3;
+        uint8_t *out = luma->buf + (size_t)(y + row) * luma->width + x;
+        for (uint16_t i = 0; i < w; i++, rgb += 3)
+        {
+            out[i] = (uint8_t)((77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2]) >> 8);
+        }
+    }
+    return true;
+}
+
+// Driver timestamps count from boot, in the units of esp_timer_get_time()
+static int64_t frame_time_us(const camera_fb_t *fb)
+{
+    return (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+}
+
+// Decode a detection-stream JPEG, read out at window, into motion_luma, scaling it down by
+// STREAM_DECODE_SCALE inside the IDCT. A windowed frame lands at the window's place, so boxes stay in
+// full-frame coordinates. Frames of any other size, such as those still queued from a capture, are
+// rejected from their header.
+static bool decode_motion_frame(const camera_fb_t *jpeg, const camera_window_t *window)
+{
+    uint16_t width, height;
+    if (!jpeg_frame_size(jpeg->buf, jpeg->len, &width, &height) ||
+        width != window->width << STREAM_DECODE_SCALE || height != window->height << STREAM_DECODE_SCALE)
+    {
+        return false;
+    }
+    jpeg_luma_decoder_t decoder = {.jpeg = jpeg, .luma = &motion_luma, .x = window->x, .y = window->y};
+    if (esp_jpg_decode(jpeg->len, STREAM_DECODE_SCALE, read_jpeg, write_luma, &decoder) != ESP_OK)
+    {
+        ESP_LOGW(cameraTag, "Failed to decode a detection frame");
+        return false;
+    }
+    // The detector reports the wall-clock time it finds in the frame, so move the capture time onto it
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t captured_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec - (esp_timer_get_time() - frame_time_us(jpeg));
+    motion_luma.timestamp.tv_sec = (time_t)(captured_us / 1000000);
+    motion_luma.timestamp.tv_usec = (suseconds_t)(captured_us % 1000000);
+    return true;
+}
+
+static bool is_full_frame(const camera_window_t *window)
+{
+    return window->x == 0 && window->y == 0 && window->width == MOTION_FRAME_WIDTH &&
+           window->height == MOTION_FRAME_HEIGHT;
+}
+
+// Round down to a multiple of step, which is a power of two
+static uint16_t align_down(uint32_t value, uint32_t step)
+{
+    return (uint16_t)(value & ~(step - 1));
+}
+
+// Program the sensor to read out only window, at the detection frame's scale
+static esp_err_t set_sensor_window(sensor_t *s, const camera_window_t *window)
+{
+    if (s->id.PID == OV2640_PID)
+    {
+        // Only the DSP crops on this sensor, so the line time stays that of CIF; DMA, JPEG and decoding
+        // shrink with the window
+        uint16_t offset_x = align_down((uint32_t)window->x * OV2640_CIF_WIDTH / MOTION_FRAME_WIDTH, OV2640_WINDOW_STEP);
+        uint16_t offset_y = align_down((uint32_t)window->y * OV2640_CIF_HEIGHT / MOTION_FRAME_HEIGHT, OV2640_WINDOW_STEP);
+        uint16_t max_x = align_down((uint32_t)window->width * OV2640_CIF_WIDTH / MOTION_FRAME_WIDTH, OV2640_WINDOW_STEP);
+        uint16_t max_y = align_down((uint32_t)window->height * OV2640_CIF_HEIGHT / MOTION_FRAME_HEIGHT, OV2640_WINDOW_STEP);
+        return s->set_res_raw(s, OV2640_MODE_CIF, 0, 0, 0, offset_x, offset_y, max_x, max_y, window->width,
+                              window->height, false, false) == 0 ? ESP_OK : ESP_FAIL;
+    }
+    if (s->id.PID == OV5640_PID)
+    {
+        // The array window itself follows the ROI and 2x2 binning halves the rows read, with the offsets
+        // and frame length halved to match as the driver does for binned sizes. A shorter frame length
+        // raises the rate the sensor can reach.
+        uint16_t scale = OV5640_FIELD_WIDTH / MOTION_FRAME_WIDTH;
+        uint16_t start_x = window->x * scale;
+        uint16_t start_y = window->y * scale;
+        uint16_t end_x = start_x + window->width * scale + 2 * OV5640_OFFSET_X - 1;
+        uint16_t end_y = start_y + window->height * scale + 2 * OV5640_OFFSET_Y - 1;
+        uint16_t total_y = window->height * scale + OV5640_VBLANK;
+        return s->set_res_raw(s, start_x, start_y, end_x, end_y, OV5640_OFFSET_X / 2, OV5640_OFFSET_Y / 2,
+                              OV5640_TOTAL_X, total_y / 2, window->width, window->height, true, true) == 0
+                   ? ESP_OK
+                   : ESP_FAIL;
+    }
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+// Put the sensor back to the detection stream: the full frame, or the window if one is set
+static esp_err_t start_detection_stream(sensor_t *s)
+{
+    if (is_full_frame(&detection_window))
+    {
+        return s->set_framesize(s, STREAM_FRAME_SIZE) == 0 ? ESP_OK : ESP_FAIL;
+    }
+    return set_sensor_window(s, &detection_window);
+}
 
-    configure_sensor_settings(esp_camera_sensor_get());
+esp_err_t camera_window_from_mask(const uint8_t *mask, camera_window_t *window)
+{
+    uint16_t min_x = MOTION_FRAME_WIDTH, min_y = MOTION_FRAME_HEIGHT, max_x = 0, max_y = 0;
+    for (uint16_t y = 0; y < MOTION_FRAME_HEIGHT; y++)
+    {
+        const uint8_t *row = mask + (size_t)y * MOTION_FRAME_WIDTH;
+        for (uint16_t x = 0; x < MOTION_FRAME_WIDTH; x++)
+        {
+            if (row[x])
+            {
+                min_x = x < min_x ? x : min_x;
+                max_x = x > max_x ? x : max_x;
+                min_y = y < min_y ? y : min_y;
+                max_y = y > max_y ? y : max_y;
+            }
+        }
+    }
+    if (min_x > max_x)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    window->x = min_x;
+    window->y = min_y;
+    window->width = max_x - min_x + 1;
+    window->height = max_y - min_y + 1;
     return ESP_OK;
 }
 
-esp_err_t takeHighResPhoto(time_t timestamp)
+esp_err_t camera_set_detection_window(const camera_window_t *window)
 {
-    if (xSemaphoreTake(camera_semaphore, portMAX_DELAY) != pdTRUE)
+    camera_window_t snapped = {0, 0, MOTION_FRAME_WIDTH, MOTION_FRAME_HEIGHT};
+    if (window)
+    {
+        if (window->width == 0 || window->height == 0 || window->x + window->width > MOTION_FRAME_WIDTH ||
+            window->y + window->height > MOTION_FRAME_HEIGHT)
+        {
+            return ESP_ERR_INVALID_ARG;
+        }
+        // Grow to whole MCUs, which the frame size is made of, so the window still covers the request
+        snapped.x = align_down(window->x, WINDOW_GRID);
+        snapped.y = align_down(window->y, WINDOW_GRID);
+        snapped.width = align_down(window->x + window->width + WINDOW_GRID - 1, WINDOW_GRID) - snapped.x;
+        snapped.height = align_down(window->y + window->height + WINDOW_GRID - 1, WINDOW_GRID) - snapped.y;
+    }
+#if CONFIG_SPAIA_PREROLL
+    // The ring keeps the stream for the saved bursts, which need the whole view
+    if (!is_full_frame(&snapped))
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
+
+    sensor_t *s = esp_camera_sensor_get();
+    if (!s || xSemaphoreTake(camera_semaphore, portMAX_DELAY) != pdTRUE)
     {
         return ESP_FAIL;
     }
+    camera_window_t previous = detection_window;
+    detection_window = snapped;
+    esp_err_t err = start_detection_stream(s);
+    if (err != ESP_OK)
+    {
+        detection_window = previous;
+        start_detection_stream(s);
+    }
+    // Frames the driver filled before this may be at either window, so the capture task drops them
+    detection_window_since_us = esp_timer_get_time();
+    xSemaphoreGive(camera_semaphore);
+    if (err == ESP_OK)
+    {
+        ESP_LOGI(cameraTag, "Detection window %ux%u at (%u, %u)", snapped.width, snapped.height, snapped.x,
+                 snapped.y);
+    }
+    return err;
+}
 
-    camera_config_t highres_config = get_default_camera_config();
-    custom_sensor_info_t *sensor_info = get_sensor_info(); // Use custom_sensor_info_t instead
+void camera_get_detection_window(camera_window_t *window)
+{
+    xSemaphoreTake(camera_semaphore, portMAX_DELAY);
+    *window = detection_window;
+    xSemaphoreGive(camera_semaphore);
+}
 
-    if (sensor_info)
+// Change the sensor's output size through its registers and wait for the first frame at that size,
+// returning the ones still at the old size to the driver
+static camera_fb_t *grab_frame_at_size(framesize_t frame_size)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    if (!s || s->set_framesize(s, frame_size) != 0)
+    {
+        ESP_LOGE(cameraTag, "Failed to set frame size %d", frame_size);
+        return NULL;
+    }
+    for (int i = 0; i < FRAMESIZE_SWITCH_MAX_FRAMES; i++)
     {
-        highres_config.xclk_freq_hz = sensor_info->xclk_freq_hz;
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb)
+        {
+            continue;
+        }
+        uint16_t width, height;
+        if (jpeg_frame_size(fb->buf, fb->len, &width, &height) && width == resolution[frame_size].width &&
+            height == resolution[frame_size].height)
+        {
+            return fb;
+        }
+        esp_camera_fb_return(fb);
+        capture_stats.switch_frames_dropped++;
     }
+    ESP_LOGE(cameraTag, "No %ux%u frame after %d tries", resolution[frame_size].width,
+             resolution[frame_size].height, FRAMESIZE_SWITCH_MAX_FRAMES);
+    return NULL;
+}
 
-    highres_config.frame_size = FRAMESIZE_SXGA;
-    highres_config.pixel_format = PIXFORMAT_JPEG;
-    highres_config.fb_count = 2;
+void camera_get_capture_latency(capture_latency_stats_t *stats)
+{
+    *stats = capture_stats;
+}
 
-    esp_err_t ret = ESP_OK;
-    if (switch_camera_mode(&highres_config) != ESP_OK)
+#if !CONFIG_SPAIA_PREROLL
+// Variance of the 4-neighbour Laplacian, high for crisp edges and low for motion blur or defocus
+static uint32_t laplacian_variance(const camera_fb_t *luma)
+{
+    const size_t width = luma->width;
+    int64_t sum = 0;
+    int64_t sum_sq = 0;
+    for (size_t y = 1; y + 1 < luma->height; y++)
     {
-        xSemaphoreGive(camera_semaphore);
-        return ESP_FAIL;
+        const uint8_t *row = luma->buf + y * width;
+        for (size_t x = 1; x + 1 < width; x++)
+        {
+            int32_t laplacian = 4 * row[x] - row[x - 1] - row[x + 1] - row[x - width] - row[x + width];
+            sum += laplacian;
+            sum_sq += laplacian * laplacian;
+        }
     }
+    int64_t n = (int64_t)(width - 2) * (int64_t)(luma->height - 2);
+    return (uint32_t)((sum_sq - sum * sum / n) / n);
+}
 
-    camera_fb_t *pic = esp_camera_fb_get();
-    if (!pic)
+// Sharpness of a capture-size JPEG, scored on a reduced decode; 0 if it cannot be decoded
+static uint32_t frame_sharpness(const camera_fb_t *jpeg)
+{
+    uint16_t width, height;
+    if (!jpeg_frame_size(jpeg->buf, jpeg->len, &width, &height) ||
+        width >> SHARPNESS_DECODE_SCALE != sharpness_luma.width ||
+        height >> SHARPNESS_DECODE_SCALE != sharpness_luma.height)
     {
-        ESP_LOGE(cameraTag, "Camera capture failed");
-        ret = ESP_FAIL;
-        goto exit;
+        return 0;
+    }
+    jpeg_luma_decoder_t decoder = {.jpeg = jpeg, .luma = &sharpness_luma};
+    if (esp_jpg_decode(jpeg->len, SHARPNESS_DECODE_SCALE, read_jpeg, write_luma, &decoder) != ESP_OK)
+    {
+        return 0;
+    }
+    return laplacian_variance(&sharpness_luma);
+}
+
+// Index of the sharpest of count frames
+static size_t sharpest_frame(const camera_fb_t *frames, size_t count)
+{
+    size_t best = 0;
+    uint32_t best_score = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t score = frame_sharpness(&frames[i]);
+        if (score > best_score)
+        {
+            best = i;
+            best_score = score;
+        }
+    }
+    ESP_LOGI(cameraTag, "Sharpest of %u burst frames is %u (Laplacian variance %lu)", (unsigned)count,
+             (unsigned)best, (unsigned long)best_score);
+    return best;
+}
+#endif
+
+// Start storing a burst at first. The ring is held from there unless an earlier burst still holds it,
+// in which case the writer moves the hold on once that one is written. Called with burst_lock taken.
+static void begin_burst(uint32_t first)
+{
+    burst_recording = true;
+    burst_recording_first = first;
+    if (!burst_held)
+    {
+        frame_ring_hold(burst_ring, first);
+        burst_held = true;
+    }
+}
+
+// Hand a stored burst to the writer. Called with burst_lock taken, so the writer sees the burst either
+// still recording or queued when it decides what to keep holding.
+static void queue_burst(const burst_job_t *job)
+{
+    burst_recording = false;
+    if (xQueueSend(burst_jobs, job, 0) != pdTRUE)
+    {
+        ESP_LOGW(cameraTag, "SD writer is behind, dropping the burst");
+    }
+}
+
+// Writes each burst to the SD card while the detection task goes back to work. A pre-roll burst
+// uploads its triggering frame, a burst of high-resolution captures only its sharpest.
+static void burst_writer_task(void *pvParameters)
+{
+    burst_job_t job;
+    while (1)
+    {
+        if (xQueueReceive(burst_jobs, &job, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+        // Views stay valid without the lock, as the ring holds these frames until released below
+        size_t count = 0;
+        size_t key_frame = 0;
+        xSemaphoreTake(burst_lock, portMAX_DELAY);
+        for (size_t i = 0; i < job.count && count < BURST_MAX_VIEWS; i++)
+        {
+            if (frame_ring_get(burst_ring, job.first + (uint32_t)i, &burst_views[count]))
+            {
+                key_frame = job.first + (uint32_t)i == job.key ? count : key_frame;
+                count++;
+            }
+        }
+        xSemaphoreGive(burst_lock);
+
+#if !CONFIG_SPAIA_PREROLL
+        key_frame = count > 1 ? sharpest_frame(burst_views, count) : 0;
+#endif
+        esp_err_t err = ESP_FAIL;
+        if (count == 1)
+        {
+            err = saveJpegToSdcard(&burst_views[0], job.timestamp);
+        }
+        else if (count > 1)
+        {
+            err = saveJpegBurstToSdcard(burst_views, count, key_frame, job.timestamp);
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(cameraTag, "Failed to save image");
+        }
+
+        // Let the ring reuse these frames, still holding the next burst if one is queued or being stored
+        burst_job_t next;
+        frame_ring_stats_t stats;
+        xSemaphoreTake(burst_lock, portMAX_DELAY);
+        if (xQueuePeek(burst_jobs, &next, 0) == pdTRUE)
+        {
+            frame_ring_hold(burst_ring, next.first);
+        }
+        else if (burst_recording)
+        {
+            frame_ring_hold(burst_ring, burst_recording_first);
+        }
+        else
+        {
+            frame_ring_release(burst_ring);
+            burst_held = false;
+        }
+        frame_ring_get_stats(burst_ring, &stats);
+        xSemaphoreGive(burst_lock);
+        ESP_LOGI(cameraTag, "Burst of %u frames written, key frame %u; ring pushed %lu, dropped %lu",
+                 (unsigned)count, (unsigned)key_frame, (unsigned long)stats.pushed, (unsigned long)stats.dropped);
+    }
+}
+
+// Allocate the writer's ring, views and (for high-resolution bursts) sharpness buffer, and start it.
+// On failure everything is freed again and burst_ring stays NULL.
+static esp_err_t start_burst_writer(void)
+{
+#if CONFIG_SPAIA_PREROLL
+    size_t ring_bytes = (size_t)CONFIG_SPAIA_PREROLL_RING_KB * 1024;
+    size_t ring_frames = PREROLL_MAX_FRAMES;
+    bool buffers_ok = true;
+#else
+    size_t ring_bytes = (size_t)CONFIG_SPAIA_BURST_RING_KB * 1024;
+    size_t ring_frames = BURST_RING_MAX_FRAMES;
+    sharpness_luma.width = resolution[CAPTURE_FRAME_SIZE].width >> SHARPNESS_DECODE_SCALE;
+    sharpness_luma.height = resolution[CAPTURE_FRAME_SIZE].height >> SHARPNESS_DECODE_SCALE;
+    sharpness_luma.len = sharpness_luma.width * sharpness_luma.height;
+    sharpness_luma.format = PIXFORMAT_GRAYSCALE;
+    sharpness_luma.buf = (uint8_t *)malloc(sharpness_luma.len);
+    burst_requests = xQueueCreate(1, sizeof(burst_request_t));
+    bool buffers_ok = sharpness_luma.buf != NULL && burst_requests != NULL;
+#endif
+    frame_ring_t *ring = NULL;
+    burst_lock = xSemaphoreCreateMutex();
+    burst_jobs = xQueueCreate(BURST_QUEUE_LENGTH, sizeof(burst_job_t));
+    burst_views = (camera_fb_t *)calloc(BURST_MAX_VIEWS, sizeof(camera_fb_t));
+    if (buffers_ok && burst_lock && burst_jobs && burst_views &&
+        frame_ring_create(ring_bytes, ring_frames, &ring) == ESP_OK)
+    {
+        // The writer only runs once it has a job, and jobs need burst_ring
+        burst_ring = ring;
+        TaskHandle_t writer = NULL;
+        if (xTaskCreatePinnedToCore(burst_writer_task, "burst_writer_task", BURST_WRITER_STACK_SIZE, NULL,
+                                    tskIDLE_PRIORITY + 1, &writer, PRO_CPU_NUM) == pdPASS)
+        {
+#if CONFIG_SPAIA_PREROLL
+            ESP_LOGI(cameraTag, "Pre-roll ring of %d KB, %d ms before and %d ms after each detection",
+                     CONFIG_SPAIA_PREROLL_RING_KB, CONFIG_SPAIA_PREROLL_MS, CONFIG_SPAIA_POSTROLL_MS);
+            return ESP_OK;
+#else
+            // Above detection on its core, so a requested burst starts straight away
+            if (xTaskCreatePinnedToCore(burst_capture_task, "burst_capture_task", BURST_CAPTURE_STACK_SIZE, NULL,
+                                        tskIDLE_PRIORITY + 1, NULL, APP_CPU_NUM) == pdPASS)
+            {
+                return ESP_OK;
+            }
+            // Still waiting for its first job, so it holds nothing
+            vTaskDelete(writer);
+#endif
+        }
+        burst_ring = NULL;
     }
 
-    if (saveJpegToSdcard(pic, timestamp) != ESP_OK)
+    frame_ring_destroy(ring);
+    free(burst_views);
+    burst_views = NULL;
+    if (burst_jobs)
     {
-        ESP_LOGE(cameraTag, "Failed to save image");
-        ret = ESP_FAIL;
+        vQueueDelete(burst_jobs);
+        burst_jobs = NULL;
     }
+    if (burst_lock)
+    {
+        vSemaphoreDelete(burst_lock);
+        burst_lock = NULL;
+    }
+#if !CONFIG_SPAIA_PREROLL
+    if (burst_requests)
+    {
+        vQueueDelete(burst_requests);
+        burst_requests = NULL;
+    }
+    free(sharpness_luma.buf);
+    sharpness_luma.buf = NULL;
+#endif
+    return ESP_ERR_NO_MEM;
+}
 
-exit:
-    vTaskDelay(pdMS_TO_TICKS(100));
+// Latency statistics for a high-resolution frame in hand at in_hand_us, measured from trigger_us, the
+// capture time of the frame that triggered it, so queueing, decoding and detection are included
+static void record_capture_latency(int64_t trigger_us, int64_t in_hand_us)
+{
+    int64_t latency_us = in_hand_us - trigger_us;
+    capture_stats.captures++;
+    capture_stats.last_us = latency_us;
+    capture_stats.total_us += latency_us;
+    if (latency_us > capture_stats.max_us)
+    {
+        capture_stats.max_us = latency_us;
+    }
+    ESP_LOGI(cameraTag, "High-res JPEG in hand %lld ms after the triggering frame (mean %lld ms over %lu)",
+             (long long)(latency_us / 1000), (long long)(capture_stats.total_us / capture_stats.captures / 1000),
+             (unsigned long)capture_stats.captures);
+}
+
+// Take one frame at the capture size and save it before returning, for when no ring keeps captures
+static esp_err_t take_single_photo(time_t timestamp, int64_t trigger_us)
+{
+    if (xSemaphoreTake(camera_semaphore, portMAX_DELAY) != pdTRUE)
+    {
+        return ESP_FAIL;
+    }
+    esp_err_t err = ESP_FAIL;
+    camera_fb_t *pic = grab_frame_at_size(CAPTURE_FRAME_SIZE);
     if (pic)
     {
+        record_capture_latency(trigger_us, esp_timer_get_time());
+        err = saveJpegToSdcard(pic, timestamp);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(cameraTag, "Failed to save image");
+        }
         esp_camera_fb_return(pic);
     }
-    vTaskDelay(pdMS_TO_TICKS(100));
-    // Switch back to motion detection mode
-    camera_config_t motion_config = get_default_camera_config();
-    if (sensor_info)
+    else
+    {
+        ESP_LOGE(cameraTag, "Camera capture failed");
+    }
+
+    sensor_t *s = esp_camera_sensor_get();
+    if (s)
+    {
+        start_detection_stream(s);
+    }
+    xSemaphoreGive(camera_semaphore);
+    return err;
+}
+
+#if !CONFIG_SPAIA_PREROLL
+// Capture a burst into burst_ring and queue it for the writer. Runs on the burst capture task, as it
+// holds the camera for the whole burst.
+static esp_err_t capture_high_res_burst(time_t timestamp, int64_t trigger_us, size_t frames, uint32_t interval_ms)
+{
+    // Only this function queues bursts, so a free slot now is still free once the burst is captured
+    if (uxQueueSpacesAvailable(burst_jobs) == 0)
     {
-        motion_config.xclk_freq_hz = sensor_info->xclk_freq_hz;
+        ESP_LOGW(cameraTag, "SD writer is behind, skipping the burst");
+        return ESP_FAIL;
+    }
+    if (xSemaphoreTake(camera_semaphore, portMAX_DELAY) != pdTRUE)
+    {
+        return ESP_FAIL;
+    }
+
+    burst_job_t job = {.count = 0, .timestamp = timestamp};
+    int64_t first_us = 0;
+    int64_t last_us = 0;
+    TickType_t last_wake = 0;
+    for (size_t i = 0; i < frames; i++)
+    {
+        camera_fb_t *pic;
+        if (i == 0)
+        {
+            pic = grab_frame_at_size(CAPTURE_FRAME_SIZE);
+            if (!pic)
+            {
+                break;
+            }
+            last_wake = xTaskGetTickCount();
+        }
+        else
+        {
+            if (interval_ms > 0)
+            {
+                vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(interval_ms));
+            }
+            pic = esp_camera_fb_get();
+            if (!pic)
+            {
+                continue;
+            }
+        }
+        int64_t in_hand_us = esp_timer_get_time();
+        if (i == 0)
+        {
+            record_capture_latency(trigger_us, in_hand_us);
+            first_us = in_hand_us;
+        }
+        last_us = in_hand_us;
+
+        // Copy into PSRAM so the driver gets its buffer back for the next frame
+        uint32_t sequence;
+        xSemaphoreTake(burst_lock, portMAX_DELAY);
+        bool stored = frame_ring_push(burst_ring, pic, &sequence);
+        if (stored)
+        {
+            if (job.count == 0)
+            {
+                job.first = sequence;
+                begin_burst(sequence);
+            }
+            job.count++;
+        }
+        xSemaphoreGive(burst_lock);
+        esp_camera_fb_return(pic);
+        if (!stored)
+        {
+            capture_stats.burst_frames_dropped++;
+        }
     }
-    switch_camera_mode(&motion_config);
-    // initialize_background_model(320, 240);
-    vTaskDelay(pdMS_TO_TICKS(100));
 
+    // Return to the detection size straight away, so the sensor settles while the burst is written
+    sensor_t *s = esp_camera_sensor_get();
+    if (s)
+    {
+        start_detection_stream(s);
+    }
     xSemaphoreGive(camera_semaphore);
-    return ret;
+
+    if (job.count == 0)
+    {
+        ESP_LOGE(cameraTag, "Camera capture failed");
+        return ESP_FAIL;
+    }
+    if (job.count > 1 && last_us > first_us)
+    {
+        capture_stats.last_burst_fps = (float)(job.count - 1) * 1e6f / (float)(last_us - first_us);
+        ESP_LOGI(cameraTag, "Burst of %u/%u frames at %.1f fps", (unsigned)job.count, (unsigned)frames,
+                 capture_stats.last_burst_fps);
+    }
+    xSemaphoreTake(burst_lock, portMAX_DELAY);
+    queue_burst(&job);
+    xSemaphoreGive(burst_lock);
+    return ESP_OK;
+}
+
+// Takes each requested burst, so the detection task goes back to its queue instead of waiting out the
+// burst's frame intervals
+static void burst_capture_task(void *pvParameters)
+{
+    burst_request_t request;
+    while (1)
+    {
+        if (xQueueReceive(burst_requests, &request, portMAX_DELAY) == pdTRUE &&
+            capture_high_res_burst(request.timestamp, request.trigger_us, request.frames, request.interval_ms) !=
+                ESP_OK)
+        {
+            ESP_LOGE(cameraTag, "Failed to take high-res photo");
+        }
+    }
+}
+#endif
+
+esp_err_t takeHighResBurst(time_t timestamp, int64_t trigger_us, size_t frames, uint32_t interval_ms)
+{
+    if (frames == 0 || frames > BURST_MAX_FRAMES)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+#if !CONFIG_SPAIA_PREROLL
+    if (burst_ring)
+    {
+        burst_request_t request = {
+            .timestamp = timestamp, .trigger_us = trigger_us, .frames = frames, .interval_ms = interval_ms};
+        if (xQueueSend(burst_requests, &request, 0) != pdTRUE)
+        {
+            ESP_LOGW(cameraTag, "A burst is already waiting to be captured, skipping this one");
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+#endif
+    // The pre-roll ring only records the stream, and without a writer no ring keeps captures at all
+    return take_single_photo(timestamp, trigger_us);
+}
+
+esp_err_t takeHighResPhoto(time_t timestamp, int64_t trigger_us)
+{
+    return takeHighResBurst(timestamp, trigger_us, 1, 0);
 }
 
+// Queue the boxes of a detection, and a summary of every track that ended, for the data log
+static void publish_motion_result(const MotionResult *result)
+{
+    if (result->motion)
+    {
+        char *json_string = boxes_to_json(result->boxes, result->track_ids, result->box_count);
+        if (json_string != NULL)
+        {
+            sensor_data_t sensor_data = {
+                .timestamp = result->timestamp,
+                .bboxes = json_string,
+                .owns_bboxes = true // The queue consumer frees the string
+            };
+            ESP_LOGI(cameraTag, "Motion boxes: %s", json_string);
+            if (xQueueSend(sensor_data_queue, &sensor_data, pdMS_TO_TICKS(10)) != pdTRUE)
+            {
+                ESP_LOGE(cameraTag, "Failed to send motion boxes to the queue");
+                free(json_string);
+            }
+        }
+    }
+
+    MotionTrack ended[MAX_TRACKS];
+    size_t ended_count = motion_detector_take_ended_tracks(motion_detector, ended, MAX_TRACKS);
+    for (size_t i = 0; i < ended_count; i++)
+    {
+        char *summary = (char *)malloc(MOTION_TRACK_JSON_SIZE);
+        if (summary == NULL)
+        {
+            return;
+        }
+        motion_track_to_json(&ended[i], summary, MOTION_TRACK_JSON_SIZE);
+        sensor_data_t sensor_data = {
+            .timestamp = ended[i].last_seen,
+            .bboxes = summary,
+            .owns_bboxes = true};
+        if (xQueueSend(sensor_data_queue, &sensor_data, pdMS_TO_TICKS(10)) != pdTRUE)
+        {
+            ESP_LOGE(cameraTag, "Failed to send track summary to the queue");
+            free(summary);
+        }
+    }
+}
+
+// Write the heatmap of the period that started at period_start, named like the CSVs by its local date
+// and hour, e.g. /sd/spaia/heatmap-16-10-26-14.pgm
+static void save_motion_heatmap(time_t period_start)
+{
+    struct tm timeinfo;
+    char filename[32];
+    char filepath[64];
+    localtime_r(&period_start, &timeinfo);
+    strftime(filename, sizeof(filename), "heatmap-%d-%m-%y-%H.pgm", &timeinfo);
+    snprintf(filepath, sizeof(filepath), "%s/spaia/%s", MOUNT_POINT, filename);
+    motion_detector_save_heatmap(motion_detector, filepath);
+}
+
+#if CONFIG_SPAIA_PREROLL
+// Hold the pre-roll before the triggering frame and start recording the post-roll
+static void start_preroll_burst(uint32_t trigger, int64_t trigger_us, time_t timestamp)
+{
+    // Only this task queues pre-roll bursts, so a free slot now is still free when the post-roll ends
+    if (uxQueueSpacesAvailable(burst_jobs) == 0)
+    {
+        ESP_LOGW(cameraTag, "SD writer is behind, skipping the burst");
+        return;
+    }
+    xSemaphoreTake(burst_lock, portMAX_DELAY);
+    preroll_burst.first = frame_ring_find(burst_ring, trigger_us - (int64_t)CONFIG_SPAIA_PREROLL_MS * 1000);
+    begin_burst(preroll_burst.first);
+    xSemaphoreGive(burst_lock);
+    preroll_burst.trigger = trigger;
+    preroll_burst.until_us = trigger_us + (int64_t)CONFIG_SPAIA_POSTROLL_MS * 1000;
+    preroll_burst.timestamp = timestamp;
+    preroll_burst.recording = true;
+}
+
+// Queue the held frames up to newest as one burst; the writer lets the ring overwrite them once saved
+static void queue_preroll_burst(uint32_t newest)
+{
+    burst_job_t job = {
+        .first = preroll_burst.first,
+        .count = newest - preroll_burst.first + 1,
+        .key = preroll_burst.trigger,
+        .timestamp = preroll_burst.timestamp};
+    xSemaphoreTake(burst_lock, portMAX_DELAY);
+    queue_burst(&job);
+    xSemaphoreGive(burst_lock);
+    preroll_burst.recording = false;
+}
+#endif
+
+// Limit the detector to window: pixels the sensor no longer reads out keep their last decoded values,
+// and must not be compared or sampled for the lighting gain. Detection task only, as it owns the
+// detector.
+static void apply_window_roi(const camera_window_t *window)
+{
+    if (is_full_frame(window))
+    {
+        motion_detector_clear_roi(motion_detector, WINDOW_ROI_SLOT);
+        return;
+    }
+    uint8_t *mask = (uint8_t *)calloc(MOTION_FRAME_WIDTH * MOTION_FRAME_HEIGHT, 1);
+    if (!mask)
+    {
+        ESP_LOGE(cameraTag, "Failed to allocate the detection window mask");
+        return;
+    }
+    for (uint16_t y = window->y; y < window->y + window->height; y++)
+    {
+        memset(mask + (size_t)y * MOTION_FRAME_WIDTH + window->x, 1, window->width);
+    }
+    if (motion_detector_set_roi(motion_detector, WINDOW_ROI_SLOT, mask, 0, 0) != ESP_OK)
+    {
+        ESP_LOGE(cameraTag, "Failed to set the detection window mask");
+    }
+    free(mask);
+}
+
+// Detection task: drains the frame queue, returning each buffer to the driver as soon as it has
+// been decoded, and runs the periodic background and heatmap saves between frames
 void motion_detection_task(void *pvParameters)
 {
-    float motion_threshold = 50;
-    time_t motion_timestamp;
+    MotionResult result;
+    TickType_t last_retain = xTaskGetTickCount();
+    TickType_t last_save = last_retain;
+    int64_t stats_start_us = esp_timer_get_time();
+    uint32_t stats_captured = 0;
+    uint32_t stats_processed = 0;
+    int64_t stats_decode_us = 0; // Decode time spent on the stats_processed frames counted so far
+    camera_window_t roi_window = {0, 0, MOTION_FRAME_WIDTH, MOTION_FRAME_HEIGHT}; // Window the detector ROI matches
+#if CONFIG_SPAIA_PREROLL
+    uint32_t stream_sequence = 0; // Newest frame in the ring
+    int64_t stream_us = 0;        // Capture time of the newest frame from the camera
+#endif
 
     while (1)
     {
-        if (xSemaphoreTake(camera_semaphore, portMAX_DELAY) == pdTRUE)
+        // Woken once per queued frame, or after STREAM_IDLE_WAKE_MS so the saves below still run
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(STREAM_IDLE_WAKE_MS));
+        queued_frame_t queued;
+        while (frame_queue_pop(frame_queue, &queued))
         {
-            camera_fb_t *frame = esp_camera_fb_get();
-            if (frame)
+            camera_fb_t *frame = queued.fb;
+            bool capture = false;
+            int64_t trigger_us = frame_time_us(frame); // Captured, before queueing, decoding and detection
+#if CONFIG_SPAIA_PREROLL
+            bool streamed = false;
+#endif
+            // The region of interest follows the window of each frame, so it is in place before detection
+            if (memcmp(&roi_window, &queued.window, sizeof(roi_window)) != 0)
             {
-                if (detect_motion(frame, motion_threshold, &motion_timestamp))
-                {
-                    ESP_LOGI(cameraTag, "Motion detected!");
-                    esp_camera_fb_return(frame);
-                    xSemaphoreGive(camera_semaphore);
+                roi_window = queued.window;
+                apply_window_roi(&roi_window);
+            }
+            // Detection only needs the luma copy, so the driver gets its buffer back first
+            int64_t decode_start_us = esp_timer_get_time();
+            bool decoded = decode_motion_frame(frame, &queued.window);
+            stats_decode_us += esp_timer_get_time() - decode_start_us;
+#if CONFIG_SPAIA_PREROLL
+            // A full ring during a post-roll drops the frame, but the post-roll still runs out
+            if (burst_ring)
+            {
+                xSemaphoreTake(burst_lock, portMAX_DELAY);
+                streamed = frame_ring_push(burst_ring, frame, &stream_sequence);
+                xSemaphoreGive(burst_lock);
+            }
+            stream_us = frame_time_us(frame);
+#endif
+            esp_camera_fb_return(frame);
+            stream_stats.processed++;
+            if (!decoded)
+            {
+                capture_stats.motion_frames_dropped++;
+            }
+            else if (motion_detector_process(motion_detector, &motion_luma, &result) == ESP_OK)
+            {
+                publish_motion_result(&result);
+                // Motion that continues an existing track is logged but not photographed again
+                capture = result.motion && result.capture_requested;
+            }
 
-                    if (takeHighResPhoto(motion_timestamp) != ESP_OK)
+            if (capture)
+            {
+                ESP_LOGI(cameraTag, "Motion detected!");
+#if CONFIG_SPAIA_PREROLL
+                // The triggering frame is already in the ring; detections during a post-roll join its burst
+                if (burst_ring)
+                {
+                    if (!preroll_burst.recording && streamed)
+                    {
+                        start_preroll_burst(stream_sequence, stream_us, result.timestamp);
+                    }
+                }
+                else
+#endif
+                {
+                    // The queued frames are detection frames too, but they hold driver buffers the capture
+                    // needs, so they are returned unprocessed
+                    while (frame_queue_pop(frame_queue, &queued))
+                    {
+                        esp_camera_fb_return(queued.fb);
+                        stream_flushed++;
+                    }
+                    if (takeHighResBurst(result.timestamp, trigger_us, CONFIG_SPAIA_BURST_FRAMES,
+                                         CONFIG_SPAIA_BURST_INTERVAL_MS) != ESP_OK)
                     {
                         ESP_LOGE(cameraTag, "Failed to take high-res photo");
                     }
-
-                    continue; // Skip the second fb_return and semaphore give
                 }
-                esp_camera_fb_return(frame);
             }
+#if CONFIG_SPAIA_PREROLL
+            if (preroll_burst.recording && stream_us >= preroll_burst.until_us)
+            {
+                queue_preroll_burst(stream_sequence);
+            }
+#endif
+        }
+
+        TickType_t now = xTaskGetTickCount();
+        if (now - last_retain >= pdMS_TO_TICKS(BACKGROUND_RETAIN_INTERVAL_MS))
+        {
+            motion_detector_retain_snapshot(motion_detector);
+            last_retain = now;
+        }
+        if (now - last_save >= pdMS_TO_TICKS(BACKGROUND_SAVE_INTERVAL_MS))
+        {
+            motion_detector_save_snapshot(motion_detector, BACKGROUND_SNAPSHOT_PATH);
+            last_save = now;
+        }
+        // Nothing is saved until the clock is set and has dated the period
+        time_t heatmap_start = motion_detector_heatmap_start(motion_detector);
+        if (heatmap_start != 0 && time(NULL) / HEATMAP_PERIOD_S != heatmap_start / HEATMAP_PERIOD_S)
+        {
+            save_motion_heatmap(heatmap_start);
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        if (now_us - stats_start_us >= (int64_t)STREAM_STATS_INTERVAL_MS * 1000)
+        {
+            float seconds = (float)(now_us - stats_start_us) / 1e6f;
+            stream_stats.capture_fps = (float)(stream_stats.captured - stats_captured) / seconds;
+            uint32_t processed = stream_stats.processed - stats_processed;
+            stream_stats.detection_fps = (float)processed / seconds;
+            stream_stats.decode_ms = processed > 0 ? (float)stats_decode_us / 1000.0f / (float)processed : 0.0f;
+            ESP_LOGI(cameraTag,
+                     "Captured %.1f fps, detected %.1f fps (target %d), decode %.1f ms per frame; %lu frames dropped, "
+                     "queue peak %lu",
+                     stream_stats.capture_fps, stream_stats.detection_fps, CONFIG_SPAIA_TARGET_FPS,
+                     stream_stats.decode_ms, (unsigned long)(stream_stats.dropped + stream_flushed),
+                     (unsigned long)stream_stats.queue_high_water);
+            stats_start_us = now_us;
+            stats_captured = stream_stats.captured;
+            stats_processed = stream_stats.processed;
+            stats_decode_us = 0;
+        }
+    }
+}
+
+// Capture task: takes frames from the driver at the target rate and queues them for detection. When
+// detection falls behind the newest frame is dropped, so the sensor never waits on the CPU.
+static void camera_capture_task(void *pvParameters)
+{
+    const TickType_t period = pdMS_TO_TICKS(1000 / CONFIG_SPAIA_TARGET_FPS);
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1)
+    {
+        queued_frame_t frame = {.fb = NULL};
+        bool stale = false;
+        // Held only around the grab, so a high-resolution capture waits at most one frame
+        if (xSemaphoreTake(camera_semaphore, portMAX_DELAY) == pdTRUE)
+        {
+            frame.fb = esp_camera_fb_get();
+            frame.window = detection_window;
+            stale = frame.fb && frame_time_us(frame.fb) < detection_window_since_us;
             xSemaphoreGive(camera_semaphore);
         }
-        vTaskDelay(pdMS_TO_TICKS(50)); // Add small delay to prevent tight loop
+        if (frame.fb)
+        {
+            stream_stats.captured++;
+            if (stale)
+            {
+                // Started before the window last changed, so its window is unknown
+                esp_camera_fb_return(frame.fb);
+                stream_stats.dropped++;
+            }
+            else if (frame_queue_push(frame_queue, &frame))
+            {
+                size_t depth = frame_queue_depth(frame_queue);
+                if (depth > stream_stats.queue_high_water)
+                {
+                    stream_stats.queue_high_water = depth;
+                }
+                xTaskNotifyGive(detection_task);
+            }
+            else
+            {
+                esp_camera_fb_return(frame.fb);
+                stream_stats.dropped++;
+            }
+        }
+        vTaskDelayUntil(&last_wake, period > 0 ? period : 1);
     }
 }
 
+void camera_get_stream_stats(camera_stream_stats_t *stats)
+{
+    *stats = stream_stats;
+    stats->dropped += stream_flushed;
+}
+
 void createCameraTask()
 {
     if (camera_semaphore == NULL)
@@ -299,6 +1363,16 @@ void createCameraTask()
         ESP_LOGE(cameraTag, "Camera semaphore not initialized. Cannot create camera task.");
         return;
     }
+    if (frame_queue == NULL && frame_queue_create(FRAME_QUEUE_LENGTH, &frame_queue) != ESP_OK)
+    {
+        ESP_LOGE(cameraTag, "Failed to create the frame queue");
+        return;
+    }
+    if (burst_ring == NULL && start_burst_writer() != ESP_OK)
+    {
+        // Detection still runs, saving a single photo per detection from the detection task
+        ESP_LOGE(cameraTag, "Failed to start the burst writer, falling back to single photos");
+    }
 
     BaseType_t xReturned = xTaskCreatePinnedToCore(
         motion_detection_task,
@@ -306,15 +1380,31 @@ void createCameraTask()
         8192, // Increased stack size
         NULL,
         tskIDLE_PRIORITY,
-        NULL,
+        &detection_task,
         APP_CPU_NUM);
 
     if (xReturned != pdPASS)
     {
         ESP_LOGE(cameraTag, "Failed to create motion detection task");
+        return;
+    }
+
+    // Above detection, so a frame is taken from the driver as soon as it is due
+    xReturned = xTaskCreatePinnedToCore(
+        camera_capture_task,
+        "camera_capture_task",
+        CAPTURE_TASK_STACK_SIZE,
+        NULL,
+        tskIDLE_PRIORITY + 1,
+        NULL,
+        APP_CPU_NUM);
+
+    if (xReturned != pdPASS)
+    {
+        ESP_LOGE(cameraTag, "Failed to create camera capture task");
     }
     else
     {
-        ESP_LOGI(cameraTag, "Motion detection task created successfully");
+        ESP_LOGI(cameraTag, "Camera capture and motion detection tasks created successfully");
     }
 }
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include "frame_queue.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct frame_queue
+{
+    queued_frame_t *slots;
+    size_t mask;        // capacity - 1
+    atomic_size_t head; // Next slot to pop, written only by the consumer
+    atomic_size_t tail; // Next slot to push, written only by the producer
+};
+
+esp_err_t frame_queue_create(size_t capacity, frame_queue_t **out_queue)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    frame_queue_t *queue = (frame_queue_t *)calloc(1, sizeof(frame_queue_t));
+    if (!queue)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    queue->slots = (queued_frame_t *)calloc(capacity, sizeof(queued_frame_t));
+    if (!queue->slots)
+    {
+        free(queue);
+        return ESP_ERR_NO_MEM;
+    }
+    queue->mask = capacity - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    *out_queue = queue;
+    return ESP_OK;
+}
+
+bool frame_queue_push(frame_queue_t *queue, const queued_frame_t *frame)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head > queue->mask)
+    {
+        return false;
+    }
+    queue->slots[tail & queue->mask] = *frame;
+    // Publish the slot before the consumer can see the new tail
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool frame_queue_pop(frame_queue_t *queue, queued_frame_t *out_frame)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail)
+    {
+        return false;
+    }
+    *out_frame = queue->slots[head & queue->mask];
+    // Hand the slot back to the producer only once it has been read
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+size_t frame_queue_depth(const frame_queue_t *queue)
+{
+    // Head first, so a push or pop between the two loads cannot make tail appear behind it
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    return tail - head;
+}
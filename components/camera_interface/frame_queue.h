@@ -0,0 +1,51 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+#include "camera_interface.h"
+
+typedef struct frame_queue frame_queue_t;
+
+// A queued frame and the detection window the sensor was reading out when it was taken
+typedef struct
+{
+    camera_fb_t *fb;
+    camera_window_t window;
+} queued_frame_t;
+
+/**
+ * @brief Allocate a bounded single-producer, single-consumer queue of frame buffers
+ *
+ * Push and pop are lock-free: exactly one task may push and exactly one other task may pop. Neither
+ * blocks; the caller decides what to do with a frame that does not fit and how to wait for one.
+ *
+ * @param capacity Frames the queue holds, a power of two
+ * @param out_queue Receives the queue
+ * @return ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_NO_MEM
+ */
+esp_err_t frame_queue_create(size_t capacity, frame_queue_t **out_queue);
+
+/**
+ * @brief Append a frame, from the producer
+ *
+ * @return false if the queue is full, in which case the caller still owns the frame
+ */
+bool frame_queue_push(frame_queue_t *queue, const queued_frame_t *frame);
+
+/**
+ * @brief Take the oldest frame, from the consumer
+ *
+ * @param out_frame Receives the frame
+ * @return false if the queue is empty
+ */
+bool frame_queue_pop(frame_queue_t *queue, queued_frame_t *out_frame);
+
+/**
+ * @brief Frames waiting, as seen at the moment of the call from either side
+ */
+size_t frame_queue_depth(const frame_queue_t *queue);
+
+#endif // FRAME_QUEUE_H
@@ -0,0 +1,179 @@
+#include "frame_ring.h"
+#include <string.h>
+#include "esp_heap_caps.h"
+
+// One stored frame. Frames are packed back to back in push order, wrapping to the start of the arena
+// when the next one does not fit before its end.
+typedef struct
+{
+    size_t offset;
+    size_t len;
+    uint16_t width;
+    uint16_t height;
+    struct timeval timestamp;
+} frame_ring_entry_t;
+
+struct frame_ring
+{
+    uint8_t *arena;
+    size_t capacity;
+    size_t write;                 // Where the next frame goes, just past the newest
+    frame_ring_entry_t *entries;  // Circular, indexed by sequence % max_frames
+    size_t max_frames;
+    uint32_t first;               // Sequence of the oldest frame
+    uint32_t next;                // Sequence the next frame gets
+    bool held;
+    uint32_t held_from;
+    frame_ring_stats_t stats;
+};
+
+static int64_t timestamp_us(const struct timeval *tv)
+{
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static size_t frame_count(const frame_ring_t *ring)
+{
+    return ring->next - ring->first;
+}
+
+static const frame_ring_entry_t *entry(const frame_ring_t *ring, uint32_t sequence)
+{
+    return &ring->entries[sequence % ring->max_frames];
+}
+
+esp_err_t frame_ring_create(size_t capacity_bytes, size_t max_frames, frame_ring_t **out_ring)
+{
+    if (capacity_bytes == 0 || max_frames == 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    frame_ring_t *ring = (frame_ring_t *)heap_caps_calloc(1, sizeof(frame_ring_t), MALLOC_CAP_SPIRAM);
+    if (!ring)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    ring->arena = (uint8_t *)heap_caps_malloc(capacity_bytes, MALLOC_CAP_SPIRAM);
+    ring->entries = (frame_ring_entry_t *)heap_caps_calloc(max_frames, sizeof(frame_ring_entry_t), MALLOC_CAP_SPIRAM);
+    if (!ring->arena || !ring->entries)
+    {
+        heap_caps_free(ring->arena);
+        heap_caps_free(ring->entries);
+        heap_caps_free(ring);
+        return ESP_ERR_NO_MEM;
+    }
+    ring->capacity = capacity_bytes;
+    ring->max_frames = max_frames;
+    *out_ring = ring;
+    return ESP_OK;
+}
+
+void frame_ring_destroy(frame_ring_t *ring)
+{
+    if (ring)
+    {
+        heap_caps_free(ring->arena);
+        heap_caps_free(ring->entries);
+        heap_caps_free(ring);
+    }
+}
+
+// Offset a frame of len bytes can be written at without touching a stored frame, or -1
+static long free_offset(const frame_ring_t *ring, size_t len)
+{
+    if (frame_count(ring) == 0)
+    {
+        return 0;
+    }
+    size_t head = entry(ring, ring->first)->offset;
+    if (ring->write > head)
+    {
+        // Stored frames span [head, write): room after them, or before them once wrapped
+        if (ring->write + len <= ring->capacity)
+        {
+            return (long)ring->write;
+        }
+        return len <= head ? 0 : -1;
+    }
+    // Wrapped: stored frames span [head, end) and [0, write)
+    return ring->write + len <= head ? (long)ring->write : -1;
+}
+
+bool frame_ring_push(frame_ring_t *ring, const camera_fb_t *fb, uint32_t *out_sequence)
+{
+    if (fb->len == 0 || fb->len > ring->capacity)
+    {
+        ring->stats.dropped++;
+        return false;
+    }
+    long offset;
+    while ((offset = free_offset(ring, fb->len)) < 0 || frame_count(ring) == ring->max_frames)
+    {
+        if (ring->held && (int32_t)(ring->first - ring->held_from) >= 0)
+        {
+            ring->stats.dropped++;
+            return false;
+        }
+        ring->first++;
+        ring->stats.evicted++;
+    }
+
+    frame_ring_entry_t *stored = &ring->entries[ring->next % ring->max_frames];
+    stored->offset = (size_t)offset;
+    stored->len = fb->len;
+    stored->width = (uint16_t)fb->width;
+    stored->height = (uint16_t)fb->height;
+    stored->timestamp = fb->timestamp;
+    memcpy(ring->arena + offset, fb->buf, fb->len);
+    ring->write = (size_t)offset + fb->len;
+    if (out_sequence)
+    {
+        *out_sequence = ring->next;
+    }
+    ring->next++;
+    ring->stats.pushed++;
+    return true;
+}
+
+bool frame_ring_get(const frame_ring_t *ring, uint32_t sequence, camera_fb_t *view)
+{
+    if ((int32_t)(sequence - ring->first) < 0 || (int32_t)(ring->next - sequence) <= 0)
+    {
+        return false;
+    }
+    const frame_ring_entry_t *stored = entry(ring, sequence);
+    memset(view, 0, sizeof(*view));
+    view->buf = ring->arena + stored->offset;
+    view->len = stored->len;
+    view->width = stored->width;
+    view->height = stored->height;
+    view->format = PIXFORMAT_JPEG;
+    view->timestamp = stored->timestamp;
+    return true;
+}
+
+uint32_t frame_ring_find(const frame_ring_t *ring, int64_t timestamp)
+{
+    uint32_t sequence = ring->first;
+    while (ring->next - sequence > 1 && timestamp_us(&entry(ring, sequence)->timestamp) < timestamp)
+    {
+        sequence++;
+    }
+    return sequence;
+}
+
+void frame_ring_hold(frame_ring_t *ring, uint32_t first_sequence)
+{
+    ring->held = true;
+    ring->held_from = first_sequence;
+}
+
+void frame_ring_release(frame_ring_t *ring)
+{
+    ring->held = false;
+}
+
+void frame_ring_get_stats(const frame_ring_t *ring, frame_ring_stats_t *stats)
+{
+    *stats = ring->stats;
+}
@@ -0,0 +1,79 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+
+// Counters since the ring was created
+typedef struct
+{
+    uint32_t pushed;  // Frames copied in
+    uint32_t evicted; // Oldest frames overwritten to make room
+    uint32_t dropped; // Frames refused: larger than the ring, or only room by evicting held frames
+} frame_ring_stats_t;
+
+typedef struct frame_ring frame_ring_t;
+
+/**
+ * @brief Allocate a ring of JPEG frames in PSRAM
+ *
+ * All memory is allocated here; pushing a frame copies it into the arena and never allocates.
+ *
+ * @param capacity_bytes Size of the arena frames are packed into
+ * @param max_frames Most frames held at once
+ * @param out_ring Receives the ring
+ * @return ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_NO_MEM
+ */
+esp_err_t frame_ring_create(size_t capacity_bytes, size_t max_frames, frame_ring_t **out_ring);
+
+/**
+ * @brief Free a ring and the frames in it; NULL is ignored
+ */
+void frame_ring_destroy(frame_ring_t *ring);
+
+/**
+ * @brief Copy a frame into the ring, evicting the oldest frames until it fits
+ *
+ * @param ring The ring
+ * @param fb Frame to copy; only buf, len, width, height and timestamp are kept
+ * @param out_sequence Receives the frame's sequence number, or NULL
+ * @return true if the frame was stored
+ */
+bool frame_ring_push(frame_ring_t *ring, const camera_fb_t *fb, uint32_t *out_sequence);
+
+/**
+ * @brief Point a camera_fb_t at a frame still in the ring
+ *
+ * The view stays valid until the frame is evicted, so hold it first if more frames will be pushed.
+ *
+ * @param ring The ring
+ * @param sequence Sequence number from frame_ring_push()
+ * @param view Receives the frame, with buf pointing into the ring
+ * @return true if the frame is still in the ring
+ */
+bool frame_ring_get(const frame_ring_t *ring, uint32_t sequence, camera_fb_t *view);
+
+/**
+ * @brief Sequence number of the oldest frame no older than timestamp_us, or of the newest frame if all
+ * are older
+ *
+ * @param ring The ring, which must not be empty
+ * @param timestamp_us Capture time in microseconds, the unit of camera_fb_t timestamps
+ */
+uint32_t frame_ring_find(const frame_ring_t *ring, int64_t timestamp_us);
+
+/**
+ * @brief Keep frames from first_sequence on from being evicted until frame_ring_release()
+ *
+ * While held, frames that only fit by evicting a held frame are dropped instead.
+ */
+void frame_ring_hold(frame_ring_t *ring, uint32_t first_sequence);
+
+void frame_ring_release(frame_ring_t *ring);
+
+void frame_ring_get_stats(const frame_ring_t *ring, frame_ring_stats_t *stats);
+
+#endif // FRAME_RING_H
@@ -6,11 +6,6 @@
 #include "esp_camera.h"
 #include "sensor.h"
 
-esp_err_t initialize_camera(void);
-esp_err_t takeHighResPhoto(time_t timestamp);
-
-void createCameraTask(void);
-
 typedef struct
 {
     uint16_t pid;
@@ -18,4 +13,116 @@ typedef struct
     framesize_t max_frame_size;
 } custom_sensor_info_t;
 
+// Time from the capture of the frame that triggered a detection to its high-resolution JPEG being in
+// hand, and frames lost to size switches
+typedef struct
+{
+    uint32_t captures;              // High-resolution photos taken
+    int64_t last_us;                // Latency of the latest photo
+    int64_t max_us;
+    int64_t total_us;               // Sum over all photos, for the mean
+    uint32_t switch_frames_dropped; // Frames still at detection size while switching up for a photo
+    uint32_t motion_frames_dropped; // Detection-stream frames skipped, mostly while returning from a photo
+    uint32_t burst_frames_dropped;  // Burst frames that found no room in PSRAM while the writer was behind
+    float last_burst_fps;           // Achieved rate of the latest burst of more than one frame
+} capture_latency_stats_t;
+
+// Frame flow from the capture task to the detection task
+typedef struct
+{
+    uint32_t captured;         // Frames taken from the driver
+    uint32_t processed;        // Frames the detection task has finished with
+    uint32_t dropped;          // Frames returned unprocessed because detection was behind or the window changed
+    uint32_t queue_high_water; // Most frames ever waiting for detection
+    float capture_fps;         // Achieved rates over the latest measurement period
+    float detection_fps;
+    float decode_ms;           // Mean JPEG to luma decode time per frame over the same period
+} camera_stream_stats_t;
+
+// A rectangle of the QVGA detection frame, in its pixel coordinates
+typedef struct
+{
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+} camera_window_t;
+
+esp_err_t initialize_camera(void);
+
+/**
+ * @brief Ask for a burst of high-resolution JPEGs to be taken and saved to the SD card, without
+ * restarting the camera driver
+ *
+ * A task of its own takes the burst, so this returns as soon as the burst is requested. The sensor
+ * switches to the capture size through its registers and the first frame at that size starts the
+ * burst. Frames are copied into PSRAM as they arrive and a background task writes them, so the SD card
+ * never delays the next frame. The writer scores each frame by the variance of its Laplacian and
+ * uploads only the sharpest; a single frame is saved and uploaded as before. The detection stream
+ * pauses while the sensor is at the capture size, for about frames times interval_ms. With
+ * CONFIG_SPAIA_PREROLL, or if the writer could not be started, one frame is taken and saved before
+ * returning instead.
+ *
+ * @param timestamp Wall-clock time of the detection, used as the file name
+ * @param trigger_us Capture time of the triggering frame, in esp_timer_get_time() units, for the latency
+ * statistics
+ * @param frames Frames in the burst, 1 to 16
+ * @param interval_ms Time between frames, or 0 for every frame the sensor delivers
+ * @return ESP_OK once the burst is requested, ESP_ERR_INVALID_ARG, or ESP_FAIL if an earlier request is
+ * still waiting or, for a single photo taken here, no frame at the capture size arrived
+ */
+esp_err_t takeHighResBurst(time_t timestamp, int64_t trigger_us, size_t frames, uint32_t interval_ms);
+
+/**
+ * @brief Take a single high-resolution JPEG, a burst of one frame
+ */
+esp_err_t takeHighResPhoto(time_t timestamp, int64_t trigger_us);
+
+/**
+ * @brief Copy the capture latency statistics
+ */
+void camera_get_capture_latency(capture_latency_stats_t *stats);
+
+/**
+ * @brief Have the sensor read out only part of the frame for motion detection
+ *
+ * On the OV5640 the sensor's own window follows the rectangle, with 2x2 binning and a shorter frame,
+ * which raises the frame rate it can reach. On the OV2640 the DSP crops it, so only DMA, JPEG and
+ * decoding shrink. Either way the output keeps the full frame's scale and the decoded rectangle lands
+ * at its place in the detection frame, so motion boxes stay in full-frame coordinates. Pixels outside
+ * it keep their last values, so the detection task installs a matching region of interest mask in
+ * slot 0, replacing any mask there, and the detector neither compares them nor samples them for
+ * lighting changes. This suits a rectangle around the ROI mask.
+ *
+ * @param window Rectangle to read, grown to a 16-pixel grid; NULL for the whole frame
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_NOT_SUPPORTED for other sensors or with the pre-roll
+ * ring enabled, or ESP_FAIL if the sensor rejected it
+ */
+esp_err_t camera_set_detection_window(const camera_window_t *window);
+
+/**
+ * @brief Copy the window in use, after rounding to the grid
+ */
+void camera_get_detection_window(camera_window_t *window);
+
+/**
+ * @brief Bounding rectangle of the enabled pixels of a QVGA region of interest mask
+ *
+ * @param mask 320 * 240 bytes, nonzero where detection is enabled, as for motion_detector_set_roi()
+ * @param window Receives the rectangle
+ * @return ESP_OK, or ESP_ERR_NOT_FOUND if no pixel is enabled
+ */
+esp_err_t camera_window_from_mask(const uint8_t *mask, camera_window_t *window);
+
+/**
+ * @brief Copy the capture and detection frame rates and queue statistics
+ */
+void camera_get_stream_stats(camera_stream_stats_t *stats);
+
+/**
+ * @brief Start the capture task, which paces frames at CONFIG_SPAIA_TARGET_FPS, and the detection task
+ * it queues them to
+ */
+void createCameraTask(void);
+
 #endif // CAMERA_INTERFACE_H
\ No newline at end of file
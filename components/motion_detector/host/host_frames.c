@@ -0,0 +1,163 @@
+#include "host_frames.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool is_frame_file(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    return ext && (strcmp(ext, ".pgm") == 0 || strcmp(ext, ".y8") == 0 || strcmp(ext, ".raw") == 0);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+bool list_frames(const char *directory, FrameList *list)
+{
+    list->paths = NULL;
+    list->count = 0;
+
+    DIR *dir = opendir(directory);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Failed to open directory %s\n", directory);
+        return false;
+    }
+
+    size_t capacity = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (!is_frame_file(ent->d_name))
+        {
+            continue;
+        }
+        if (list->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            char **paths = realloc(list->paths, capacity * sizeof(char *));
+            if (paths == NULL)
+            {
+                closedir(dir);
+                free_frame_list(list);
+                return false;
+            }
+            list->paths = paths;
+        }
+        size_t length = strlen(directory) + strlen(ent->d_name) + 2;
+        char *path = malloc(length);
+        if (path == NULL)
+        {
+            closedir(dir);
+            free_frame_list(list);
+            return false;
+        }
+        snprintf(path, length, "%s/%s", directory, ent->d_name);
+        list->paths[list->count++] = path;
+    }
+    closedir(dir);
+
+    qsort(list->paths, list->count, sizeof(char *), compare_paths);
+    return true;
+}
+
+void free_frame_list(FrameList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    list->paths = NULL;
+    list->count = 0;
+}
+
+// Read the next PGM header number, skipping whitespace and comments
+static bool read_pgm_number(FILE *fp, size_t *value)
+{
+    int c = fgetc(fp);
+    while (c != EOF && (isspace(c) || c == '#'))
+    {
+        if (c == '#')
+        {
+            while (c != EOF && c != '\n')
+            {
+                c = fgetc(fp);
+            }
+        }
+        c = fgetc(fp);
+    }
+    if (!isdigit(c))
+    {
+        return false;
+    }
+    *value = 0;
+    while (isdigit(c))
+    {
+        *value = *value * 10 + (size_t)(c - '0');
+        c = fgetc(fp);
+    }
+    // A single whitespace character separates the header from the pixels
+    return c != EOF;
+}
+
+bool load_frame(const char *path, size_t raw_width, size_t raw_height,
+                uint8_t **pixels, size_t *capacity, size_t *width, size_t *height)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return false;
+    }
+
+    const char *ext = strrchr(path, '.');
+    if (ext && strcmp(ext, ".pgm") == 0)
+    {
+        size_t max_value = 0;
+        if (fgetc(fp) != 'P' || fgetc(fp) != '5' ||
+            !read_pgm_number(fp, width) || !read_pgm_number(fp, height) || !read_pgm_number(fp, &max_value) ||
+            max_value > 255)
+        {
+            fprintf(stderr, "%s is not an 8-bit binary PGM\n", path);
+            fclose(fp);
+            return false;
+        }
+    }
+    else
+    {
+        if (raw_width == 0 || raw_height == 0)
+        {
+            fprintf(stderr, "%s is raw Y8; pass --width and --height\n", path);
+            fclose(fp);
+            return false;
+        }
+        *width = raw_width;
+        *height = raw_height;
+    }
+
+    size_t size = *width * *height;
+    if (size > *capacity)
+    {
+        uint8_t *grown = realloc(*pixels, size);
+        if (grown == NULL)
+        {
+            fclose(fp);
+            return false;
+        }
+        *pixels = grown;
+        *capacity = size;
+    }
+
+    bool ok = fread(*pixels, 1, size, fp) == size;
+    if (!ok)
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+    }
+    fclose(fp);
+    return ok;
+}
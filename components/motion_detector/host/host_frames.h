@@ -0,0 +1,46 @@
+#ifndef HOST_FRAMES_H
+#define HOST_FRAMES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sorted list of frame files found in a directory
+typedef struct
+{
+    char **paths;
+    size_t count;
+} FrameList;
+
+/**
+ * @brief Collect the .pgm, .y8 and .raw files in a directory, sorted by name
+ *
+ * @param directory Directory to scan
+ * @param list Output list, release with free_frame_list()
+ * @return true on success
+ */
+bool list_frames(const char *directory, FrameList *list);
+
+/**
+ * @brief Release a list returned by list_frames()
+ */
+void free_frame_list(FrameList *list);
+
+/**
+ * @brief Load one 8-bit luminance frame
+ *
+ * Binary PGM (P5) files carry their own size. Raw Y8 files (.y8, .raw) use raw_width and raw_height.
+ *
+ * @param path File to load
+ * @param raw_width Width for raw files
+ * @param raw_height Height for raw files
+ * @param pixels Output buffer, reallocated as needed
+ * @param capacity Size of pixels in bytes, updated on reallocation
+ * @param width Output width
+ * @param height Output height
+ * @return true on success
+ */
+bool load_frame(const char *path, size_t raw_width, size_t raw_height,
+                uint8_t **pixels, size_t *capacity, size_t *width, size_t *height);
+
+#endif // HOST_FRAMES_H
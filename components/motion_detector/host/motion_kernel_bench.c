@@ -0,0 +1,781 @@
+// Microbenchmark for the motion kernels on synthetic QVGA frames.
+//
+// Reports Mpixel/s for the scalar reference and the compile-time selected kernel, checks that
+// they agree bit for bit with and without a region of interest, and compares the Q8.8 background against a float EMA reference.
+// Checks the packed mask open and close against a per-pixel reference on random masks.
+// Then runs whole detectors in pixel, tile and pyramid mode over the same frames and compares their cost and box accuracy,
+// and measures the quadratic pixel clustering the labeler replaced against the labeler's boxes.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "motion_detector.h"
+#include "motion_kernels.h"
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+#define BENCH_WIDTH 320
+#define BENCH_HEIGHT 240
+#define BENCH_FRAMES 200
+#define BENCH_SHIFT 4
+#define BENCH_FOREGROUND_SHIFT 8
+#define BENCH_THRESHOLD 50
+#define BENCH_TILE_SHIFT 3
+#define BENCH_SQUARE_SIZE 40
+#define BENCH_SQUARE_Y 100
+#define BENCH_TEXTURE_AMPLITUDE 60 // Textured scene: each pixel offset by up to this many grey levels
+#define BENCH_MASK_ROUNDS 20 // Random masks per size and density in the open/close check
+#define BENCH_FRAME_BOXES 8  // Labeler boxes kept per frame to compare the legacy clustering against
+#define BENCH_AGREEMENT_IOU 0.9f // A legacy box agrees with a labeler box overlapping it at least this much
+#define LEGACY_MAX_BOXES 30  // Settings of the legacy clustering and its filters
+#define LEGACY_CLUSTER_DISTANCE 20
+#define LEGACY_MAX_AREA 10000
+#define LEGACY_MIN_AREA 200
+#define LEGACY_IOU 0.3f
+
+typedef void (*DiffRowKernel)(uint16_t *, const uint8_t *, uint32_t *, const uint32_t *, size_t, uint8_t,
+                              unsigned, unsigned);
+typedef void (*TileRowKernel)(uint16_t *, const uint8_t *, uint32_t *, const uint32_t *, size_t, unsigned, uint8_t,
+                              unsigned, unsigned);
+typedef void (*DownscaleKernel)(const uint8_t *, size_t, size_t, unsigned, uint8_t *);
+
+// Boxes a detector reported for one frame
+typedef struct
+{
+    BoundingBox boxes[BENCH_FRAME_BOXES];
+    size_t count;
+} FrameBoxes;
+
+// Accuracy against the moving square, summed over frames
+typedef struct
+{
+    int found;
+    int extra;      // Boxes that miss the square
+    double total_iou;
+    double total_edge_error;
+} BoxScore;
+
+static uint32_t rng_state = 12345;
+
+static uint32_t next_random(void)
+{
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+// The static scene: a gradient, with fine high-contrast texture on top if textured, like gravel or foliage
+static int scene_luma(int x, int y, bool textured)
+{
+    int value = 40 + (x + y) / 4;
+    if (textured)
+    {
+        uint32_t hash = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u;
+        hash ^= hash >> 13;
+        value += (int)((hash * 2654435761u) >> 24) % (2 * BENCH_TEXTURE_AMPLITUDE + 1) - BENCH_TEXTURE_AMPLITUDE;
+    }
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// The scene with sensor noise and a bright square moving across it
+static void make_frame(uint8_t *frame, int index, bool textured)
+{
+    int square_x = (index * 3) % (BENCH_WIDTH - BENCH_SQUARE_SIZE);
+    for (int y = 0; y < BENCH_HEIGHT; y++)
+    {
+        for (int x = 0; x < BENCH_WIDTH; x++)
+        {
+            int value = scene_luma(x, y, textured) + (int)(next_random() % 7) - 3;
+            if (x >= square_x && x < square_x + BENCH_SQUARE_SIZE && y >= BENCH_SQUARE_Y &&
+                y < BENCH_SQUARE_Y + BENCH_SQUARE_SIZE)
+            {
+                value = 220;
+            }
+            frame[y * BENCH_WIDTH + x] = (uint8_t)(value < 0 ? 0 : (value > 255 ? 255 : value));
+        }
+    }
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static double bench_diff(DiffRowKernel kernel, uint8_t **frames, uint16_t *background, uint32_t *mask,
+                         const uint32_t *roi)
+{
+    size_t stride = (BENCH_WIDTH + 31) / 32;
+    double start = now_us();
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        for (int y = 0; y < BENCH_HEIGHT; y++)
+        {
+            kernel(background + y * BENCH_WIDTH, frames[f] + y * BENCH_WIDTH, mask + y * stride,
+                   roi ? roi + y * stride : NULL, BENCH_WIDTH, BENCH_THRESHOLD, BENCH_SHIFT, BENCH_FOREGROUND_SHIFT);
+        }
+    }
+    return (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_FRAMES / (now_us() - start);
+}
+
+static double bench_tile(TileRowKernel kernel, uint8_t **frames, uint16_t *background, uint32_t *sums,
+                         const uint32_t *roi_tiles)
+{
+    size_t tile_stride = ((BENCH_WIDTH >> BENCH_TILE_SHIFT) + 31) / 32;
+    double start = now_us();
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        for (int y = 0; y < BENCH_HEIGHT; y++)
+        {
+            uint32_t *tile_row = sums + (y >> BENCH_TILE_SHIFT) * (BENCH_WIDTH >> BENCH_TILE_SHIFT);
+            const uint32_t *roi_row = roi_tiles ? roi_tiles + (y >> BENCH_TILE_SHIFT) * tile_stride : NULL;
+            kernel(background + y * BENCH_WIDTH, frames[f] + y * BENCH_WIDTH, tile_row, roi_row, BENCH_WIDTH,
+                   BENCH_TILE_SHIFT, BENCH_THRESHOLD, BENCH_SHIFT, BENCH_FOREGROUND_SHIFT);
+        }
+    }
+    return (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_FRAMES / (now_us() - start);
+}
+
+static double bench_downscale(DownscaleKernel kernel, uint8_t **frames, unsigned shift, uint8_t *out)
+{
+    size_t block = (size_t)1 << shift;
+    size_t coarse_width = BENCH_WIDTH >> shift;
+    double start = now_us();
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        for (size_t y = 0; y < BENCH_HEIGHT; y += block)
+        {
+            kernel(frames[f] + y * BENCH_WIDTH, BENCH_WIDTH, block, shift, out + (y >> shift) * coarse_width);
+        }
+    }
+    return (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_FRAMES / (now_us() - start);
+}
+
+// Score the first box that overlaps the square in frame f, and count the boxes that miss it
+static void score_boxes(BoxScore *score, const BoundingBox *boxes, size_t box_count, int f)
+{
+    size_t square_x = (size_t)((f * 3) % (BENCH_WIDTH - BENCH_SQUARE_SIZE));
+    BoundingBox truth = {square_x, BENCH_SQUARE_Y, square_x + BENCH_SQUARE_SIZE - 1,
+                         BENCH_SQUARE_Y + BENCH_SQUARE_SIZE - 1};
+    bool matched = false;
+    for (size_t b = 0; b < box_count; b++)
+    {
+        BoundingBox box = boxes[b];
+        float iou = calculate_iou(box, truth);
+        if (iou == 0)
+        {
+            score->extra++;
+        }
+        else if (!matched)
+        {
+            matched = true;
+            score->found++;
+            score->total_iou += iou;
+            score->total_edge_error += (fabs((double)box.x_min - truth.x_min) + fabs((double)box.y_min - truth.y_min) +
+                                        fabs((double)box.x_max - truth.x_max) + fabs((double)box.y_max - truth.y_max)) / 4;
+        }
+    }
+}
+
+static void print_score(const BoxScore *score)
+{
+    printf("found %3d/%d  IoU %.3f  edge error %.2f px  stray boxes %d\n", score->found, BENCH_FRAMES,
+           score->found ? score->total_iou / score->found : 0, score->found ? score->total_edge_error / score->found : 0,
+           score->extra);
+}
+
+// Run a detector over all frames, after a static warm-up, and score its boxes against the square. If
+// recorded is set, each frame's boxes are kept in it.
+static void bench_detector(const char *name, MotionDetectionMode mode, unsigned pyramid_shift, uint8_t **frames,
+                           uint8_t *background_frame, FrameBoxes *recorded)
+{
+    MotionDetectorConfig config;
+    motion_detector_default_config(&config, BENCH_WIDTH, BENCH_HEIGHT);
+    config.mode = mode;
+    config.pyramid_shift = (uint8_t)pyramid_shift;
+    config.stripes = 1;
+    config.staging.sample_step = 1; // Every frame gets the full pass, so the cost compares like for like
+    MotionDetector *detector;
+    if (motion_detector_create(&config, &detector) != ESP_OK)
+    {
+        printf("%-14s cannot create detector\n", name);
+        return;
+    }
+
+    camera_fb_t frame = {.len = BENCH_WIDTH * BENCH_HEIGHT, .width = BENCH_WIDTH, .height = BENCH_HEIGHT,
+                         .format = PIXFORMAT_GRAYSCALE};
+    MotionResult result;
+    frame.buf = background_frame;
+    for (uint32_t i = 0; i < config.init_frames + 8; i++)
+    {
+        motion_detector_process(detector, &frame, &result);
+    }
+
+    double total_us = 0;
+    size_t total_bytes = 0;
+    BoxScore score = {0};
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        frame.buf = frames[f];
+        double start = now_us();
+        motion_detector_process(detector, &frame, &result);
+        total_us += now_us() - start;
+        total_bytes += result.bytes_touched;
+        score_boxes(&score, result.boxes, result.box_count, f);
+        if (recorded)
+        {
+            recorded[f].count = result.box_count < BENCH_FRAME_BOXES ? result.box_count : BENCH_FRAME_BOXES;
+            memcpy(recorded[f].boxes, result.boxes, recorded[f].count * sizeof(BoundingBox));
+        }
+    }
+    printf("%-14s %8.1f us/frame %8zu bytes/frame  ", name, total_us / BENCH_FRAMES, total_bytes / BENCH_FRAMES);
+    print_score(&score);
+    motion_detector_destroy(detector);
+}
+
+// The clustering the detector used before connected-component labeling, kept to measure the labeler
+// against. Every changed pixel, until the box cap, grows a box over the changed pixels within
+// LEGACY_CLUSTER_DISTANCE of it, which is quadratic in the changed pixels; the boxes then go through
+// the filters of that time, which shift the array on every removal.
+static size_t legacy_cluster_boxes(const uint8_t *frame, const uint8_t *background, size_t *pixel_x, size_t *pixel_y,
+                                   BoundingBox *boxes)
+{
+    size_t changed_pixels = 0;
+    for (size_t i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++)
+    {
+        if (abs((int)background[i] - (int)frame[i]) > BENCH_THRESHOLD)
+        {
+            pixel_x[changed_pixels] = i % BENCH_WIDTH;
+            pixel_y[changed_pixels] = i / BENCH_WIDTH;
+            changed_pixels++;
+        }
+    }
+
+    size_t box_count = 0;
+    for (size_t i = 0; i < changed_pixels && box_count < LEGACY_MAX_BOXES; i++)
+    {
+        BoundingBox box = {.x_min = pixel_x[i], .y_min = pixel_y[i], .x_max = pixel_x[i], .y_max = pixel_y[i]};
+        for (size_t j = i + 1; j < changed_pixels; j++)
+        {
+            if (abs((int)pixel_x[i] - (int)pixel_x[j]) < LEGACY_CLUSTER_DISTANCE &&
+                abs((int)pixel_y[i] - (int)pixel_y[j]) < LEGACY_CLUSTER_DISTANCE)
+            {
+                if (pixel_x[j] < box.x_min)
+                    box.x_min = pixel_x[j];
+                if (pixel_y[j] < box.y_min)
+                    box.y_min = pixel_y[j];
+                if (pixel_x[j] > box.x_max)
+                    box.x_max = pixel_x[j];
+                if (pixel_y[j] > box.y_max)
+                    box.y_max = pixel_y[j];
+            }
+        }
+        boxes[box_count++] = box;
+    }
+
+    // Large boxes out, then overlapping boxes merged, then small and edge-touching boxes out
+    for (size_t i = 0; i < box_count;)
+    {
+        bool remove = (boxes[i].x_max - boxes[i].x_min) * (boxes[i].y_max - boxes[i].y_min) > LEGACY_MAX_AREA;
+        if (remove)
+        {
+            memmove(&boxes[i], &boxes[i + 1], (box_count - i - 1) * sizeof(BoundingBox));
+            box_count--;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < box_count; i++)
+    {
+        for (size_t j = i + 1; j < box_count; j++)
+        {
+            if (calculate_iou(boxes[i], boxes[j]) > LEGACY_IOU)
+            {
+                boxes[i].x_min = boxes[i].x_min < boxes[j].x_min ? boxes[i].x_min : boxes[j].x_min;
+                boxes[i].y_min = boxes[i].y_min < boxes[j].y_min ? boxes[i].y_min : boxes[j].y_min;
+                boxes[i].x_max = boxes[i].x_max > boxes[j].x_max ? boxes[i].x_max : boxes[j].x_max;
+                boxes[i].y_max = boxes[i].y_max > boxes[j].y_max ? boxes[i].y_max : boxes[j].y_max;
+                memmove(&boxes[j], &boxes[j + 1], (box_count - j - 1) * sizeof(BoundingBox));
+                box_count--;
+                j--;
+            }
+        }
+    }
+    for (size_t i = 0; i < box_count;)
+    {
+        BoundingBox box = boxes[i];
+        bool remove = (box.x_max - box.x_min) * (box.y_max - box.y_min) < LEGACY_MIN_AREA || box.x_min == 0 ||
+                      box.y_min == 0 || box.x_max == BENCH_WIDTH - 1 || box.y_max == BENCH_HEIGHT - 1;
+        if (remove)
+        {
+            memmove(&boxes[i], &boxes[i + 1], (box_count - i - 1) * sizeof(BoundingBox));
+            box_count--;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    return box_count;
+}
+
+// Time the legacy clustering on the same frames the pixel-mode labeler saw, thresholded against the
+// static scene, and report how often its boxes agree with the labeler's
+static void bench_legacy_clustering(uint8_t **frames, const uint8_t *background_frame, const FrameBoxes *labeled)
+{
+    size_t *pixel_x = malloc(BENCH_WIDTH * BENCH_HEIGHT * sizeof(size_t));
+    size_t *pixel_y = malloc(BENCH_WIDTH * BENCH_HEIGHT * sizeof(size_t));
+    if (!pixel_x || !pixel_y)
+    {
+        free(pixel_x);
+        free(pixel_y);
+        return;
+    }
+    double total_us = 0;
+    BoxScore score = {0};
+    int agreeing_frames = 0;
+    double total_best_iou = 0;
+    size_t legacy_boxes = 0;
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        BoundingBox boxes[LEGACY_MAX_BOXES];
+        double start = now_us();
+        size_t box_count = legacy_cluster_boxes(frames[f], background_frame, pixel_x, pixel_y, boxes);
+        total_us += now_us() - start;
+        score_boxes(&score, boxes, box_count, f);
+
+        // A frame agrees when both report the same number of boxes and each legacy box has a close match
+        bool agrees = box_count == labeled[f].count;
+        for (size_t b = 0; b < box_count; b++)
+        {
+            float best = 0;
+            for (size_t l = 0; l < labeled[f].count; l++)
+            {
+                float iou = calculate_iou(boxes[b], labeled[f].boxes[l]);
+                best = iou > best ? iou : best;
+            }
+            agrees &= best >= BENCH_AGREEMENT_IOU;
+            total_best_iou += best;
+        }
+        legacy_boxes += box_count;
+        agreeing_frames += agrees;
+    }
+    printf("%-14s %8.1f us/frame (clustering only)  ", "legacy", total_us / BENCH_FRAMES);
+    print_score(&score);
+    printf("  vs labeler: %d/%d frames agree, mean IoU of each legacy box with its best labeler box %.3f\n",
+           agreeing_frames, BENCH_FRAMES, legacy_boxes ? total_best_iou / legacy_boxes : 0);
+    free(pixel_x);
+    free(pixel_y);
+}
+
+// Left half of the frame plus every third tile column enabled, so both skipped words and partial
+// 16-pixel chunks are exercised
+static void make_roi(uint32_t *roi, uint32_t *roi_tiles)
+{
+    size_t stride = (BENCH_WIDTH + 31) / 32;
+    size_t tiles_x = BENCH_WIDTH >> BENCH_TILE_SHIFT;
+    size_t tile_stride = (tiles_x + 31) / 32;
+    memset(roi, 0, stride * BENCH_HEIGHT * sizeof(uint32_t));
+    memset(roi_tiles, 0, tile_stride * (BENCH_HEIGHT >> BENCH_TILE_SHIFT) * sizeof(uint32_t));
+    for (size_t y = 0; y < BENCH_HEIGHT; y++)
+    {
+        for (size_t x = 0; x < BENCH_WIDTH; x++)
+        {
+            size_t tx = x >> BENCH_TILE_SHIFT;
+            if (x < BENCH_WIDTH / 2 || tx % 3 == 0)
+            {
+                roi[y * stride + (x >> 5)] |= 1u << (x & 31);
+                roi_tiles[(y >> BENCH_TILE_SHIFT) * tile_stride + (tx >> 5)] |= 1u << (tx & 31);
+            }
+        }
+    }
+}
+
+// Per-pixel 3x3 erosion or dilation of a packed mask, pixels outside the frame taken as outside_changed
+static void reference_morph(const uint32_t *src, uint32_t *dst, size_t stride, size_t width, size_t height,
+                            bool dilate, bool outside_changed)
+{
+    memset(dst, 0, stride * height * sizeof(uint32_t));
+    for (int y = 0; y < (int)height; y++)
+    {
+        for (int x = 0; x < (int)width; x++)
+        {
+            bool result = !dilate;
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    int nx = x + dx;
+                    int ny = y + dy;
+                    bool set = outside_changed;
+                    if (nx >= 0 && nx < (int)width && ny >= 0 && ny < (int)height)
+                    {
+                        set = (src[ny * stride + (nx >> 5)] >> (nx & 31)) & 1;
+                    }
+                    result = dilate ? (result || set) : (result && set);
+                }
+            }
+            if (result)
+            {
+                dst[y * stride + (x >> 5)] |= 1u << (x & 31);
+            }
+        }
+    }
+}
+
+// Open, then close if asked, in place, the way the detector filters its change mask: per pixel, or
+// with the packed kernels as separate horizontal and vertical passes
+static void filter_mask(uint32_t *mask, uint32_t *scratch, size_t stride, size_t width, size_t height, bool close,
+                        bool packed)
+{
+    static const bool steps[4][2] = {{false, false}, {true, false}, {true, false}, {false, true}};
+    for (size_t i = 0; i < (close ? 4u : 2u); i++)
+    {
+        bool dilate = steps[i][0];
+        bool outside_changed = steps[i][1];
+        if (packed)
+        {
+            motion_kernel_mask_horizontal_pass(mask, scratch, stride, width, height, dilate, outside_changed);
+            motion_kernel_mask_vertical_pass(scratch, mask, stride, 0, height, height, dilate, outside_changed);
+        }
+        else
+        {
+            reference_morph(mask, scratch, stride, width, height, dilate, outside_changed);
+            memcpy(mask, scratch, stride * height * sizeof(uint32_t));
+        }
+    }
+}
+
+// Set each pixel of a packed mask with the given probability in percent
+static void make_random_mask(uint32_t *mask, size_t width, size_t height, unsigned density)
+{
+    size_t stride = (width + 31) / 32;
+    memset(mask, 0, stride * height * sizeof(uint32_t));
+    for (size_t y = 0; y < height; y++)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            if (next_random() % 100 < density)
+            {
+                mask[y * stride + (x >> 5)] |= 1u << (x & 31);
+            }
+        }
+    }
+}
+
+// Random masks of a few sizes, including widths that end mid-word, at sparse, even and dense fill.
+// Returns whether the packed open and open-close matched the reference on all of them.
+static bool check_mask_filter(void)
+{
+    static const size_t sizes[][2] = {{BENCH_WIDTH, BENCH_HEIGHT}, {77, 23}, {32, 7}, {31, 1}, {1, 5}};
+    static const unsigned densities[] = {5, 50, 95};
+    size_t max_words = (BENCH_WIDTH + 31) / 32 * BENCH_HEIGHT;
+    uint32_t *original = malloc(max_words * sizeof(uint32_t));
+    uint32_t *packed = malloc(max_words * sizeof(uint32_t));
+    uint32_t *reference = malloc(max_words * sizeof(uint32_t));
+    uint32_t *scratch = malloc(max_words * sizeof(uint32_t));
+    if (!original || !packed || !reference || !scratch)
+    {
+        return false;
+    }
+    size_t checked = 0;
+    size_t mismatched = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t width = sizes[s][0];
+        size_t height = sizes[s][1];
+        size_t words = (width + 31) / 32 * height;
+        for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++)
+        {
+            for (int round = 0; round < BENCH_MASK_ROUNDS; round++)
+            {
+                make_random_mask(original, width, height, densities[d]);
+                for (int close = 0; close <= 1; close++)
+                {
+                    memcpy(packed, original, words * sizeof(uint32_t));
+                    memcpy(reference, original, words * sizeof(uint32_t));
+                    filter_mask(packed, scratch, (width + 31) / 32, width, height, close, true);
+                    filter_mask(reference, scratch, (width + 31) / 32, width, height, close, false);
+                    checked++;
+                    mismatched += memcmp(packed, reference, words * sizeof(uint32_t)) != 0;
+                }
+            }
+        }
+    }
+
+    // Speed on full frames at even fill
+    make_random_mask(original, BENCH_WIDTH, BENCH_HEIGHT, 50);
+    double elapsed[2];
+    for (int is_packed = 0; is_packed <= 1; is_packed++)
+    {
+        double start = now_us();
+        for (int round = 0; round < BENCH_MASK_ROUNDS; round++)
+        {
+            memcpy(packed, original, max_words * sizeof(uint32_t));
+            filter_mask(packed, scratch, (BENCH_WIDTH + 31) / 32, BENCH_WIDTH, BENCH_HEIGHT, true, is_packed);
+        }
+        elapsed[is_packed] = now_us() - start;
+    }
+    double frame_pixels = (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_MASK_ROUNDS;
+    printf("mask open+close   per-pixel %6.1f Mpixel/s  packed %8.1f Mpixel/s  matches reference: %s (%zu masks)\n",
+           frame_pixels / elapsed[0], frame_pixels / elapsed[1], mismatched == 0 ? "yes" : "NO", checked);
+    free(original);
+    free(packed);
+    free(reference);
+    free(scratch);
+    return mismatched == 0;
+}
+
+static void seed_background(uint16_t *background, const uint8_t *frame)
+{
+    for (size_t i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++)
+    {
+        background[i] = (uint16_t)(frame[i] << 8);
+    }
+}
+
+int main(void)
+{
+    size_t pixels = BENCH_WIDTH * BENCH_HEIGHT;
+    size_t mask_words = (BENCH_WIDTH + 31) / 32 * BENCH_HEIGHT;
+    size_t tiles = (BENCH_WIDTH >> BENCH_TILE_SHIFT) * (BENCH_HEIGHT >> BENCH_TILE_SHIFT);
+    uint8_t *frames[BENCH_FRAMES];
+    uint16_t *bg_reference = malloc(pixels * sizeof(uint16_t));
+    uint16_t *bg_selected = malloc(pixels * sizeof(uint16_t));
+    uint32_t *mask_reference = malloc(mask_words * sizeof(uint32_t));
+    uint32_t *mask_selected = malloc(mask_words * sizeof(uint32_t));
+    uint32_t *sums_reference = calloc(tiles, sizeof(uint32_t));
+    uint32_t *sums_selected = calloc(tiles, sizeof(uint32_t));
+    float *bg_float = malloc(pixels * sizeof(float));
+    uint32_t *roi = malloc(mask_words * sizeof(uint32_t));
+    uint32_t *roi_tiles = malloc(tiles * sizeof(uint32_t));
+    if (!bg_reference || !bg_selected || !mask_reference || !mask_selected || !sums_reference || !sums_selected ||
+        !bg_float || !roi || !roi_tiles)
+    {
+        return 1;
+    }
+    make_roi(roi, roi_tiles);
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        frames[f] = malloc(pixels);
+        if (!frames[f])
+        {
+            return 1;
+        }
+        make_frame(frames[f], f, false);
+    }
+
+    printf("kernel: %s, %dx%d, %d frames\n", motion_kernel_name(), BENCH_WIDTH, BENCH_HEIGHT, BENCH_FRAMES);
+
+    // Fused diff kernels: speed and bit-exactness
+    seed_background(bg_reference, frames[0]);
+    seed_background(bg_selected, frames[0]);
+    double scalar_rate = bench_diff(motion_kernel_update_diff_row_scalar, frames, bg_reference, mask_reference, NULL);
+    double selected_rate = bench_diff(motion_kernel_update_diff_row, frames, bg_selected, mask_selected, NULL);
+    bool diff_exact = memcmp(bg_reference, bg_selected, pixels * sizeof(uint16_t)) == 0 &&
+                      memcmp(mask_reference, mask_selected, mask_words * sizeof(uint32_t)) == 0;
+    printf("update_diff_row   scalar %8.1f Mpixel/s  %-6s %8.1f Mpixel/s  bit-exact: %s\n",
+           scalar_rate, motion_kernel_name(), selected_rate, diff_exact ? "yes" : "NO");
+
+    seed_background(bg_reference, frames[0]);
+    seed_background(bg_selected, frames[0]);
+    scalar_rate = bench_diff(motion_kernel_update_diff_row_scalar, frames, bg_reference, mask_reference, roi);
+    selected_rate = bench_diff(motion_kernel_update_diff_row, frames, bg_selected, mask_selected, roi);
+    diff_exact &= memcmp(bg_reference, bg_selected, pixels * sizeof(uint16_t)) == 0 &&
+                  memcmp(mask_reference, mask_selected, mask_words * sizeof(uint32_t)) == 0;
+    printf("  with roi        scalar %8.1f Mpixel/s  %-6s %8.1f Mpixel/s  bit-exact: %s\n",
+           scalar_rate, motion_kernel_name(), selected_rate, diff_exact ? "yes" : "NO");
+
+    // Tile kernels
+    seed_background(bg_reference, frames[0]);
+    seed_background(bg_selected, frames[0]);
+    scalar_rate = bench_tile(motion_kernel_update_tile_row_scalar, frames, bg_reference, sums_reference, NULL);
+    selected_rate = bench_tile(motion_kernel_update_tile_row, frames, bg_selected, sums_selected, NULL);
+    bool tile_exact = memcmp(bg_reference, bg_selected, pixels * sizeof(uint16_t)) == 0 &&
+                      memcmp(sums_reference, sums_selected, tiles * sizeof(uint32_t)) == 0;
+    printf("update_tile_row   scalar %8.1f Mpixel/s  %-6s %8.1f Mpixel/s  bit-exact: %s\n",
+           scalar_rate, motion_kernel_name(), selected_rate, tile_exact ? "yes" : "NO");
+
+    seed_background(bg_reference, frames[0]);
+    seed_background(bg_selected, frames[0]);
+    memset(sums_reference, 0, tiles * sizeof(uint32_t));
+    memset(sums_selected, 0, tiles * sizeof(uint32_t));
+    scalar_rate = bench_tile(motion_kernel_update_tile_row_scalar, frames, bg_reference, sums_reference, roi_tiles);
+    selected_rate = bench_tile(motion_kernel_update_tile_row, frames, bg_selected, sums_selected, roi_tiles);
+    tile_exact &= memcmp(bg_reference, bg_selected, pixels * sizeof(uint16_t)) == 0 &&
+                  memcmp(sums_reference, sums_selected, tiles * sizeof(uint32_t)) == 0;
+    printf("  with roi        scalar %8.1f Mpixel/s  %-6s %8.1f Mpixel/s  bit-exact: %s\n",
+           scalar_rate, motion_kernel_name(), selected_rate, tile_exact ? "yes" : "NO");
+
+    // Downscale kernels for pyramid mode, 2x and 4x
+    bool downscale_exact = true;
+    uint8_t *coarse_reference = malloc(pixels / 4);
+    uint8_t *coarse_selected = malloc(pixels / 4);
+    if (!coarse_reference || !coarse_selected)
+    {
+        return 1;
+    }
+    for (unsigned shift = 1; shift <= 2; shift++)
+    {
+        size_t coarse_pixels = pixels >> (2 * shift);
+        scalar_rate = bench_downscale(motion_kernel_downscale_rows_scalar, frames, shift, coarse_reference);
+        selected_rate = bench_downscale(motion_kernel_downscale_rows, frames, shift, coarse_selected);
+        bool exact = memcmp(coarse_reference, coarse_selected, coarse_pixels) == 0;
+        // The right edge and a short bottom group take the scalar tail
+        motion_kernel_downscale_rows_scalar(frames[0], BENCH_WIDTH - 3, (1u << shift) - 1, shift, coarse_reference);
+        motion_kernel_downscale_rows(frames[0], BENCH_WIDTH - 3, (1u << shift) - 1, shift, coarse_selected);
+        exact &= memcmp(coarse_reference, coarse_selected, (BENCH_WIDTH - 3 + (1u << shift) - 1) >> shift) == 0;
+        downscale_exact &= exact;
+        printf("downscale_rows %ux scalar %8.1f Mpixel/s  %-6s %8.1f Mpixel/s  bit-exact: %s\n", 1u << shift,
+               scalar_rate, motion_kernel_name(), selected_rate, exact ? "yes" : "NO");
+    }
+    free(coarse_reference);
+    free(coarse_selected);
+
+    // Heatmap accumulation over the change masks the diff kernel left, as 8x8 tiles and as 16x16
+    bool activity_exact = true;
+    size_t stride = (BENCH_WIDTH + 31) / 32;
+    uint16_t *activity_reference = calloc(tiles, sizeof(uint16_t));
+    uint16_t *activity_selected = calloc(tiles, sizeof(uint16_t));
+    if (!activity_reference || !activity_selected)
+    {
+        return 1;
+    }
+    for (unsigned cell_shift = 3; cell_shift <= 4; cell_shift++)
+    {
+        size_t cells = BENCH_WIDTH >> cell_shift;
+        size_t rows = (size_t)1 << cell_shift;
+        double elapsed[2];
+        for (int k = 0; k < 2; k++)
+        {
+            uint16_t *counts = k == 0 ? activity_reference : activity_selected;
+            memset(counts, 0, tiles * sizeof(uint16_t));
+            double start = now_us();
+            for (int f = 0; f < BENCH_FRAMES; f++)
+            {
+                for (size_t y = 0; y < BENCH_HEIGHT; y += rows)
+                {
+                    const uint32_t *mask_rows = mask_selected + y * stride;
+                    uint16_t *count_row = counts + (y >> cell_shift) * cells;
+                    if (k == 0)
+                    {
+                        motion_kernel_accumulate_activity_scalar(mask_rows, stride, rows, cell_shift, cells, count_row);
+                    }
+                    else
+                    {
+                        motion_kernel_accumulate_activity(mask_rows, stride, rows, cell_shift, cells, count_row);
+                    }
+                }
+            }
+            elapsed[k] = now_us() - start;
+        }
+        bool exact = memcmp(activity_reference, activity_selected, tiles * sizeof(uint16_t)) == 0;
+        activity_exact &= exact;
+        printf("accumulate %2ux%-2u   scalar %8.1f Mpixel/s  %-6s %8.1f Mpixel/s  bit-exact: %s\n", 1u << cell_shift,
+               1u << cell_shift, (double)pixels * BENCH_FRAMES / elapsed[0], motion_kernel_name(),
+               (double)pixels * BENCH_FRAMES / elapsed[1], exact ? "yes" : "NO");
+    }
+    free(activity_reference);
+    free(activity_selected);
+
+    bool mask_filter_exact = check_mask_filter();
+
+    // Q8.8 integer EMA against a float EMA with the same rate, background pixels only
+    float alpha = 1.0f / (1 << BENCH_SHIFT);
+    for (size_t i = 0; i < pixels; i++)
+    {
+        bg_reference[i] = (uint16_t)(frames[0][i] << 8);
+        bg_float[i] = frames[0][i];
+    }
+    double start = now_us();
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        for (size_t i = 0; i < pixels; i++)
+        {
+            bg_float[i] = (1 - alpha) * bg_float[i] + alpha * frames[f][i];
+        }
+    }
+    double float_rate = (double)pixels * BENCH_FRAMES / (now_us() - start);
+    start = now_us();
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        for (size_t i = 0; i < pixels; i++)
+        {
+            bg_reference[i] = (uint16_t)(bg_reference[i] - ((bg_reference[i] + (1u << (BENCH_SHIFT - 1))) >> BENCH_SHIFT) +
+                                         (frames[f][i] << (8 - BENCH_SHIFT)));
+        }
+    }
+    double fixed_rate = (double)pixels * BENCH_FRAMES / (now_us() - start);
+    double max_error = 0;
+    double sum_error = 0;
+    for (size_t i = 0; i < pixels; i++)
+    {
+        double error = fabs(bg_reference[i] / 256.0 - bg_float[i]);
+        sum_error += error;
+        if (error > max_error)
+        {
+            max_error = error;
+        }
+    }
+    printf("background EMA    float  %8.1f Mpixel/s  q8.8   %8.1f Mpixel/s  error vs float: mean %.3f, max %.3f grey levels\n",
+           float_rate, fixed_rate, sum_error / pixels, max_error);
+
+    // Whole detector: full-resolution pixel mode against tile mode and against detection on the 2x and 4x
+    // pyramid levels, first on the plain scene and then on the textured one. The warm-up frame is the
+    // scene without the square.
+    uint8_t *background_frame = malloc(pixels);
+    FrameBoxes *labeled = calloc(BENCH_FRAMES, sizeof(FrameBoxes));
+    if (!background_frame || !labeled)
+    {
+        return 1;
+    }
+    for (int textured = 0; textured <= 1; textured++)
+    {
+        if (textured)
+        {
+            printf("textured scene, +/-%d grey levels per pixel:\n", BENCH_TEXTURE_AMPLITUDE);
+            for (int f = 0; f < BENCH_FRAMES; f++)
+            {
+                make_frame(frames[f], f, true);
+            }
+        }
+        for (size_t y = 0; y < BENCH_HEIGHT; y++)
+        {
+            for (size_t x = 0; x < BENCH_WIDTH; x++)
+            {
+                background_frame[y * BENCH_WIDTH + x] = (uint8_t)scene_luma((int)x, (int)y, textured);
+            }
+        }
+        bench_detector("pixel", MOTION_MODE_PIXEL, 1, frames, background_frame, labeled);
+        bench_detector("tile", MOTION_MODE_TILE, 1, frames, background_frame, NULL);
+        bench_detector("pyramid 2x", MOTION_MODE_PYRAMID, 1, frames, background_frame, NULL);
+        bench_detector("pyramid 4x", MOTION_MODE_PYRAMID, 2, frames, background_frame, NULL);
+        if (!textured)
+        {
+            bench_legacy_clustering(frames, background_frame, labeled);
+        }
+    }
+    free(labeled);
+    free(background_frame);
+
+    for (int f = 0; f < BENCH_FRAMES; f++)
+    {
+        free(frames[f]);
+    }
+    free(bg_reference);
+    free(bg_selected);
+    free(mask_reference);
+    free(mask_selected);
+    free(sums_reference);
+    free(sums_selected);
+    free(bg_float);
+    free(roi);
+    free(roi_tiles);
+    return diff_exact && tile_exact && downscale_exact && activity_exact && mask_filter_exact ? 0 : 1;
+}
@@ -0,0 +1,668 @@
+// Replay recorded luminance frames through the motion detector on the host.
+//
+// Detections are written to stdout as JSON lines; a latency, allocation and throughput
+// summary goes to stderr. Modes, thresholds and stripe counts can each be a comma-separated
+// list; every combination runs as its own detector instance over the same frames, so configurations
+// can be compared side by side. With --chunk-rows each frame is instead handed over in row chunks
+// at a simulated sensor line rate, the way the camera DMA fills a frame buffer, and latency is
+// measured from the last row landing to the result. --compare-streamed also runs each configuration on
+// whole frames and counts the frames where the two disagree.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "motion_detector.h"
+#include "motion_kernels.h"
+#include "motion_tracker.h"
+#include "host_frames.h"
+
+#define MAX_REPLAY_CONFIGS 8 // Detector instances run side by side
+#define REPLAY_EPOCH 1700000000 // Wall-clock time of the first frame, so timestamps repeat run to run
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+typedef struct
+{
+    MotionDetectionMode modes[MAX_REPLAY_CONFIGS];
+    size_t mode_count;
+    float thresholds[MAX_REPLAY_CONFIGS];
+    size_t threshold_count;
+    uint8_t stripes[MAX_REPLAY_CONFIGS];
+    size_t stripe_count;
+    unsigned pyramid_shift;
+    size_t raw_width;
+    size_t raw_height;
+    int repeat;
+    size_t chunk_rows;
+    double line_us;
+    double fps;
+    int sample_step;
+    bool compare_streamed;
+    bool all_frames;
+    const char *roi_path;
+    const char *snapshot_path;
+    const char *heatmap_path;
+    const char *directory;
+} ReplayOptions;
+
+// One detector instance and what it measured
+typedef struct
+{
+    char name[32];
+    MotionDetectionMode mode;
+    float threshold;
+    uint8_t stripes;
+    MotionDetector *detector;
+    MotionDetector *whole_frame; // Same configuration fed whole frames, for --compare-streamed
+    double *latencies;
+    size_t processed;
+    size_t detections;
+    size_t captures;
+    size_t total_allocations;
+    size_t max_allocations;
+    size_t total_bytes_touched;
+    size_t total_pixels;
+    double total_us;
+    size_t overruns;
+    size_t mismatches;      // Frames where the streamed and whole-frame results differ
+    long first_mismatch;    // Replay frame index of the first, or -1
+} ReplayConfig;
+
+static const char *mode_names[] = {"pixel", "tile", "adaptive", "pyramid"};
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <frame directory>\n"
+            "  --mode pixel|tile|adaptive|pyramid\n"
+            "                              Detection mode, or a comma-separated list (default pixel)\n"
+            "  --threshold N               Pixel threshold, or a comma-separated list (default 50)\n"
+            "  --stripes N                 Stripes processed in parallel, or a comma-separated list (default %d)\n"
+            "  --pyramid-shift N           Pyramid mode downscale, 1 for 2x or 2 for 4x (default %d)\n"
+            "  --width N --height N        Size of raw .y8/.raw frames\n"
+            "  --repeat N                  Replay the sequence N times (default 1)\n"
+            "  --chunk-rows N              Stream each frame to the detector N rows at a time\n"
+            "  --line-us U                 Sensor line time when streaming, in microseconds (default 0)\n"
+            "  --fps F                     Frame rate the frame timestamps advance at (default 10)\n"
+            "  --sample-step N             Sparse pre-check sample step, 1 to disable it (default from the detector)\n"
+            "  --no-staging                Same as --sample-step 1: every frame gets the full pass\n"
+            "  --compare-streamed          With --chunk-rows, also process whole frames and count the frames whose\n"
+            "                              results differ. Streamed frames skip the pre-check, so add --no-staging\n"
+            "                              for an exact match; lighting steps are compensated only after a streamed\n"
+            "                              frame and can still differ\n"
+            "  --all                       Emit a JSON line for every frame, not just detections\n"
+            "  --roi FILE                  Region of interest PGM, black pixels masked out\n"
+            "  --snapshot FILE             Warm-start from this background snapshot if valid, save to it at the end\n"
+            "  --heatmap FILE              Save the motion heatmap at the end, FILE.N for configuration N if several\n"
+            "  --verbose                   Show detector logs up to debug level\n"
+            "Every mode, threshold and stripe count combination runs as its own detector, up to %d.\n",
+            program, MOTION_DEFAULT_STRIPES, MOTION_DEFAULT_PYRAMID_SHIFT, MAX_REPLAY_CONFIGS);
+}
+
+static bool parse_mode(const char *name, size_t length, MotionDetectionMode *mode)
+{
+    for (size_t i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++)
+    {
+        if (strlen(mode_names[i]) == length && strncmp(name, mode_names[i], length) == 0)
+        {
+            *mode = (MotionDetectionMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_mode_list(const char *list, ReplayOptions *options)
+{
+    options->mode_count = 0;
+    while (*list)
+    {
+        size_t length = strcspn(list, ",");
+        if (options->mode_count == MAX_REPLAY_CONFIGS ||
+            !parse_mode(list, length, &options->modes[options->mode_count++]))
+        {
+            return false;
+        }
+        list += length + (list[length] == ',');
+    }
+    return options->mode_count > 0;
+}
+
+static bool parse_threshold_list(const char *list, ReplayOptions *options)
+{
+    options->threshold_count = 0;
+    while (*list)
+    {
+        char *end;
+        float threshold = strtof(list, &end);
+        if (end == list || (*end != ',' && *end != '\0') || options->threshold_count == MAX_REPLAY_CONFIGS)
+        {
+            return false;
+        }
+        options->thresholds[options->threshold_count++] = threshold;
+        list = *end ? end + 1 : end;
+    }
+    return options->threshold_count > 0;
+}
+
+static bool parse_stripe_list(const char *list, ReplayOptions *options)
+{
+    options->stripe_count = 0;
+    while (*list)
+    {
+        char *end;
+        unsigned long stripes = strtoul(list, &end, 10);
+        if (end == list || (*end != ',' && *end != '\0') || stripes == 0 || stripes > MOTION_MAX_STRIPES ||
+            options->stripe_count == MAX_REPLAY_CONFIGS)
+        {
+            return false;
+        }
+        options->stripes[options->stripe_count++] = (uint8_t)stripes;
+        list = *end ? end + 1 : end;
+    }
+    return options->stripe_count > 0;
+}
+
+static bool parse_options(int argc, char **argv, ReplayOptions *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->modes[0] = MOTION_MODE_PIXEL;
+    options->mode_count = 1;
+    options->thresholds[0] = 50;
+    options->threshold_count = 1;
+    options->stripes[0] = MOTION_DEFAULT_STRIPES;
+    options->stripe_count = 1;
+    options->repeat = 1;
+    options->fps = 10;
+    options->sample_step = -1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--mode") == 0 && has_value)
+        {
+            if (!parse_mode_list(argv[++i], options))
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--threshold") == 0 && has_value)
+        {
+            if (!parse_threshold_list(argv[++i], options))
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--stripes") == 0 && has_value)
+        {
+            if (!parse_stripe_list(argv[++i], options))
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--pyramid-shift") == 0 && has_value)
+        {
+            options->pyramid_shift = (unsigned)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(arg, "--width") == 0 && has_value)
+        {
+            options->raw_width = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(arg, "--height") == 0 && has_value)
+        {
+            options->raw_height = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(arg, "--repeat") == 0 && has_value)
+        {
+            options->repeat = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "--chunk-rows") == 0 && has_value)
+        {
+            options->chunk_rows = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(arg, "--line-us") == 0 && has_value)
+        {
+            options->line_us = strtod(argv[++i], NULL);
+        }
+        else if (strcmp(arg, "--fps") == 0 && has_value)
+        {
+            options->fps = strtod(argv[++i], NULL);
+        }
+        else if (strcmp(arg, "--sample-step") == 0 && has_value)
+        {
+            options->sample_step = atoi(argv[++i]);
+        }
+        else if (strcmp(arg, "--no-staging") == 0)
+        {
+            options->sample_step = 1;
+        }
+        else if (strcmp(arg, "--compare-streamed") == 0)
+        {
+            options->compare_streamed = true;
+        }
+        else if (strcmp(arg, "--all") == 0)
+        {
+            options->all_frames = true;
+        }
+        else if (strcmp(arg, "--roi") == 0 && has_value)
+        {
+            options->roi_path = argv[++i];
+        }
+        else if (strcmp(arg, "--snapshot") == 0 && has_value)
+        {
+            options->snapshot_path = argv[++i];
+        }
+        else if (strcmp(arg, "--heatmap") == 0 && has_value)
+        {
+            options->heatmap_path = argv[++i];
+        }
+        else if (strcmp(arg, "--verbose") == 0)
+        {
+            host_log_level = ESP_LOG_DEBUG;
+        }
+        else if (arg[0] != '-' && options->directory == NULL)
+        {
+            options->directory = arg;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    if (options->compare_streamed && options->chunk_rows == 0)
+    {
+        return false;
+    }
+    return options->directory != NULL && options->repeat > 0 && options->fps > 0 && options->sample_step != 0 &&
+           options->sample_step <= 255 &&
+           options->mode_count * options->threshold_count * options->stripe_count <= MAX_REPLAY_CONFIGS;
+}
+
+static double elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e6 + (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, size_t count, double fraction)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * (double)(count - 1) + 0.5);
+    return sorted[index];
+}
+
+static void wait_until(const struct timespec *start, double offset_us)
+{
+    struct timespec now;
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_us(start, &now) < offset_us);
+}
+
+// Hand a frame to the detector the way the camera DMA fills a buffer: chunk_rows rows at a time, one
+// sensor line every line_us. Rows that have not landed yet hold garbage, so a detector reading ahead
+// would show up as a mismatch against the whole-frame replay. Returns the latency from the last row
+// landing to the result.
+static double stream_frame(ReplayConfig *config, const ReplayOptions *options, const uint8_t *pixels,
+                           camera_fb_t *dma_frame, MotionResult *result)
+{
+    size_t width = dma_frame->width;
+    size_t height = dma_frame->height;
+    memset(dma_frame->buf, 0xA5, width * height);
+
+    struct timespec start, landed, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    motion_detector_begin_frame(config->detector, dma_frame);
+    for (size_t rows = 0; rows < height;)
+    {
+        size_t next = rows + options->chunk_rows < height ? rows + options->chunk_rows : height;
+        wait_until(&start, next * options->line_us);
+        memcpy(dma_frame->buf + rows * width, pixels + rows * width, (next - rows) * width);
+        rows = next;
+        if (rows == height)
+        {
+            break;
+        }
+        motion_detector_push_rows(config->detector, rows);
+
+        // The detector fell behind if the next chunk landed before this one was processed
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        size_t following = rows + options->chunk_rows < height ? rows + options->chunk_rows : height;
+        if (options->line_us > 0 && elapsed_us(&start, &now) > following * options->line_us)
+        {
+            config->overruns++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &landed);
+    motion_detector_finish_frame(config->detector, result);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_us(&landed, &end);
+}
+
+// Create a detector for one configuration, warm-started and masked
+static bool create_detector(const ReplayConfig *config, const ReplayOptions *options, size_t width, size_t height,
+                            MotionDetector **out_detector)
+{
+    MotionDetectorConfig detector_config;
+    motion_detector_default_config(&detector_config, width, height);
+    detector_config.mode = config->mode;
+    detector_config.threshold = config->threshold;
+    detector_config.stripes = config->stripes;
+    if (options->pyramid_shift)
+    {
+        detector_config.pyramid_shift = (uint8_t)options->pyramid_shift;
+    }
+    if (options->sample_step > 0)
+    {
+        detector_config.staging.sample_step = (uint8_t)options->sample_step;
+    }
+    esp_err_t err = motion_detector_create(&detector_config, out_detector);
+    if (err != ESP_OK)
+    {
+        fprintf(stderr, "%s: cannot create a %zux%zu detector (0x%x)\n", config->name, width, height, err);
+        return false;
+    }
+    if (options->roi_path && motion_detector_load_roi(*out_detector, 0, options->roi_path, 0, 0) != ESP_OK)
+    {
+        return false;
+    }
+    if (options->snapshot_path)
+    {
+        err = motion_detector_load_snapshot(*out_detector, options->snapshot_path, 24 * 3600);
+        fprintf(stderr, "%s snapshot: %s\n", config->name, err == ESP_OK ? "warm start" : "cold start");
+    }
+    return true;
+}
+
+// Create one detector per configuration for the given frame size, and its whole-frame twin if comparing
+static bool create_detectors(ReplayConfig *configs, size_t config_count, const ReplayOptions *options,
+                             size_t width, size_t height)
+{
+    for (size_t c = 0; c < config_count; c++)
+    {
+        ReplayConfig *config = &configs[c];
+        motion_detector_destroy(config->detector);
+        motion_detector_destroy(config->whole_frame);
+        config->detector = NULL;
+        config->whole_frame = NULL;
+        if (!create_detector(config, options, width, height, &config->detector) ||
+            (options->compare_streamed && !create_detector(config, options, width, height, &config->whole_frame)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether two results report the same boxes, tracks and capture decision
+static bool same_result(const MotionResult *a, const MotionResult *b)
+{
+    if (a->motion != b->motion || a->capture_requested != b->capture_requested || a->box_count != b->box_count)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a->box_count; i++)
+    {
+        if (a->boxes[i].x_min != b->boxes[i].x_min || a->boxes[i].y_min != b->boxes[i].y_min ||
+            a->boxes[i].x_max != b->boxes[i].x_max || a->boxes[i].y_max != b->boxes[i].y_max ||
+            a->track_ids[i] != b->track_ids[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void print_summary(const ReplayConfig *config, const ReplayOptions *options)
+{
+    size_t processed = config->processed;
+    qsort(config->latencies, processed, sizeof(double), compare_doubles);
+    fprintf(stderr, "[%s]\n", config->name);
+    fprintf(stderr, "frames: %zu, detections: %zu, captures: %zu\n", processed, config->detections, config->captures);
+    fprintf(stderr, "latency us: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+            percentile(config->latencies, processed, 0.50), percentile(config->latencies, processed, 0.90),
+            percentile(config->latencies, processed, 0.99), config->latencies[processed - 1]);
+    fprintf(stderr, "throughput: %.1f frames/s, %.1f Mpixel/s\n",
+            processed / (config->total_us / 1e6), config->total_pixels / config->total_us);
+    fprintf(stderr, "allocations: %zu total, %zu max per frame\n", config->total_allocations, config->max_allocations);
+    if (options->chunk_rows > 0)
+    {
+        fprintf(stderr, "streaming: %zu rows per chunk, %zu chunks finished after the next one landed\n",
+                options->chunk_rows, config->overruns);
+    }
+    if (options->compare_streamed)
+    {
+        fprintf(stderr, "streamed vs whole frame: %zu of %zu frames differ", config->mismatches, processed);
+        if (config->mismatches > 0)
+        {
+            fprintf(stderr, ", first at index %ld", config->first_mismatch);
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "bytes touched: %.0f per frame\n", (double)config->total_bytes_touched / processed);
+
+    MotionDetectorStats stats;
+    motion_detector_get_stats(config->detector, &stats);
+    fprintf(stderr, "lighting: %u compensated, %u skipped\n", stats.lighting_compensated, stats.lighting_skipped);
+    fprintf(stderr, "stages: %u quiet after sparse check, %u full passes, %u detections\n",
+            stats.sparse_quiet, stats.full_passes, stats.detections);
+    fprintf(stderr, "tracking: %u captures requested, %u tracks ended\n",
+            stats.captures_requested, stats.tracks_ended);
+}
+
+int main(int argc, char **argv)
+{
+    ReplayOptions options;
+    if (!parse_options(argc, argv, &options))
+    {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    FrameList frames;
+    if (!list_frames(options.directory, &frames))
+    {
+        return 1;
+    }
+    if (frames.count == 0)
+    {
+        fprintf(stderr, "No .pgm, .y8 or .raw frames in %s\n", options.directory);
+        free_frame_list(&frames);
+        return 1;
+    }
+
+    size_t total_frames = frames.count * (size_t)options.repeat;
+    ReplayConfig configs[MAX_REPLAY_CONFIGS];
+    size_t config_count = 0;
+    int status = 0;
+    memset(configs, 0, sizeof(configs));
+    for (size_t m = 0; m < options.mode_count; m++)
+    {
+        for (size_t t = 0; t < options.threshold_count; t++)
+        {
+            for (size_t s = 0; s < options.stripe_count; s++)
+            {
+                ReplayConfig *config = &configs[config_count++];
+                config->mode = options.modes[m];
+                config->threshold = options.thresholds[t];
+                config->stripes = options.stripes[s];
+                int length = snprintf(config->name, sizeof(config->name), "%s/%g", mode_names[config->mode],
+                                      config->threshold);
+                if (config->stripes > 1)
+                {
+                    snprintf(config->name + length, sizeof(config->name) - length, "/s%u", config->stripes);
+                }
+                config->first_mismatch = -1;
+                config->latencies = malloc(total_frames * sizeof(double));
+                if (config->latencies == NULL)
+                {
+                    status = 1;
+                }
+            }
+        }
+    }
+
+    uint8_t *pixels = NULL;
+    size_t capacity = 0;
+    uint8_t *dma_buffer = NULL; // Frame buffer the simulated DMA fills when streaming
+    size_t model_width = 0;
+    size_t model_height = 0;
+
+    for (int pass = 0; pass < options.repeat && status == 0; pass++)
+    {
+        for (size_t i = 0; i < frames.count; i++)
+        {
+            size_t width;
+            size_t height;
+            if (!load_frame(frames.paths[i], options.raw_width, options.raw_height, &pixels, &capacity, &width, &height))
+            {
+                status = 1;
+                break;
+            }
+            if (width != model_width || height != model_height)
+            {
+                if (options.chunk_rows > 0)
+                {
+                    uint8_t *resized = realloc(dma_buffer, width * height);
+                    if (resized == NULL)
+                    {
+                        status = 1;
+                        break;
+                    }
+                    dma_buffer = resized;
+                }
+                if (!create_detectors(configs, config_count, &options, width, height))
+                {
+                    status = 1;
+                    break;
+                }
+                model_width = width;
+                model_height = height;
+            }
+
+            camera_fb_t frame = {
+                .buf = pixels,
+                .len = width * height,
+                .width = width,
+                .height = height,
+                .format = PIXFORMAT_GRAYSCALE};
+            // Timestamps follow the frame index, not the host clock, so tracks come out the same every run
+            int64_t frame_us = (int64_t)(((double)pass * frames.count + i) * 1e6 / options.fps);
+            frame.timestamp.tv_sec = REPLAY_EPOCH + (time_t)(frame_us / 1000000);
+            frame.timestamp.tv_usec = (suseconds_t)(frame_us % 1000000);
+            camera_fb_t dma_frame = frame;
+            dma_frame.buf = dma_buffer;
+
+            for (size_t c = 0; c < config_count; c++)
+            {
+                ReplayConfig *config = &configs[c];
+                MotionResult result;
+                struct timespec start, end;
+
+                double latency;
+                if (options.chunk_rows > 0)
+                {
+                    latency = stream_frame(config, &options, pixels, &dma_frame, &result);
+                }
+                else
+                {
+                    clock_gettime(CLOCK_MONOTONIC, &start);
+                    motion_detector_process(config->detector, &frame, &result);
+                    clock_gettime(CLOCK_MONOTONIC, &end);
+                    latency = elapsed_us(&start, &end);
+                }
+                if (config->whole_frame)
+                {
+                    MotionResult whole_result;
+                    motion_detector_process(config->whole_frame, &frame, &whole_result);
+                    if (!same_result(&result, &whole_result))
+                    {
+                        if (config->mismatches++ == 0)
+                        {
+                            config->first_mismatch = (long)(pass * frames.count + i);
+                        }
+                    }
+                    MotionTrack discarded[MAX_TRACKS];
+                    motion_detector_take_ended_tracks(config->whole_frame, discarded, MAX_TRACKS);
+                }
+                config->latencies[config->processed++] = latency;
+                config->total_us += latency;
+                config->total_pixels += width * height;
+                config->total_allocations += result.allocations;
+                config->total_bytes_touched += result.bytes_touched;
+                if (result.allocations > config->max_allocations)
+                {
+                    config->max_allocations = result.allocations;
+                }
+                config->detections += result.motion;
+                config->captures += result.capture_requested;
+
+                if (result.motion || options.all_frames)
+                {
+                    char *boxes = boxes_to_json(result.boxes, result.track_ids, result.box_count);
+                    printf("{\"config\":\"%s\",\"frame\":\"%s\",\"index\":%zu,\"pass\":%d,\"motion\":%s,\"capture\":%s,"
+                           "\"boxes\":%s,\"latency_us\":%.1f,\"allocations\":%zu}\n",
+                           config->name, frames.paths[i], i, pass, result.motion ? "true" : "false",
+                           result.capture_requested ? "true" : "false", boxes ? boxes : "[]", latency,
+                           result.allocations);
+                    free(boxes);
+                }
+
+                MotionTrack ended[MAX_TRACKS];
+                size_t ended_count = motion_detector_take_ended_tracks(config->detector, ended, MAX_TRACKS);
+                for (size_t e = 0; e < ended_count; e++)
+                {
+                    char summary[MOTION_TRACK_JSON_SIZE];
+                    motion_track_to_json(&ended[e], summary, sizeof(summary));
+                    printf("{\"config\":\"%s\",\"track_summary\":%s}\n", config->name, summary);
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "kernel: %s\n", motion_kernel_name());
+    for (size_t c = 0; c < config_count; c++)
+    {
+        ReplayConfig *config = &configs[c];
+        if (config->processed > 0)
+        {
+            print_summary(config, &options);
+        }
+        // With several configurations each saves in turn, so the last one's model is kept
+        if (options.snapshot_path && config->processed > 0 &&
+            motion_detector_save_snapshot(config->detector, options.snapshot_path) != ESP_OK)
+        {
+            status = 1;
+        }
+        if (options.heatmap_path && config->processed > 0)
+        {
+            char heatmap_path[512];
+            snprintf(heatmap_path, sizeof(heatmap_path), config_count > 1 ? "%s.%zu" : "%s", options.heatmap_path, c);
+            if (motion_detector_save_heatmap(config->detector, heatmap_path) != ESP_OK)
+            {
+                status = 1;
+            }
+        }
+        motion_detector_destroy(config->detector);
+        motion_detector_destroy(config->whole_frame);
+        free(config->latencies);
+    }
+    free(pixels);
+    free(dma_buffer);
+    free_frame_list(&frames);
+    return status;
+}
@@ -0,0 +1,35 @@
+// Host stand-in for ESP_LOG; messages go to stderr when their level is enabled
+#ifndef HOST_ESP_LOG_H
+#define HOST_ESP_LOG_H
+
+#include <stdio.h>
+
+typedef enum
+{
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+// Set by the harness, ESP_LOG_WARN by default so detections stay readable on stdout
+extern esp_log_level_t host_log_level;
+
+#define HOST_LOG(level, letter, tag, format, ...)                                     \
+    do                                                                                \
+    {                                                                                 \
+        if (host_log_level >= (level))                                                \
+        {                                                                             \
+            fprintf(stderr, letter " (%s) " format "\n", (tag), ##__VA_ARGS__);       \
+        }                                                                             \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) HOST_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) HOST_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#endif // HOST_ESP_LOG_H
@@ -0,0 +1,11 @@
+// Host stand-in for FreeRTOS queues, enough for sdcard_interface.h to compile
+#ifndef HOST_FREERTOS_QUEUE_H
+#define HOST_FREERTOS_QUEUE_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct HostQueue *QueueHandle_t;
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait);
+
+#endif // HOST_FREERTOS_QUEUE_H
@@ -4,48 +4,381 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <esp_camera.h>
 #include "esp_log.h"
 #include "esp_system.h"
 
+#define MOTION_MAX_STRIPES 4           // Horizontal stripes a frame can be split into for parallel processing
+#define MOTION_DEFAULT_PYRAMID_SHIFT 1 // Pyramid mode detects on a 2x downscaled image unless configured
+
+// One stripe per core: the PRO core helps the detector task on dual-core chips
+#if defined(ESP_PLATFORM) && !CONFIG_FREERTOS_UNICORE
+#define MOTION_DEFAULT_STRIPES 2
+#else
+#define MOTION_DEFAULT_STRIPES 1
+#endif
+
 // Define the structure for the background model
 typedef struct
 {
-    uint8_t *background;
-    size_t width;
+    uint16_t *background; // Q8.8 fixed-point luminance per pixel, or per block in pyramid mode
+    uint16_t *variance;   // Running variance per pixel in grey levels squared, adaptive mode only
+    size_t width;         // Frame size in pixels, also in pyramid mode
     size_t height;
+    uint8_t scale_shift;  // Pyramid mode: background holds one value per 2^shift square block; else 0
     bool initialized;
 } BackgroundModel;
 
+// How motion_detector_process() finds changed regions
+typedef enum
+{
+    MOTION_MODE_PIXEL,    // Per-pixel change mask and component labeling at full resolution
+    MOTION_MODE_TILE,     // Per-tile mean absolute difference, labeling on the tile grid
+    MOTION_MODE_ADAPTIVE, // Per-pixel threshold at k standard deviations of a running variance
+    MOTION_MODE_PYRAMID   // Change mask on a 2x or 4x box-filtered image, boxes refined at full resolution
+} MotionDetectionMode;
+
+// An axis-aligned box in frame pixels
+typedef struct
+{
+    size_t x_min, y_min;
+    size_t x_max, y_max;
+} BoundingBox;
+
+// A connected region of changed pixels; the centroid is (sum_x / pixel_count, sum_y / pixel_count)
+typedef struct
+{
+    size_t x_min, y_min;
+    size_t x_max, y_max;
+    size_t pixel_count;
+    size_t sum_x, sum_y;
+} MotionComponent;
+
+// Running counters kept by the detector since start-up or the last reset
+typedef struct
+{
+    uint32_t frames;               // Frames processed; frames of the wrong size are not counted
+    uint32_t lighting_compensated; // Frames whose background was rescaled for a global brightness step
+    uint32_t lighting_skipped;     // Frames skipped as lighting events, with the background reseeded
+    uint32_t sparse_quiet;         // Frames that stopped after the sparse pre-check
+    uint32_t full_passes;          // Frames that ran the full-resolution pass
+    uint32_t detections;           // Frames that reported at least one box
+    uint32_t captures_requested;   // Frames that started a track or changed one enough for a new capture
+    uint32_t tracks_ended;         // Tracks closed and summarized
+} MotionDetectorStats;
+
+// Staged detection: a sparse sample decides whether a frame gets the full-resolution pass
+typedef struct
+{
+    uint8_t sample_step;           // One jittered sample per step x step cell, a power of two; 1 disables the pre-check
+    uint16_t min_changed_permille; // Changed samples, per mille of all samples, needed to run the full pass
+    uint16_t refresh_interval;     // Consecutive quiet frames before a full pass refreshes the background; 0 never
+} MotionStagingConfig;
+
+// Settings fixed when a detector is created; see motion_detector_default_config() for the defaults
+typedef struct
+{
+    size_t width, height;          // Frame size; every processed frame must match
+    MotionDetectionMode mode;      // Initial detection mode
+    float threshold;               // Grey levels a pixel must change by; ignored in adaptive mode
+    uint8_t background_shift;      // Background EMA rate is 1 / 2^shift, 1..8; higher adapts slower
+    uint8_t foreground_shift;      // Rate for changed pixels, 1..8; slower so subjects don't bleed in
+    uint32_t init_frames;          // Frames that seed the background before detection starts
+    size_t max_boxes;              // Candidate boxes kept per frame before merging, at most 256
+    size_t min_box_area;           // Merged boxes smaller than this are dropped
+    size_t max_box_area;           // Boxes larger than this are dropped before merging
+    float merge_iou;               // Boxes overlapping by more than this are merged, 0..1
+    uint8_t stripes;               // Horizontal stripes processed in parallel, 1..MOTION_MAX_STRIPES
+    uint8_t pyramid_shift;         // Pyramid mode downscales by 2^shift: 1 (2x) or 2 (4x)
+    MotionStagingConfig staging;   // Sparse pre-check
+} MotionDetectorConfig;
+
+// What one call to motion_detector_process() found. The arrays belong to the detector and stay
+// valid until its next call.
+typedef struct
+{
+    bool motion;                   // At least one box survived filtering
+    bool capture_requested;        // A track was confirmed or changed enough for a high-resolution capture
+    time_t timestamp;              // Wall-clock capture time from the frame, or the time it was processed if unset
+    size_t box_count;
+    const BoundingBox *boxes;
+    const uint16_t *track_ids;     // Track per box, 0 when no track slot was free
+    size_t ended_tracks;           // Tracks that ended on this frame, see motion_detector_take_ended_tracks()
+    size_t allocations;            // Heap allocations made while processing; zero in the steady state
+    size_t bytes_touched;          // Frame, background and mask bytes streamed; PSRAM bandwidth on the ESP32-S3
+} MotionResult;
+
+// One motion detector instance: configuration, background model, scratch buffers, tracks and counters.
+// Instances are independent, so several can run on different resolutions, regions or settings.
+typedef struct MotionDetector MotionDetector;
+
+struct MotionTrack;
+
 // Function prototypes
 
 /**
- * @brief Initialize the background model with given dimensions
+ * @brief Fill a configuration with the default settings for a frame size
  *
+ * @param config Output configuration
  * @param width The width of the frame
  * @param height The height of the frame
  */
-void initialize_background_model(size_t width, size_t height);
+void motion_detector_default_config(MotionDetectorConfig *config, size_t width, size_t height);
+
+/**
+ * @brief Create a detector and allocate all of its buffers
+ *
+ * Processing never allocates afterwards, except for the variance plane the first time adaptive mode is
+ * selected on a detector created in another mode.
+ *
+ * @param config Detector settings
+ * @param out_detector Receives the new detector
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for an out-of-range setting, or ESP_ERR_NO_MEM
+ */
+esp_err_t motion_detector_create(const MotionDetectorConfig *config, MotionDetector **out_detector);
+
+/**
+ * @brief Free a detector and everything it owns
+ *
+ * @param detector The detector, or NULL
+ */
+void motion_detector_destroy(MotionDetector *detector);
+
+/**
+ * @brief Compare a frame to the background model and update both the model and the tracks
+ *
+ * The first init_frames frames only seed the background.
+ *
+ * @param detector The detector
+ * @param frame Grayscale frame of the configured size; its timestamp, if set, is the wall-clock capture time
+ * @param result Output; filled on every call that returns ESP_OK
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_INVALID_SIZE when the frame does not match, or
+ *         ESP_ERR_INVALID_STATE while a streamed frame is in progress
+ */
+esp_err_t motion_detector_process(MotionDetector *detector, const camera_fb_t *frame, MotionResult *result);
+
+/**
+ * @brief Start a frame whose rows are still being written, e.g. by the camera DMA
+ *
+ * Rows are processed as they are reported with motion_detector_push_rows(), so only the last chunk is
+ * left for motion_detector_finish_frame(). Streamed frames always run the full pass: the sparse
+ * pre-check needs the whole frame. Lighting is judged when the frame is finished; a frame whose
+ * brightness stepped reports no boxes while the background is rescaled for the next one.
+ *
+ * @param detector The detector
+ * @param frame Frame of the configured size; buf must stay valid until the frame is finished
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_INVALID_SIZE, or ESP_ERR_INVALID_STATE when a frame is
+ *         already in progress
+ */
+esp_err_t motion_detector_begin_frame(MotionDetector *detector, const camera_fb_t *frame);
+
+/**
+ * @brief Process the rows of the frame in progress that have landed
+ *
+ * @param detector The detector
+ * @param rows Rows from the top of the frame that are complete; counts below an earlier call are ignored
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, or ESP_ERR_INVALID_STATE when no frame is in progress
+ */
+esp_err_t motion_detector_push_rows(MotionDetector *detector, size_t rows);
+
+/**
+ * @brief Process the remaining rows of the frame in progress and update the tracks
+ *
+ * @param detector The detector
+ * @param result Output, as from motion_detector_process()
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, or ESP_ERR_INVALID_STATE when no frame is in progress
+ */
+esp_err_t motion_detector_finish_frame(MotionDetector *detector, MotionResult *result);
+
+/**
+ * @brief Take the tracks that ended since the last call, e.g. to log summaries
+ *
+ * @param detector The detector
+ * @param tracks Output array
+ * @param max_tracks Capacity of tracks
+ * @return Number of tracks copied
+ */
+size_t motion_detector_take_ended_tracks(MotionDetector *detector, struct MotionTrack *tracks, size_t max_tracks);
+
+/**
+ * @brief Format boxes and their track ids as a JSON array
+ *
+ * @param boxes Boxes, e.g. MotionResult.boxes
+ * @param track_ids Track per box, or NULL
+ * @param box_count Number of boxes
+ * @return A string the caller frees, or NULL when out of memory
+ */
+char *boxes_to_json(const BoundingBox *boxes, const uint16_t *track_ids, size_t box_count);
+
+/**
+ * @brief Intersection over union of two boxes
+ *
+ * @return Overlap in 0..1, 0 for disjoint boxes
+ */
+float calculate_iou(BoundingBox box1, BoundingBox box2);
+
+/**
+ * @brief Select the detection mode; takes effect on the next frame
+ *
+ * MOTION_MODE_ADAPTIVE ignores the configured threshold and allocates a variance plane of
+ * width * height uint16_t values the first time it is selected. Switching into or out of
+ * MOTION_MODE_PYRAMID resamples the background, which then keeps only the block means.
+ *
+ * @param detector The detector
+ * @param mode The detection mode
+ * @return ESP_OK, ESP_ERR_INVALID_ARG for an unknown mode, ESP_ERR_INVALID_STATE while a streamed frame
+ * is in progress, or ESP_ERR_NO_MEM if the variance plane could not be allocated
+ */
+esp_err_t motion_detector_set_mode(MotionDetector *detector, MotionDetectionMode mode);
+
+/**
+ * @brief Get the current detection mode
+ *
+ * @param detector The detector
+ * @return The detection mode
+ */
+MotionDetectionMode motion_detector_get_mode(const MotionDetector *detector);
+
+/**
+ * @brief Copy the detector's running counters
+ *
+ * @param detector The detector
+ * @param stats Output counters
+ */
+void motion_detector_get_stats(const MotionDetector *detector, MotionDetectorStats *stats);
+
+/**
+ * @brief Zero the detector's running counters
+ *
+ * @param detector The detector
+ */
+void motion_detector_reset_stats(MotionDetector *detector);
+
+/**
+ * @brief Install a region of interest mask for a time-of-day window
+ *
+ * Pixels outside the mask are never compared or learned, and tiles with no enabled pixel are skipped
+ * in tile mode. When several windows overlap the lowest slot wins; outside every window the whole
+ * frame is used. The background is reseeded whenever the active mask changes.
+ *
+ * @param detector The detector
+ * @param slot Mask slot, 0..3
+ * @param mask width * height bytes; nonzero enables detection at that pixel
+ * @param start_minute Window start in local time, minutes since midnight
+ * @param end_minute Window end, exclusive; equal to start_minute for a mask that is always active
+ * @return ESP_OK, ESP_ERR_INVALID_ARG, or ESP_ERR_NO_MEM
+ */
+esp_err_t motion_detector_set_roi(MotionDetector *detector, size_t slot, const uint8_t *mask, uint16_t start_minute,
+                                  uint16_t end_minute);
+
+/**
+ * @brief Load a region of interest mask from an 8-bit binary PGM, e.g. on the SD card
+ *
+ * The image must match the frame size and have no header comments. Black pixels are masked out.
+ *
+ * @param detector The detector
+ * @param slot Mask slot, 0..3
+ * @param path PGM file path
+ * @param start_minute Window start in local time, minutes since midnight
+ * @param end_minute Window end, exclusive; equal to start_minute for a mask that is always active
+ * @return ESP_OK or an error from reading the file or motion_detector_set_roi()
+ */
+esp_err_t motion_detector_load_roi(MotionDetector *detector, size_t slot, const char *path, uint16_t start_minute,
+                                   uint16_t end_minute);
 
 /**
- * @brief Update the background model with a new frame
+ * @brief Remove the region of interest mask in a slot
  *
- * @param frame Pointer to the current camera frame
+ * @param detector The detector
+ * @param slot Mask slot, 0..3
  */
-void update_background_model(camera_fb_t *frame);
+void motion_detector_clear_roi(MotionDetector *detector, size_t slot);
 
 /**
- * @brief Detect motion by comparing the current frame to the background model
+ * @brief Write the learned background, and the variance if present, to a snapshot file
  *
- * @param current_frame Pointer to the current camera frame
- * @param threshold The threshold for considering a change as motion (0.0 to 1.0)
- * @return true if motion is detected, false otherwise
+ * The background is stored as 8-bit luma behind a header with the frame size, a timestamp and a
+ * checksum. The file is written beside path and renamed into place.
+ *
+ * @param detector The detector
+ * @param path Snapshot file, e.g. on the SD card
+ * @return ESP_OK, ESP_ERR_INVALID_STATE before the model is learned, or ESP_FAIL on a write error
+ */
+esp_err_t motion_detector_save_snapshot(const MotionDetector *detector, const char *path);
+
+/**
+ * @brief Warm-start the background model from a snapshot file
+ *
+ * The snapshot must match the frame size, pass its checksum and, when the clock is synced, be at most
+ * max_age_seconds old. On success detection starts with the next frame instead of after the warm-up
+ * frames.
+ *
+ * @param detector The detector
+ * @param path Snapshot file written by motion_detector_save_snapshot()
+ * @param max_age_seconds Oldest snapshot accepted
+ * @return ESP_OK, ESP_ERR_NOT_FOUND, ESP_ERR_INVALID_SIZE, ESP_ERR_INVALID_STATE when stale, or ESP_ERR_INVALID_CRC
+ */
+esp_err_t motion_detector_load_snapshot(MotionDetector *detector, const char *path, uint32_t max_age_seconds);
+
+/**
+ * @brief Copy the background into PSRAM that survives a soft reset
+ *
+ * Needs CONFIG_SPIRAM_ALLOW_NOINIT_SEG_EXTERNAL_MEMORY and frames up to QVGA. There is one retained
+ * copy, so only one detector should use it. Cheap enough to call every few seconds.
+ *
+ * @param detector The detector
+ * @return ESP_OK, ESP_ERR_INVALID_STATE before the model is learned, or ESP_ERR_NOT_SUPPORTED
+ */
+esp_err_t motion_detector_retain_snapshot(const MotionDetector *detector);
+
+/**
+ * @brief Warm-start the background model from the copy kept by motion_detector_retain_snapshot()
+ *
+ * @param detector The detector
+ * @param max_age_seconds Oldest snapshot accepted when the clock is synced
+ * @return ESP_OK, an error from the validity checks, or ESP_ERR_NOT_SUPPORTED
  */
-bool detect_motion(camera_fb_t *current_frame, float threshold, time_t *detection_timestamp);
+esp_err_t motion_detector_restore_retained_snapshot(MotionDetector *detector, uint32_t max_age_seconds);
 
 /**
- * @brief Clean up and free the memory used by the background model
+ * @brief Wall-clock start of the current heatmap period
+ *
+ * A period that begins before the clock is set, e.g. at boot before SNTP, is dated from the first frame
+ * processed once it is, so a period never appears to start in 1970.
+ *
+ * @param detector The detector
+ * @return The start, or 0 until the clock is set
+ */
+time_t motion_detector_heatmap_start(const MotionDetector *detector);
+
+/**
+ * @brief Write the motion heatmap as a 16-bit binary PGM and start a new period
+ *
+ * One sample per tile counts the frames since the last save in which the tile had a changed pixel,
+ * saturating at 65535. A comment line holds the number of frames processed and the start of the
+ * period. The counts are only cleared when the file was written.
+ *
+ * @param detector The detector
+ * @param path Heatmap file, e.g. on the SD card beside the data logs
+ * @return ESP_OK, ESP_ERR_NO_MEM, or ESP_FAIL on a write error
+ */
+esp_err_t motion_detector_save_heatmap(MotionDetector *detector, const char *path);
+
+/**
+ * @brief Set the sparse pre-check thresholds
+ *
+ * @param detector The detector
+ * @param config New staging configuration
+ */
+void motion_detector_set_staging_config(MotionDetector *detector, const MotionStagingConfig *config);
+
+/**
+ * @brief Get the current sparse pre-check thresholds
+ *
+ * @param detector The detector
+ * @param config Output configuration
  */
-void cleanup_background_model(void);
+void motion_detector_get_staging_config(const MotionDetector *detector, MotionStagingConfig *config);
 
 #endif // MOTION_DETECTOR_H
\ No newline at end of file
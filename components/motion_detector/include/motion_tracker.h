@@ -0,0 +1,96 @@
+#ifndef MOTION_TRACKER_H
+#define MOTION_TRACKER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "motion_detector.h"
+
+#define MAX_TRACKS 16 // Tracks followed at once
+
+// A subject followed across frames by box association
+typedef struct MotionTrack
+{
+    uint16_t id;              // Nonzero, unique until the counter wraps
+    BoundingBox box;          // Last associated box
+    BoundingBox captured_box; // Box at the last high-resolution capture
+    float vx, vy;             // Smoothed centroid velocity in pixels per frame
+    time_t first_seen;
+    time_t last_seen;
+    time_t last_capture;
+    uint32_t hits;            // Frames with an associated box
+    uint32_t misses;          // Consecutive frames without one
+    uint32_t captures;        // Captures requested for this track
+} MotionTrack;
+
+#define MOTION_TRACK_JSON_SIZE 256 // Buffer that always holds motion_track_to_json() output
+
+// Tracks of one detector; each MotionDetector owns one
+typedef struct
+{
+    MotionTrack tracks[MAX_TRACKS];
+    size_t track_count;
+    MotionTrack ended[MAX_TRACKS]; // Ended tracks not yet taken; later ones are dropped when full
+    size_t ended_count;
+    uint32_t ended_total;          // Tracks ended since creation, taken or not
+    uint16_t next_id;
+} MotionTracker;
+
+/**
+ * @brief Drop all tracks, active and ended
+ *
+ * Track ids keep counting, so a zeroed tracker must be reset once before use.
+ *
+ * @param tracker The tracker
+ */
+void motion_tracker_reset(MotionTracker *tracker);
+
+/**
+ * @brief Associate a frame's boxes with the current tracks
+ *
+ * Each box is matched greedily to the track whose predicted box overlaps it most, or failing that
+ * whose centroid is nearest within a gate. Unmatched boxes start new tracks; tracks unmatched for
+ * too many frames end and are queued for motion_tracker_take_ended(). Call once per processed frame,
+ * with no boxes when nothing moved.
+ *
+ * @param tracker The tracker
+ * @param boxes Boxes found in the frame
+ * @param box_count Number of boxes
+ * @param now Frame time
+ * @param track_ids Output track id per box, 0 for a box no track slot was free for
+ * @return true if a track was confirmed or a confirmed track changed enough to warrant a new capture
+ */
+bool motion_tracker_update(MotionTracker *tracker, const BoundingBox *boxes, size_t box_count, time_t now,
+                           uint16_t *track_ids);
+
+/**
+ * @brief Take the tracks that ended since the last call
+ *
+ * @param tracker The tracker
+ * @param tracks Output array
+ * @param max_tracks Capacity of tracks
+ * @return Number of tracks copied
+ */
+size_t motion_tracker_take_ended(MotionTracker *tracker, MotionTrack *tracks, size_t max_tracks);
+
+/**
+ * @brief Copy the active tracks
+ *
+ * @param tracker The tracker
+ * @param tracks Output array
+ * @param max_tracks Capacity of tracks
+ * @return Number of tracks copied
+ */
+size_t motion_tracker_get_tracks(const MotionTracker *tracker, MotionTrack *tracks, size_t max_tracks);
+
+/**
+ * @brief Format an ended track as a one-line JSON summary
+ *
+ * @param track The track
+ * @param buffer Output, MOTION_TRACK_JSON_SIZE bytes is always enough
+ * @param size Size of buffer
+ * @return Length of the summary, as snprintf()
+ */
+int motion_track_to_json(const MotionTrack *track, char *buffer, size_t size);
+
+#endif // MOTION_TRACKER_H
@@ -3,60 +3,507 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include "esp_log.h"
 #include "esp_system.h"
 #include "sdcard_interface.h"
+#include "motion_kernels.h"
+#include "motion_tracker.h"
+#include "motion_workers.h"
+#if CONFIG_SPIRAM_ALLOW_NOINIT_SEG_EXTERNAL_MEMORY
+#include "esp_attr.h"
+#endif
 
 static const char *detectorTag = "detector";
 
-#define ALPHA 0.06f         // lower numbers respond to quicker movements, higher numbers reduce noise sensitivity
-#define FRAME_INIT_COUNT 20 // Number of frames to capture before starting motion detection
+#define BACKGROUND_LEARNING_SHIFT 4 // Default EMA rate is 1 / 2^shift (1..8); higher numbers adapt slower and reduce noise sensitivity
+#define FOREGROUND_LEARNING_SHIFT 8 // Default rate for changed pixels; slower than the background so subjects don't bleed in
+#define FRAME_INIT_COUNT 20         // Default number of frames to capture before starting motion detection
+#define MIN_BOX_AREA 200            // Default: merged boxes smaller than this are dropped
+#define MAX_BOX_AREA 10000          // Default: boxes larger than this are dropped before merging
+#define MERGE_IOU 0.3f              // Default: boxes overlapping by more than this are merged
+#define MAX_LABELS 8192             // Provisional labels available to the component labeler per frame
+#define MAX_COMPONENTS 256          // Connected components reported per frame
+#define MIN_COMPONENT_PIXELS 20     // Minimum pixel count for a component to become a box
+#define MAX_BOXES MAX_COMPONENTS    // Boxes kept per frame before filtering, one per component
+#define SNAPSHOT_MAGIC 0x4742444Du  // "MDBG" little-endian
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HAS_VARIANCE 0x1   // Snapshot flag: a uint16_t variance plane follows the luma plane
+#define SNAPSHOT_MIN_CLOCK 1577836800 // Clocks before 2020 are unsynced and cannot date a snapshot or heatmap
+#define SNAPSHOT_RETAINED_PIXELS (320 * 240) // Largest frame the soft-reset snapshot can hold
+#define TILE_SHIFT 3                // Tile mode works on (1 << TILE_SHIFT) pixel square tiles; 3 or 4
+#define TILE_THRESHOLD_DIVISOR 4    // A tile changes when its mean difference exceeds threshold / divisor
+#define ADAPTIVE_K_SQUARED 9        // Adaptive mode: a change must exceed k = 3 standard deviations
+#define ADAPTIVE_MIN_THRESHOLD 12   // Adaptive mode: differences at or below this are always noise
+#define ADAPTIVE_SEED_VARIANCE 64   // Adaptive mode: variance seeded during initialization (sigma = 8)
+#define VARIANCE_LEARNING_SHIFT 5   // Adaptive mode: variance EMA rate is 1 / 2^shift
+#define LIGHTING_SAMPLE_STEP 8      // Global gain is estimated from every 8th pixel of every 8th row
+#define LIGHTING_MIN_LUMA 16        // Background pixels darker than this are too noisy for a gain sample
+#define LIGHTING_GAIN_TOLERANCE 20  // Median gains within 256 +/- this (about 8%) are left alone
+#define LIGHTING_MIN_GAIN 128       // Gains outside [0.5, 2.0] in Q8 reseed the background instead
+#define LIGHTING_MAX_GAIN 512
+#define MASK_OPENING 1              // Open then close the change mask: specks and gaps under 3 pixels wide go
+#define MAX_ROI_MASKS 4             // Region of interest masks, each active during its own time-of-day window
+#define STAGING_SAMPLE_STEP 4       // Quiet-frame check samples one pixel per 4x4 cell (1/16 of the frame)
+#define STAGING_MIN_CHANGED 1       // Frames with fewer changed samples per mille than this are quiet
+#define STAGING_REFRESH_INTERVAL 8  // Every 8th consecutive quiet frame still runs the full pass
 
+#if TILE_SHIFT < 3 || TILE_SHIFT > 4
+#error "TILE_SHIFT must be 3 (8x8 tiles) or 4 (16x16 tiles)"
+#endif
+
+#define TILE_SIZE (1u << TILE_SHIFT)
+
+// A horizontal run of changed pixels on one row, tagged with its provisional label
+typedef struct
+{
+    uint16_t x_start, x_end;
+    uint32_t label;
+} PixelRun;
+
+// Per-stripe labeler state. Each stripe labels its rows with its own slice of the label table, so
+// stripes never write the same memory while they run in parallel.
+typedef struct
+{
+    PixelRun *runs[2];      // Previous and current row runs for the labeler
+    PixelRun *first_runs;   // Runs on the stripe's first row, joined with the stripe above
+    size_t first_count;
+    PixelRun *last_runs;    // Runs on the stripe's last row; points into runs
+    size_t last_count;
+    uint32_t label_base;    // First label of the stripe's slice of the label table
+    uint32_t label_count;   // Labels used in the current frame
+    bool labels_exhausted;  // Some changed pixels were dropped for lack of labels
+    bool first_row_pending; // The next labeled row is the stripe's first
+    uint32_t *tile_sums;    // Absolute difference sums for the tile row being accumulated
+    uint8_t *coarse_row;    // Pyramid mode: block means of the row group being compared
+} StripeScratch;
+
+// Scratch buffers owned by the detector. They are sized once in motion_detector_create() so the
+// steady-state frame loop never touches the heap.
+typedef struct
+{
+    uint32_t *change_mask;        // 1 bit per pixel, each row padded to whole 32-bit words
+    size_t mask_stride;           // Words per change mask row
+    uint32_t *morph_mask;         // Intermediate mask for the separable open, same layout as change_mask
+    uint32_t *eroded_mask;        // Row-streaming filter: rows after a vertical pass, same layout as change_mask
+    uint32_t *dilated_mask;       // Row-streaming filter: the same rows after the following horizontal pass
+    StripeScratch stripes[MOTION_MAX_STRIPES]; // One per horizontal stripe of the frame
+    uint32_t labels_per_stripe;   // Size of each stripe's slice of the label table
+    uint32_t *label_parent;       // Union-find forest over provisional labels
+    MotionComponent *label_stats; // Statistics per provisional label, valid on roots
+    MotionComponent *components;  // Fixed-capacity table of labeled components
+    BoundingBox *boxes;           // Candidate boxes for the current frame
+    uint16_t *box_parent;         // Union-find forest over boxes while merging
+    uint16_t *track_ids;          // Track assigned to each final box, 0 when untracked
+    uint32_t *tile_mask;          // 1 bit per tile, each row padded to whole 32-bit words
+    size_t tile_stride;           // Words per tile mask row
+    size_t tiles_x, tiles_y;      // Tile grid size, partial tiles included
+    size_t coarse_width;          // Pyramid mode grid size, partial blocks included; the coarse
+    size_t coarse_height;         // change mask reuses change_mask with coarse_stride words per row
+    size_t coarse_stride;
+    uint16_t *gain_samples;       // Q8 frame / background ratios from the sparse lighting sample
+    size_t max_gain_samples;      // Capacity of gain_samples
+} DetectorScratch;
+
+// A region of interest in every mask layout, so no detection path converts per frame
+typedef struct
+{
+    uint32_t *pixels;      // 1 = detect, change mask layout
+    uint32_t *tiles;       // 1 = detect, tile mask layout; set where any pixel of the tile is set
+    uint32_t *coarse;      // 1 = detect, pyramid mask layout; set where any pixel of the block is set
+    uint16_t start_minute; // Active window in local time, minutes since midnight; start == end is always
+    uint16_t end_minute;
+} RoiMask;
+
+// Header of a background snapshot; an 8-bit luma plane follows, then the variance plane if flagged
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t width;
+    uint32_t height;
+    int64_t timestamp; // Wall-clock time the snapshot was taken
+    uint32_t checksum; // FNV-1a over the planes
+} BackgroundSnapshotHeader;
+
+// Progress through a frame delivered in row chunks. Each counter is the number of rows, from the top,
+// that have been through that stage.
+typedef struct
+{
+    const camera_fb_t *frame;  // Frame being filled, NULL outside begin_frame/finish_frame
+    MotionDetectionMode mode;  // Mode fixed for the whole frame
+    bool full_pass;            // False while the model is seeding; the frame is then handled at the end
+    size_t rows_landed;        // Rows reported by motion_detector_push_rows()
+    size_t rows_updated;       // Rows (tile rows in tile mode) through the fused update
+    size_t rows_eroded;        // Rows through the erosion half of the open
+    size_t rows_opened;        // Rows through the whole open
+    size_t rows_dilated;       // Rows through the dilation half of the close
+    size_t rows_closed;        // Rows through the whole close, ready to label
+    size_t rows_labeled;       // Rows (tile rows in tile mode) labeled
+    size_t gain_samples;       // Lighting samples collected so far
+} FrameStream;
+
+// Where motion happened since the heatmap was last saved
+typedef struct
+{
+    uint16_t *counts; // Frames with a changed pixel in each tile, tiles_x * tiles_y, saturating
+    uint32_t frames;  // Frames processed in the period, the most any count could reach
+    time_t start;     // Wall-clock start of the period, 0 until the clock is set
+} MotionHeatmap;
+
+// The wall-clock time, or 0 while the clock is unsynced
+static time_t synced_clock(void)
+{
+    time_t now = time(NULL);
+    return now >= SNAPSHOT_MIN_CLOCK ? now : 0;
+}
+
+// Everything one detector instance learns and owns; instances share nothing but the retained snapshot
+struct MotionDetector
+{
+    MotionDetectorConfig config;
+    BackgroundModel model;
+    DetectorScratch scratch;
+    MotionTracker tracker;
+    MotionWorkers *workers;            // Helpers for stripes 1.., NULL when the frame is a single stripe
+    MotionDetectorStats stats;
+    uint32_t frame_counter;            // Frames seeded so far during initialization
+    size_t frame_allocations;          // Heap allocations made while processing the current frame
+    size_t frame_bytes_touched;        // Frame, background and mask bytes streamed for the current frame
+    uint32_t quiet_streak;             // Consecutive frames that stopped at the sparse check
+    RoiMask roi_masks[MAX_ROI_MASKS];
+    const RoiMask *active_roi;         // Mask applied to the current frame, NULL for the whole frame
+    bool roi_reseed_pending;           // Background outside the old mask is stale and must be reseeded
+    FrameStream stream;                // Frame in progress through the row-streaming API
+    MotionHeatmap heatmap;
+};
+
+#if CONFIG_SPIRAM_ALLOW_NOINIT_SEG_EXTERNAL_MEMORY
+// Kept in PSRAM that startup does not clear, so a soft reset or panic restart can warm-start from it
 typedef struct
 {
-    size_t x_min, y_min;
-    size_t x_max, y_max;
-} BoundingBox;
+    BackgroundSnapshotHeader header;
+    uint8_t luma[SNAPSHOT_RETAINED_PIXELS];
+} RetainedSnapshot;
+
+static EXT_RAM_NOINIT_ATTR RetainedSnapshot retained_snapshot;
+#endif
+
+// Every heap allocation in the detector goes through here so the per-frame count stays honest
+static void *detector_malloc(MotionDetector *detector, size_t size)
+{
+    detector->frame_allocations++;
+    return malloc(size);
+}
+
+static void free_detector_buffers(MotionDetector *detector)
+{
+    free(detector->scratch.change_mask);
+    free(detector->scratch.morph_mask);
+    free(detector->scratch.eroded_mask);
+    free(detector->scratch.dilated_mask);
+    for (size_t s = 0; s < MOTION_MAX_STRIPES; s++)
+    {
+        free(detector->scratch.stripes[s].runs[0]);
+        free(detector->scratch.stripes[s].runs[1]);
+        free(detector->scratch.stripes[s].first_runs);
+        free(detector->scratch.stripes[s].tile_sums);
+        free(detector->scratch.stripes[s].coarse_row);
+    }
+    free(detector->scratch.label_parent);
+    free(detector->scratch.label_stats);
+    free(detector->scratch.components);
+    free(detector->scratch.boxes);
+    free(detector->scratch.box_parent);
+    free(detector->scratch.track_ids);
+    free(detector->scratch.tile_mask);
+    free(detector->heatmap.counts);
+    free(detector->scratch.gain_samples);
+    free(detector->model.background);
+    free(detector->model.variance);
+    for (size_t i = 0; i < MAX_ROI_MASKS; i++)
+    {
+        free(detector->roi_masks[i].pixels);
+        free(detector->roi_masks[i].tiles);
+        free(detector->roi_masks[i].coarse);
+    }
+}
+
+// Size every buffer for the configured frame geometry
+static esp_err_t allocate_detector_buffers(MotionDetector *detector)
+{
+    size_t width = detector->config.width;
+    size_t height = detector->config.height;
+    size_t max_boxes = detector->config.max_boxes;
+    size_t max_runs_per_row = (width + 1) / 2;
+    detector->scratch.mask_stride = (width + 31) / 32;
+    detector->scratch.change_mask = (uint32_t *)detector_malloc(detector, detector->scratch.mask_stride * height * sizeof(uint32_t));
+    detector->scratch.morph_mask = (uint32_t *)detector_malloc(detector, detector->scratch.mask_stride * height * sizeof(uint32_t));
+    detector->scratch.eroded_mask = (uint32_t *)detector_malloc(detector, detector->scratch.mask_stride * height * sizeof(uint32_t));
+    detector->scratch.dilated_mask = (uint32_t *)detector_malloc(detector, detector->scratch.mask_stride * height * sizeof(uint32_t));
+    detector->scratch.label_parent = (uint32_t *)detector_malloc(detector, MAX_LABELS * sizeof(uint32_t));
+    detector->scratch.label_stats = (MotionComponent *)detector_malloc(detector, MAX_LABELS * sizeof(MotionComponent));
+    detector->scratch.components = (MotionComponent *)detector_malloc(detector, MAX_COMPONENTS * sizeof(MotionComponent));
+    detector->scratch.boxes = (BoundingBox *)detector_malloc(detector, max_boxes * sizeof(BoundingBox));
+    detector->scratch.box_parent = (uint16_t *)detector_malloc(detector, max_boxes * sizeof(uint16_t));
+    detector->scratch.track_ids = (uint16_t *)detector_malloc(detector, max_boxes * sizeof(uint16_t));
+    detector->scratch.tiles_x = (width + TILE_SIZE - 1) >> TILE_SHIFT;
+    detector->scratch.tiles_y = (height + TILE_SIZE - 1) >> TILE_SHIFT;
+    detector->scratch.tile_stride = (detector->scratch.tiles_x + 31) / 32;
+    size_t block = (size_t)1 << detector->config.pyramid_shift;
+    detector->scratch.coarse_width = (width + block - 1) >> detector->config.pyramid_shift;
+    detector->scratch.coarse_height = (height + block - 1) >> detector->config.pyramid_shift;
+    detector->scratch.coarse_stride = (detector->scratch.coarse_width + 31) / 32;
+    detector->scratch.tile_mask = (uint32_t *)detector_malloc(detector, detector->scratch.tile_stride * detector->scratch.tiles_y * sizeof(uint32_t));
+    detector->heatmap.counts = (uint16_t *)detector_malloc(detector, detector->scratch.tiles_x * detector->scratch.tiles_y * sizeof(uint16_t));
+    detector->scratch.max_gain_samples = ((width + LIGHTING_SAMPLE_STEP - 1) / LIGHTING_SAMPLE_STEP) *
+                                         ((height + LIGHTING_SAMPLE_STEP - 1) / LIGHTING_SAMPLE_STEP);
+    detector->scratch.gain_samples = (uint16_t *)detector_malloc(detector, detector->scratch.max_gain_samples * sizeof(uint16_t));
+    detector->model.background = (uint16_t *)detector_malloc(detector, width * height * sizeof(uint16_t));
+    if (detector->config.mode == MOTION_MODE_ADAPTIVE)
+    {
+        detector->model.variance = (uint16_t *)detector_malloc(detector, width * height * sizeof(uint16_t));
+    }
+
+    // The label table is split evenly between the stripes, so striping costs no extra label memory
+    bool stripes_allocated = true;
+    detector->scratch.labels_per_stripe = MAX_LABELS / detector->config.stripes;
+    for (size_t s = 0; s < detector->config.stripes; s++)
+    {
+        StripeScratch *stripe = &detector->scratch.stripes[s];
+        stripe->runs[0] = (PixelRun *)detector_malloc(detector, max_runs_per_row * sizeof(PixelRun));
+        stripe->runs[1] = (PixelRun *)detector_malloc(detector, max_runs_per_row * sizeof(PixelRun));
+        stripe->first_runs = (PixelRun *)detector_malloc(detector, max_runs_per_row * sizeof(PixelRun));
+        stripe->tile_sums = (uint32_t *)detector_malloc(detector, detector->scratch.tiles_x * sizeof(uint32_t));
+        stripe->coarse_row = (uint8_t *)detector_malloc(detector, detector->scratch.coarse_width);
+        stripe->label_base = s * detector->scratch.labels_per_stripe;
+        stripes_allocated = stripes_allocated && stripe->runs[0] && stripe->runs[1] && stripe->first_runs &&
+                            stripe->tile_sums && stripe->coarse_row;
+    }
+
+    if (!detector->scratch.change_mask || !detector->scratch.morph_mask || !detector->scratch.eroded_mask ||
+        !detector->scratch.dilated_mask || !stripes_allocated ||
+        !detector->scratch.label_parent || !detector->scratch.label_stats ||
+        !detector->scratch.components || !detector->scratch.boxes || !detector->scratch.box_parent ||
+        !detector->scratch.track_ids || !detector->scratch.tile_mask || !detector->heatmap.counts ||
+        !detector->scratch.gain_samples || !detector->model.background ||
+        (detector->config.mode == MOTION_MODE_ADAPTIVE && !detector->model.variance))
+    {
+        ESP_LOGE(detectorTag, "Failed to allocate detector buffers for %zux%zu", width, height);
+        return ESP_ERR_NO_MEM;
+    }
+    detector->model.width = width;
+    detector->model.height = height;
+    detector->model.scale_shift = detector->config.mode == MOTION_MODE_PYRAMID ? detector->config.pyramid_shift : 0;
+    memset(detector->heatmap.counts, 0, detector->scratch.tiles_x * detector->scratch.tiles_y * sizeof(uint16_t));
+    detector->heatmap.start = synced_clock();
+    return ESP_OK;
+}
+
+// Round a staging sample step down to a power of two so the jitter is a mask
+static MotionStagingConfig normalize_staging_config(const MotionStagingConfig *config)
+{
+    MotionStagingConfig normalized = *config;
+    uint8_t step = 1;
+    while (step <= config->sample_step / 2)
+    {
+        step <<= 1;
+    }
+    normalized.sample_step = step;
+    return normalized;
+}
+
+void motion_detector_default_config(MotionDetectorConfig *config, size_t width, size_t height)
+{
+    MotionDetectorConfig defaults = {
+        .width = width,
+        .height = height,
+        .mode = MOTION_MODE_PIXEL,
+        .threshold = 50,
+        .background_shift = BACKGROUND_LEARNING_SHIFT,
+        .foreground_shift = FOREGROUND_LEARNING_SHIFT,
+        .init_frames = FRAME_INIT_COUNT,
+        .max_boxes = MAX_BOXES,
+        .min_box_area = MIN_BOX_AREA,
+        .max_box_area = MAX_BOX_AREA,
+        .merge_iou = MERGE_IOU,
+        .stripes = MOTION_DEFAULT_STRIPES,
+        .pyramid_shift = MOTION_DEFAULT_PYRAMID_SHIFT,
+        .staging = {
+            .sample_step = STAGING_SAMPLE_STEP,
+            .min_changed_permille = STAGING_MIN_CHANGED,
+            .refresh_interval = STAGING_REFRESH_INTERVAL}};
+    *config = defaults;
+}
+
+esp_err_t motion_detector_create(const MotionDetectorConfig *config, MotionDetector **out_detector)
+{
+    if (!config || !out_detector || config->width == 0 || config->height == 0 ||
+        config->width > UINT16_MAX || config->mode > MOTION_MODE_PYRAMID ||
+        config->pyramid_shift < 1 || config->pyramid_shift > 2 ||
+        config->background_shift < 1 || config->background_shift > 8 ||
+        config->foreground_shift < 1 || config->foreground_shift > 8 ||
+        config->max_boxes == 0 || config->max_boxes > MAX_BOXES ||
+        config->merge_iou < 0 || config->merge_iou > 1 ||
+        config->stripes == 0 || config->stripes > MOTION_MAX_STRIPES ||
+        config->stripes > (config->height + TILE_SIZE - 1) >> TILE_SHIFT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    MotionDetector *detector = (MotionDetector *)calloc(1, sizeof(MotionDetector));
+    if (!detector)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    detector->config = *config;
+    detector->config.staging = normalize_staging_config(&config->staging);
+    motion_tracker_reset(&detector->tracker);
+
+    esp_err_t err = allocate_detector_buffers(detector);
+    if (err == ESP_OK && config->stripes > 1)
+    {
+        err = motion_workers_create(config->stripes - 1, &detector->workers);
+    }
+    if (err != ESP_OK)
+    {
+        motion_detector_destroy(detector);
+        return err;
+    }
+    *out_detector = detector;
+    return ESP_OK;
+}
+
+void motion_detector_destroy(MotionDetector *detector)
+{
+    if (!detector)
+    {
+        return;
+    }
+    motion_workers_destroy(detector->workers);
+    free_detector_buffers(detector);
+    free(detector);
+}
 
-BackgroundModel bg_model = {NULL, 0, 0, false};
+// Values in the background plane: one per pixel, or one per block in pyramid mode
+static size_t background_plane_size(const MotionDetector *detector)
+{
+    if (detector->model.scale_shift)
+    {
+        return detector->scratch.coarse_width * detector->scratch.coarse_height;
+    }
+    return detector->model.width * detector->model.height;
+}
 
-static int frame_counter = 0; // Frame counter for initialization
+// Rounded background luma at a frame pixel, whatever the plane's resolution
+static inline uint8_t background_luma(const MotionDetector *detector, size_t x, size_t y)
+{
+    unsigned shift = detector->model.scale_shift;
+    size_t plane_width = shift ? detector->scratch.coarse_width : detector->model.width;
+    return (uint8_t)((detector->model.background[(y >> shift) * plane_width + (x >> shift)] + 128) >> 8);
+}
 
-void initialize_background_model(size_t width, size_t height)
+// Set the background plane from a full-resolution luma plane, box-filtering it in pyramid mode.
+// Writes only the start of the plane, below luma when luma is staged at the end of the same buffer.
+static void set_background_from_luma(MotionDetector *detector, const uint8_t *luma)
 {
-    if (bg_model.background)
+    size_t width = detector->model.width;
+    size_t height = detector->model.height;
+    unsigned shift = detector->model.scale_shift;
+    if (!shift)
+    {
+        for (size_t i = 0; i < width * height; i++)
+        {
+            detector->model.background[i] = (uint16_t)(luma[i] << 8);
+        }
+        return;
+    }
+    uint8_t *means = detector->scratch.stripes[0].coarse_row;
+    size_t coarse_width = detector->scratch.coarse_width;
+    for (size_t cy = 0; cy < detector->scratch.coarse_height; cy++)
     {
-        free(bg_model.background);
+        size_t y = cy << shift;
+        size_t rows = height - y < ((size_t)1 << shift) ? height - y : (size_t)1 << shift;
+        motion_kernel_downscale_rows(luma + y * width, width, rows, shift, means);
+        for (size_t cx = 0; cx < coarse_width; cx++)
+        {
+            detector->model.background[cy * coarse_width + cx] = (uint16_t)(means[cx] << 8);
+        }
     }
-    bg_model.background = (uint8_t *)malloc(width * height);
-    bg_model.width = width;
-    bg_model.height = height;
-    bg_model.initialized = false;
-    frame_counter = 0;
 }
 
-void update_background_model(camera_fb_t *frame)
+// Move the background between full resolution and the pyramid grid in place. Going down, every
+// block mean lands at or before the first pixel it reads; going up, every pixel is written at or
+// after the block it reads, so walking backwards never overwrites a block still needed.
+static void resample_background(MotionDetector *detector, unsigned new_shift)
 {
-    if (!bg_model.background || bg_model.width != frame->width || bg_model.height != frame->height)
+    if (new_shift == detector->model.scale_shift)
+    {
+        return;
+    }
+    uint16_t *background = detector->model.background;
+    size_t width = detector->model.width;
+    size_t height = detector->model.height;
+    size_t coarse_width = detector->scratch.coarse_width;
+    if (new_shift)
+    {
+        size_t block = (size_t)1 << new_shift;
+        for (size_t cy = 0; cy < detector->scratch.coarse_height; cy++)
+        {
+            for (size_t cx = 0; cx < coarse_width; cx++)
+            {
+                size_t y_end = (cy + 1) * block < height ? (cy + 1) * block : height;
+                size_t x_end = (cx + 1) * block < width ? (cx + 1) * block : width;
+                uint32_t sum = 0;
+                uint32_t count = 0;
+                for (size_t y = cy * block; y < y_end; y++)
+                {
+                    for (size_t x = cx * block; x < x_end; x++)
+                    {
+                        sum += background[y * width + x];
+                        count++;
+                    }
+                }
+                background[cy * coarse_width + cx] = (uint16_t)((sum + count / 2) / count);
+            }
+        }
+    }
+    else
     {
-        initialize_background_model(frame->width, frame->height);
+        unsigned shift = detector->model.scale_shift;
+        for (size_t i = width * height; i-- > 0;)
+        {
+            size_t y = i / width;
+            size_t x = i % width;
+            background[i] = background[(y >> shift) * coarse_width + (x >> shift)];
+        }
     }
+    detector->model.scale_shift = (uint8_t)new_shift;
+}
 
-    if (frame_counter < FRAME_INIT_COUNT)
+// Replace the background with the frame, dropping all history
+static void seed_background_from_frame(MotionDetector *detector, const camera_fb_t *frame)
+{
+    set_background_from_luma(detector, frame->buf);
+    if (detector->model.variance)
     {
-        memcpy(bg_model.background, frame->buf, frame->len);
-        frame_counter++; // Increment counter with each frame
-        if (frame_counter >= FRAME_INIT_COUNT)
+        for (size_t i = 0; i < frame->len; i++)
         {
-            bg_model.initialized = true; // Mark the background as initialized after enough frames
-            ESP_LOGI(detectorTag, "Background model initialized after %d frames", frame_counter);
+            detector->model.variance[i] = ADAPTIVE_SEED_VARIANCE;
         }
-        return; // Skip background update and motion detection until initialized
     }
-    for (size_t i = 0; i < frame->len; i++)
+}
+
+// Seed the background from the first frames until the model counts as learned
+static void initialize_background_from_frame(MotionDetector *detector, const camera_fb_t *frame)
+{
+    seed_background_from_frame(detector, frame);
+    detector->frame_counter++;
+    if (detector->frame_counter >= detector->config.init_frames)
     {
-        // Adjust ALPHA if the background update is too fast or slow
-        bg_model.background[i] = (uint8_t)((1 - ALPHA) * bg_model.background[i] + ALPHA * frame->buf[i]);
+        detector->model.initialized = true; // Mark the background as initialized after enough frames
+        ESP_LOGI(detectorTag, "Background model initialized after %lu frames", (unsigned long)detector->frame_counter);
     }
 }
 // Calculate the intersection area of two boxes
@@ -110,78 +557,157 @@ BoundingBox merge_boxes(BoundingBox box1, BoundingBox box2)
         .y_max = (box1.y_max > box2.y_max) ? box1.y_max : box2.y_max};
     return merged;
 }
-// Filter out boxes that are too large (based on area)
+static size_t box_area(BoundingBox box)
+{
+    return (box.x_max - box.x_min) * (box.y_max - box.y_min);
+}
+
+// Remove boxes larger than max_area in a single compaction pass
 void filter_large_boxes(BoundingBox *boxes, size_t *box_count, size_t max_area)
 {
-    size_t i = 0;
-    while (i < *box_count)
+    size_t kept = 0;
+    for (size_t i = 0; i < *box_count; i++)
     {
-        size_t area = (boxes[i].x_max - boxes[i].x_min) * (boxes[i].y_max - boxes[i].y_min);
-        if (area > max_area)
-        {
-            // Shift all boxes down to remove the current box
-            for (size_t j = i; j < *box_count - 1; j++)
-            {
-                boxes[j] = boxes[j + 1];
-            }
-            (*box_count)--; // Reduce the count
-        }
-        else
+        if (box_area(boxes[i]) <= max_area)
         {
-            i++;
+            boxes[kept++] = boxes[i];
         }
     }
+    *box_count = kept;
 }
-// Filter overlapping boxes based on IoU threshold and merge them
-void filter_and_merge_boxes(BoundingBox *boxes, size_t *box_count, float iou_threshold, size_t max_area)
+
+static int compare_box_x_min(const void *a, const void *b)
 {
-    // First, filter out large boxes
-    filter_large_boxes(boxes, box_count, max_area);
+    const BoundingBox *box_a = (const BoundingBox *)a;
+    const BoundingBox *box_b = (const BoundingBox *)b;
+    return (box_a->x_min > box_b->x_min) - (box_a->x_min < box_b->x_min);
+}
 
-    // Merge overlapping boxes based on IoU threshold
+static uint16_t find_box_root(uint16_t *parent, uint16_t i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static void join_boxes(uint16_t *parent, size_t i, size_t j)
+{
+    uint16_t root_i = find_box_root(parent, (uint16_t)i);
+    uint16_t root_j = find_box_root(parent, (uint16_t)j);
+    // Keep the lower index as root so it is visited before its members
+    parent[root_i > root_j ? root_i : root_j] = root_i < root_j ? root_i : root_j;
+}
+
+// Fold every group joined in parent into its root and compact the roots to the front, keeping their
+// order. grown marks, by position, the roots that absorbed a box. Returns how many did.
+static size_t fold_box_groups(BoundingBox *boxes, uint16_t *parent, size_t *box_count, uint32_t *grown)
+{
+    memset(grown, 0, (*box_count + 31) / 32 * sizeof(uint32_t));
     for (size_t i = 0; i < *box_count; i++)
     {
-        for (size_t j = i + 1; j < *box_count; j++)
+        uint16_t root = find_box_root(parent, (uint16_t)i);
+        if (root != i)
         {
-            if (calculate_iou(boxes[i], boxes[j]) > iou_threshold)
-            {
-                // Merge the overlapping boxes
-                BoundingBox merged_box = merge_boxes(boxes[i], boxes[j]);
-                boxes[i] = merged_box; // Replace the first box with the merged one
-
-                // Shift all boxes down to remove the second box
-                for (size_t k = j; k < *box_count - 1; k++)
-                {
-                    boxes[k] = boxes[k + 1];
-                }
-                (*box_count)--; // Reduce the count
-                j--;            // Recheck the current index
-            }
+            boxes[root] = merge_boxes(boxes[root], boxes[i]);
+            grown[root >> 5] |= 1u << (root & 31);
+        }
+    }
+    size_t kept = 0;
+    size_t grown_count = 0;
+    for (size_t i = 0; i < *box_count; i++)
+    {
+        if (parent[i] == i)
+        {
+            // kept <= i, so bit kept has already been read
+            bool root_grown = (grown[i >> 5] >> (i & 31)) & 1;
+            grown[kept >> 5] = (grown[kept >> 5] & ~(1u << (kept & 31))) | ((uint32_t)root_grown << (kept & 31));
+            grown_count += root_grown;
+            boxes[kept++] = boxes[i];
         }
     }
+    for (size_t i = kept; i < *box_count; i++)
+    {
+        grown[i >> 5] &= ~(1u << (i & 31));
+    }
+    *box_count = kept;
+    return grown_count;
 }
 
-// Filter overlapping boxes based on IoU threshold
-void filter_boxes_by_iou(BoundingBox *boxes, size_t *box_count, float iou_threshold)
+// Merge every group of boxes connected by IoU above the threshold, until no two boxes left overlap by
+// more than it. The first round sorts the boxes by x_min and sweeps them, so only pairs that overlap
+// horizontally are tested: O(n log n) plus those pairs. A merged box can grow into a new overlap, but
+// boxes that did not change were already tested against each other, so later rounds test only the
+// boxes that grew, each against the rest: O(n) per merged box. The result is left sorted by x_min.
+// parent holds *box_count entries.
+static void merge_overlapping_boxes(BoundingBox *boxes, uint16_t *parent, size_t *box_count, float iou_threshold)
 {
+    if (*box_count < 2)
+    {
+        return;
+    }
+    uint32_t grown[(MAX_BOXES + 31) / 32];
+    qsort(boxes, *box_count, sizeof(BoundingBox), compare_box_x_min);
+    for (size_t i = 0; i < *box_count; i++)
+    {
+        parent[i] = (uint16_t)i;
+    }
     for (size_t i = 0; i < *box_count; i++)
     {
-        for (size_t j = i + 1; j < *box_count; j++)
+        for (size_t j = i + 1; j < *box_count && boxes[j].x_min < boxes[i].x_max; j++)
         {
             if (calculate_iou(boxes[i], boxes[j]) > iou_threshold)
             {
-                // Merge boxes or discard the duplicate one
-                // For simplicity, let's just discard the second box for now
-                // You can choose to merge the boxes if necessary
-                for (size_t k = j; k < *box_count - 1; k++)
+                join_boxes(parent, i, j);
+            }
+        }
+    }
+    size_t grown_count = fold_box_groups(boxes, parent, box_count, grown);
+    if (grown_count == 0)
+    {
+        // Nothing merged, so the boxes are still sorted
+        return;
+    }
+
+    do
+    {
+        for (size_t i = 0; i < *box_count; i++)
+        {
+            parent[i] = (uint16_t)i;
+        }
+        for (size_t i = 0; i < *box_count; i++)
+        {
+            if (!((grown[i >> 5] >> (i & 31)) & 1))
+            {
+                continue;
+            }
+            for (size_t j = 0; j < *box_count; j++)
+            {
+                // A pair of grown boxes is tested once, from the lower index
+                bool j_grown = (grown[j >> 5] >> (j & 31)) & 1;
+                if (j != i && (!j_grown || j > i) && calculate_iou(boxes[i], boxes[j]) > iou_threshold)
                 {
-                    boxes[k] = boxes[k + 1];
+                    join_boxes(parent, i, j);
                 }
-                (*box_count)--; // Reduce the count
-                j--;            // Recheck the current index
             }
         }
-    }
+        grown_count = fold_box_groups(boxes, parent, box_count, grown);
+    } while (grown_count > 0);
+    // Merged boxes may have moved their x_min left
+    qsort(boxes, *box_count, sizeof(BoundingBox), compare_box_x_min);
+}
+
+// Filter overlapping boxes based on IoU threshold and merge them
+void filter_and_merge_boxes(BoundingBox *boxes, uint16_t *parent, size_t *box_count, float iou_threshold,
+                            size_t max_area)
+{
+    // First, filter out large boxes
+    filter_large_boxes(boxes, box_count, max_area);
+
+    // Merge overlapping boxes based on IoU threshold
+    merge_overlapping_boxes(boxes, parent, box_count, iou_threshold);
 }
 
 void draw_bounding_box(camera_fb_t *frame, BoundingBox box)
@@ -190,271 +716,1892 @@ void draw_bounding_box(camera_fb_t *frame, BoundingBox box)
     // For simplicity, this is a placeholder as rendering depends on your display library
     ESP_LOGI(detectorTag, "Bounding Box - x_min: %d, y_min: %d, x_max: %d, y_max: %d", box.x_min, box.y_min, box.x_max, box.y_max);
 }
-void filter_small_boxes(BoundingBox *boxes, size_t *box_count, size_t min_area)
+// Remove boxes smaller than min_area and boxes touching the frame edge in a single compaction pass
+void filter_small_and_edge_touching_boxes(BoundingBox *boxes, size_t *box_count, size_t min_area,
+                                          size_t frame_width, size_t frame_height)
 {
-    size_t i = 0;
-    while (i < *box_count)
+    size_t kept = 0;
+    for (size_t i = 0; i < *box_count; i++)
     {
-        size_t area = (boxes[i].x_max - boxes[i].x_min) * (boxes[i].y_max - boxes[i].y_min);
-        if (area < min_area)
-        {
-            // Remove small box
-            for (size_t j = i; j < *box_count - 1; j++)
-            {
-                boxes[j] = boxes[j + 1];
-            }
-            (*box_count)--;
-        }
-        else
+        bool touches_edge = boxes[i].x_min == 0 || boxes[i].y_min == 0 ||
+                            boxes[i].x_max == frame_width - 1 || boxes[i].y_max == frame_height - 1;
+        if (box_area(boxes[i]) >= min_area && !touches_edge)
         {
-            i++;
+            boxes[kept++] = boxes[i];
         }
     }
+    *box_count = kept;
 }
-void filter_edge_touching_boxes(BoundingBox *boxes, size_t *box_count, size_t frame_width, size_t frame_height)
+// Find the root label of a union-find tree, halving the path as we go
+static uint32_t find_root(uint32_t *parent, uint32_t label)
 {
-    size_t i = 0;
-    while (i < *box_count)
+    while (parent[label] != label)
     {
-        // Check if the box touches any edge
-        if (boxes[i].x_min == 0 || boxes[i].y_min == 0 ||
-            boxes[i].x_max == frame_width - 1 || boxes[i].y_max == frame_height - 1)
-        {
-            // Remove this box by shifting all subsequent boxes
-            for (size_t j = i; j < *box_count - 1; j++)
-            {
-                boxes[j] = boxes[j + 1];
-            }
-            (*box_count)--; // Decrease the count of boxes
-        }
-        else
-        {
-            i++; // Move to next box only if current box was not removed
-        }
+        parent[label] = parent[parent[label]];
+        label = parent[label];
     }
+    return label;
 }
-char *boxes_to_json(BoundingBox *boxes, size_t box_count)
+
+// Join two labels, folding the statistics of one root into the other
+static void union_labels(uint32_t *parent, MotionComponent *stats, uint32_t a, uint32_t b)
 {
-    if (box_count == 0 || boxes == NULL)
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a == b)
     {
-        return strdup("[]"); // Return an empty JSON array if there are no boxes
+        return;
     }
-
-    size_t estimated_size = box_count * 120; // Start with a larger estimate
-    char *json_string = (char *)malloc(estimated_size);
-    if (json_string == NULL)
+    if (b < a)
     {
-        ESP_LOGE("boxes_to_json", "Failed to allocate memory for JSON string");
-        return NULL;
+        uint32_t tmp = a;
+        a = b;
+        b = tmp;
     }
+    parent[b] = a;
+    if (stats[b].x_min < stats[a].x_min)
+        stats[a].x_min = stats[b].x_min;
+    if (stats[b].y_min < stats[a].y_min)
+        stats[a].y_min = stats[b].y_min;
+    if (stats[b].x_max > stats[a].x_max)
+        stats[a].x_max = stats[b].x_max;
+    if (stats[b].y_max > stats[a].y_max)
+        stats[a].y_max = stats[b].y_max;
+    stats[a].pixel_count += stats[b].pixel_count;
+    stats[a].sum_x += stats[b].sum_x;
+    stats[a].sum_y += stats[b].sum_y;
+}
 
-    char *current_position = json_string;
-    size_t remaining_size = estimated_size;
-
-    // Start the JSON array
-    int written = snprintf(current_position, remaining_size, "[");
-    current_position += written;
-    remaining_size -= written;
+static inline bool roi_contains(const RoiMask *roi, size_t stride, size_t x, size_t y)
+{
+    return !roi || ((roi->pixels[y * stride + (x >> 5)] >> (x & 31)) & 1);
+}
 
-    for (size_t i = 0; i < box_count; i++)
+static bool roi_window_contains(const RoiMask *roi, uint16_t minute)
+{
+    if (roi->start_minute == roi->end_minute)
     {
-        // Format each bounding box as a JSON object
-        written = snprintf(current_position, remaining_size,
-                           "{\"x_min\":%zu,\"y_min\":%zu,\"x_max\":%zu,\"y_max\":%zu}",
-                           boxes[i].x_min, boxes[i].y_min, boxes[i].x_max, boxes[i].y_max);
+        return true;
+    }
+    if (roi->start_minute < roi->end_minute)
+    {
+        return minute >= roi->start_minute && minute < roi->end_minute;
+    }
+    // Window wraps past midnight
+    return minute >= roi->start_minute || minute < roi->end_minute;
+}
 
-        if (written >= remaining_size)
+// Pick the first loaded mask whose window contains the local time. Pixels outside a mask are not
+// learned, so any change of mask needs the background reseeded before detection resumes.
+static void select_active_roi(MotionDetector *detector)
+{
+    const RoiMask *selected = NULL;
+    bool any_loaded = false;
+    for (size_t i = 0; i < MAX_ROI_MASKS; i++)
+    {
+        any_loaded |= detector->roi_masks[i].pixels != NULL;
+    }
+    if (any_loaded)
+    {
+        time_t now = time(NULL);
+        struct tm local;
+        localtime_r(&now, &local);
+        uint16_t minute = (uint16_t)(local.tm_hour * 60 + local.tm_min);
+        for (size_t i = 0; i < MAX_ROI_MASKS && !selected; i++)
         {
-            // We’re out of space; double size with reallocation
-            size_t current_length = current_position - json_string;
-            estimated_size *= 2;
-            char *new_string = (char *)realloc(json_string, estimated_size);
-            if (new_string == NULL)
+            if (detector->roi_masks[i].pixels && roi_window_contains(&detector->roi_masks[i], minute))
             {
-                ESP_LOGE("boxes_to_json", "Failed to reallocate memory for JSON string");
-                free(json_string);
-                return NULL;
+                selected = &detector->roi_masks[i];
             }
-            json_string = new_string;
-            current_position = json_string + current_length;
-            remaining_size = estimated_size - current_length;
-
-            // Retry writing
-            written = snprintf(current_position, remaining_size,
-                               "{\"x_min\":%zu,\"y_min\":%zu,\"x_max\":%zu,\"y_max\":%zu}",
-                               boxes[i].x_min, boxes[i].y_min, boxes[i].x_max, boxes[i].y_max);
         }
+    }
+    if (selected != detector->active_roi)
+    {
+        ESP_LOGI(detectorTag, "Region of interest %d active", selected ? (int)(selected - detector->roi_masks) : -1);
+        detector->active_roi = selected;
+        detector->roi_reseed_pending = true;
+    }
+}
 
-        current_position += written;
-        remaining_size -= written;
-
-        // Add a comma if it’s not the last box
-        if (i < box_count - 1)
+// Quickselect the median of values; reorders values
+static uint16_t select_median(uint16_t *values, size_t count)
+{
+    size_t target = count / 2;
+    size_t low = 0;
+    size_t high = count - 1;
+    while (low < high)
+    {
+        uint16_t pivot = values[(low + high) / 2];
+        size_t i = low;
+        size_t j = high;
+        while (i <= j)
         {
-            written = snprintf(current_position, remaining_size, ",");
-            current_position += written;
-            remaining_size -= written;
+            while (values[i] < pivot)
+                i++;
+            while (values[j] > pivot)
+                j--;
+            if (i <= j)
+            {
+                uint16_t tmp = values[i];
+                values[i] = values[j];
+                values[j] = tmp;
+                i++;
+                if (j == 0)
+                    break;
+                j--;
+            }
         }
+        if (target <= j)
+            high = j;
+        else if (target >= i)
+            low = i;
+        else
+            break;
     }
-
-    // Close the JSON array
-    snprintf(current_position, remaining_size, "]");
-
-    // Optional: Trim memory to actual size
-    size_t final_size = current_position - json_string + 1; // +1 for null terminator
-    char *final_json = (char *)realloc(json_string, final_size);
-    return final_json ? final_json : json_string; // Return final allocation or original
+    return values[target];
 }
 
-bool detect_motion(camera_fb_t *current_frame, float threshold, time_t *detection_timestamp)
+// Add the lighting samples on rows [y_begin, y_end) to the count already collected for the frame and
+// return the new count. Samples sit on every LIGHTING_SAMPLE_STEP-th pixel of every
+// LIGHTING_SAMPLE_STEP-th row.
+static size_t collect_gain_samples(MotionDetector *detector, const uint8_t *frame, size_t width, size_t y_begin,
+                                   size_t y_end, size_t count)
 {
-    // Declare local variables
-    size_t max_boxes = 30;
-    size_t box_count = 0;
-    size_t max_area = 10000; // the max size of a valid box
-    size_t min_area = 200;
-    float iou_threshold = 0.3;
-    BoundingBox *boxes = (BoundingBox *)malloc(max_boxes * sizeof(BoundingBox));
-
-    if (!current_frame || !bg_model.background || bg_model.width != current_frame->width || bg_model.height != current_frame->height)
+    size_t y_first = y_begin + (LIGHTING_SAMPLE_STEP + LIGHTING_SAMPLE_STEP / 2 - y_begin % LIGHTING_SAMPLE_STEP) %
+                                   LIGHTING_SAMPLE_STEP;
+    for (size_t y = y_first; y < y_end; y += LIGHTING_SAMPLE_STEP)
     {
-        ESP_LOGD(detectorTag, "Frame error or background model not initialized");
-        return false;
-    }
-    // Update the background model
-    update_background_model(current_frame);
-
-    if (!bg_model.initialized)
+        for (size_t x = LIGHTING_SAMPLE_STEP / 2; x < width; x += LIGHTING_SAMPLE_STEP)
+        {
+            uint32_t bg_luma = background_luma(detector, x, y);
+            if (bg_luma < LIGHTING_MIN_LUMA || !roi_contains(detector->active_roi, detector->scratch.mask_stride, x, y))
+            {
+                continue;
+            }
+            uint32_t ratio = ((uint32_t)frame[y * width + x] << 8) / bg_luma;
+            detector->scratch.gain_samples[count++] = (uint16_t)(ratio > UINT16_MAX ? UINT16_MAX : ratio);
+        }
+    }
+    return count;
+}
+
+// Median of the collected gain samples, or 256 when there are too few usable samples
+static uint32_t median_gain(MotionDetector *detector, size_t count)
+{
+    if (count == 0 || count < detector->scratch.max_gain_samples / 4)
     {
-        free(boxes); // Free the allocated memory before returning
-        return false;
+        return 256;
     }
+    return select_median(detector->scratch.gain_samples, count);
+}
 
-    int changed_pixels = 0;
-    size_t *pixel_x = (size_t *)malloc(current_frame->len * sizeof(size_t));
-    size_t *pixel_y = (size_t *)malloc(current_frame->len * sizeof(size_t));
+// Estimate the global gain between the frame and the background as the median Q8 ratio of a sparse
+// pixel sample. The median ignores a subject covering less than half the sampled pixels.
+// Returns 256 when there are too few usable samples.
+static uint32_t estimate_global_gain(MotionDetector *detector, const uint8_t *frame, size_t width, size_t height)
+{
+    size_t count = collect_gain_samples(detector, frame, width, 0, height, 0);
+    return median_gain(detector, count);
+}
 
-    size_t width = current_frame->width;
-    size_t height = current_frame->height;
+// Multiply the whole background by a Q8 gain so a global brightness step is not seen as motion
+static void rescale_background(MotionDetector *detector, uint32_t gain)
+{
+    size_t pixels = background_plane_size(detector);
+    for (size_t i = 0; i < pixels; i++)
+    {
+        uint32_t scaled = (detector->model.background[i] * gain) >> 8;
+        detector->model.background[i] = (uint16_t)(scaled > (255u << 8) ? (255u << 8) : scaled);
+    }
+    detector->frame_bytes_touched += 2 * pixels * sizeof(uint16_t);
+}
+
+// Fixed offsets for the sparse check, so the sample grid does not alias with regular texture
+static const uint8_t staging_jitter[16] = {5, 14, 2, 9, 12, 0, 7, 11, 3, 15, 8, 1, 10, 6, 13, 4};
 
-    // Track positions of changed pixels
-    for (size_t i = 0; i < current_frame->len; i++)
+// Count jittered grid samples whose difference from the background exceeds threshold.
+// Each row of cells samples a single image row so only 1 / step of the frame is read.
+// Stops early once min_changed samples are found; *sampled receives the number of samples taken.
+static size_t count_changed_samples(MotionDetector *detector, const uint8_t *frame, size_t width, size_t height,
+                                    uint8_t threshold, size_t min_changed, size_t *sampled)
+{
+    size_t step = detector->config.staging.sample_step;
+    size_t jitter_mask = step - 1;
+    size_t changed = 0;
+    size_t count = 0;
+    for (size_t cell_y = 0; cell_y < height; cell_y += step)
     {
-        if (abs(bg_model.background[i] - current_frame->buf[i]) > threshold)
+        size_t y = cell_y + (staging_jitter[(cell_y / step) & 15] & jitter_mask);
+        if (y >= height)
         {
-            changed_pixels++;
-            size_t x = i % width;
-            size_t y = i / width;
-            pixel_x[changed_pixels - 1] = x;
-            pixel_y[changed_pixels - 1] = y;
+            y = height - 1;
+        }
+        const uint8_t *frame_row = frame + y * width;
+        for (size_t cell_x = 0, cell = cell_y / step; cell_x < width; cell_x += step, cell++)
+        {
+            size_t x = cell_x + (staging_jitter[cell & 15] & jitter_mask);
+            if (x >= width || !roi_contains(detector->active_roi, detector->scratch.mask_stride, x, y))
+            {
+                continue;
+            }
+            int diff = frame_row[x] - background_luma(detector, x, y);
+            count++;
+            if (diff > threshold || diff < -threshold)
+            {
+                if (++changed >= min_changed)
+                {
+                    *sampled = count;
+                    return changed;
+                }
+            }
         }
     }
-    // Create bounding boxes from clusters of changed pixels
-    if (changed_pixels > 0 && max_boxes > 0)
+    *sampled = count;
+    return changed;
+}
+
+// Stage one: decide from a sparse sample whether the frame is worth a full pass. Uses the lowest
+// per-pixel difference the current mode could still report, so it never hides a detection that
+// the sample can see.
+static bool is_quiet_frame(MotionDetector *detector, const uint8_t *frame, size_t width, size_t height,
+                           float threshold)
+{
+    uint8_t sample_threshold = (uint8_t)threshold;
+    if (detector->config.mode == MOTION_MODE_TILE)
+    {
+        sample_threshold = (uint8_t)(threshold / TILE_THRESHOLD_DIVISOR);
+    }
+    else if (detector->config.mode == MOTION_MODE_ADAPTIVE && detector->model.variance)
+    {
+        sample_threshold = ADAPTIVE_MIN_THRESHOLD;
+    }
+
+    size_t step = detector->config.staging.sample_step;
+    size_t expected = ((width + step - 1) / step) * ((height + step - 1) / step);
+    size_t min_changed = expected * detector->config.staging.min_changed_permille / 1000;
+    if (min_changed == 0)
+    {
+        min_changed = 1;
+    }
+    size_t sampled;
+    size_t changed = count_changed_samples(detector, frame, width, height, sample_threshold, min_changed, &sampled);
+    detector->frame_bytes_touched += sampled * (sizeof(uint8_t) + sizeof(uint16_t));
+    return changed < min_changed;
+}
+
+// Threshold rows [y_begin, y_end) of the frame against the background into the packed change mask and
+// update the background, all in one pass that reads each pixel and background value once
+static void update_and_build_change_mask(MotionDetector *detector, const uint8_t *frame, size_t width,
+                                         size_t y_begin, size_t y_end, float threshold)
+{
+    // A pixel changes when its integer difference exceeds threshold, i.e. exceeds floor(threshold)
+    uint8_t pixel_threshold = threshold <= 0 ? 0 : (threshold >= 255 ? 255 : (uint8_t)threshold);
+
+    for (size_t y = y_begin; y < y_end; y++)
+    {
+        motion_kernel_update_diff_row(detector->model.background + y * width, frame + y * width,
+                                      detector->scratch.change_mask + y * detector->scratch.mask_stride,
+                                      detector->active_roi ? detector->active_roi->pixels + y * detector->scratch.mask_stride : NULL,
+                                      width, pixel_threshold, detector->config.background_shift,
+                                      detector->config.foreground_shift);
+    }
+}
+
+// Adaptive mode: threshold each pixel of rows [y_begin, y_end) at k standard deviations of its own history
+static void update_and_build_adaptive_mask(MotionDetector *detector, const uint8_t *frame, size_t width,
+                                           size_t y_begin, size_t y_end)
+{
+    for (size_t y = y_begin; y < y_end; y++)
+    {
+        motion_kernel_update_diff_variance_row(detector->model.background + y * width, detector->model.variance + y * width,
+                                               frame + y * width, detector->scratch.change_mask + y * detector->scratch.mask_stride,
+                                               detector->active_roi ? detector->active_roi->pixels + y * detector->scratch.mask_stride : NULL,
+                                               width, ADAPTIVE_MIN_THRESHOLD, ADAPTIVE_K_SQUARED,
+                                               detector->config.background_shift, detector->config.foreground_shift,
+                                               VARIANCE_LEARNING_SHIFT);
+    }
+}
+
+// Tile mode: accumulate per-tile absolute differences for tile rows [ty_begin, ty_end) while updating the
+// background, then threshold each tile's mean difference into the packed tile mask
+static void update_and_build_tile_mask(MotionDetector *detector, StripeScratch *stripe, const uint8_t *frame,
+                                       size_t width, size_t height, size_t ty_begin, size_t ty_end, float threshold)
+{
+    uint8_t pixel_threshold = threshold <= 0 ? 0 : (threshold >= 255 ? 255 : (uint8_t)threshold);
+    float tile_threshold = threshold / TILE_THRESHOLD_DIVISOR;
+
+    for (size_t ty = ty_begin; ty < ty_end; ty++)
     {
-        size_t cluster_threshold = 20; // Minimum pixel count for a cluster
+        size_t y_first = ty << TILE_SHIFT;
+        size_t y_last = (y_first + TILE_SIZE < height) ? y_first + TILE_SIZE : height;
+
+        const uint32_t *roi_tiles = detector->active_roi ? detector->active_roi->tiles + ty * detector->scratch.tile_stride : NULL;
+        memset(stripe->tile_sums, 0, detector->scratch.tiles_x * sizeof(uint32_t));
+        for (size_t y = y_first; y < y_last; y++)
+        {
+            motion_kernel_update_tile_row(detector->model.background + y * width, frame + y * width, stripe->tile_sums,
+                                          roi_tiles, width, TILE_SHIFT, pixel_threshold,
+                                          detector->config.background_shift, detector->config.foreground_shift);
+        }
 
-        for (size_t i = 0; i < changed_pixels; i++)
+        uint32_t *mask_row = detector->scratch.tile_mask + ty * detector->scratch.tile_stride;
+        memset(mask_row, 0, detector->scratch.tile_stride * sizeof(uint32_t));
+        for (size_t tx = 0; tx < detector->scratch.tiles_x; tx++)
         {
-            if (box_count >= max_boxes)
+            size_t x_first = tx << TILE_SHIFT;
+            size_t x_last = (x_first + TILE_SIZE < width) ? x_first + TILE_SIZE : width;
+            size_t tile_area = (x_last - x_first) * (y_last - y_first);
+            if (stripe->tile_sums[tx] > tile_threshold * tile_area)
             {
-                break;
+                mask_row[tx >> 5] |= 1u << (tx & 31);
             }
+        }
+    }
+}
+
+// Pyramid mode: box-filter each group of 2^shift rows of coarse rows [cy_begin, cy_end) into block means
+// and run the fused diff on those against the coarse background. The means live in a row buffer,
+// so each frame byte is read once and only the coarse planes are written.
+static void update_and_build_coarse_mask(MotionDetector *detector, StripeScratch *stripe, const uint8_t *frame,
+                                         size_t width, size_t height, size_t cy_begin, size_t cy_end, float threshold)
+{
+    uint8_t pixel_threshold = threshold <= 0 ? 0 : (threshold >= 255 ? 255 : (uint8_t)threshold);
+    unsigned shift = detector->model.scale_shift;
+    size_t block = (size_t)1 << shift;
+    size_t coarse_width = detector->scratch.coarse_width;
+    size_t coarse_stride = detector->scratch.coarse_stride;
+
+    for (size_t cy = cy_begin; cy < cy_end; cy++)
+    {
+        size_t y = cy << shift;
+        size_t rows = height - y < block ? height - y : block;
+        motion_kernel_downscale_rows(frame + y * width, width, rows, shift, stripe->coarse_row);
+        motion_kernel_update_diff_row(detector->model.background + cy * coarse_width, stripe->coarse_row,
+                                      detector->scratch.change_mask + cy * coarse_stride,
+                                      detector->active_roi ? detector->active_roi->coarse + cy * coarse_stride : NULL,
+                                      coarse_width, pixel_threshold, detector->config.background_shift,
+                                      detector->config.foreground_shift);
+    }
+}
+
+// Bytes the fused pass streams over the whole frame in a mode
+static size_t fused_pass_bytes(const MotionDetector *detector, MotionDetectionMode mode, size_t width, size_t height)
+{
+    size_t pixels = width * height;
+    if (mode == MOTION_MODE_TILE)
+    {
+        // Frame read once, background read and written once, tile mask written once
+        return pixels + 2 * pixels * sizeof(uint16_t) +
+               detector->scratch.tile_stride * detector->scratch.tiles_y * sizeof(uint32_t);
+    }
+    if (mode == MOTION_MODE_PYRAMID)
+    {
+        // Frame read once, coarse background read and written once, coarse mask written once
+        size_t blocks = detector->scratch.coarse_width * detector->scratch.coarse_height;
+        return pixels + 2 * blocks * sizeof(uint16_t) +
+               detector->scratch.coarse_stride * detector->scratch.coarse_height * sizeof(uint32_t);
+    }
+    // Frame read once, background (and variance) read and written once, mask written once
+    size_t planes = mode == MOTION_MODE_ADAPTIVE ? 2 : 1;
+    return pixels + 2 * planes * pixels * sizeof(uint16_t) + detector->scratch.mask_stride * height * sizeof(uint32_t);
+}
+
+// Morphological open then close with a 3x3 square, in place on the change mask. The open removes
+// isolated noise pixels and strokes under 3 pixels wide before they can become components; the close
+// then fills holes and gaps under 3 pixels wide, so a subject split by a thin seam stays one
+// component. Larger regions keep their shape. The close's erosion counts pixels outside the frame as
+// changed, so it never trims a region that touches the edge.
+static void filter_change_mask(MotionDetector *detector, size_t width, size_t height)
+{
+    size_t stride = detector->scratch.mask_stride;
+    uint32_t *change = detector->scratch.change_mask;
+    uint32_t *morph = detector->scratch.morph_mask;
+    motion_kernel_mask_horizontal_pass(change, morph, stride, width, height, false, false);
+    motion_kernel_mask_vertical_pass(morph, change, stride, 0, height, height, false, false);
+    motion_kernel_mask_horizontal_pass(change, morph, stride, width, height, true, false);
+    motion_kernel_mask_vertical_pass(morph, change, stride, 0, height, height, true, false);
+    motion_kernel_mask_horizontal_pass(change, morph, stride, width, height, true, false);
+    motion_kernel_mask_vertical_pass(morph, change, stride, 0, height, height, true, false);
+    motion_kernel_mask_horizontal_pass(change, morph, stride, width, height, false, true);
+    motion_kernel_mask_vertical_pass(morph, change, stride, 0, height, height, false, true);
+
+    // Eight passes, each reading and writing the whole mask
+    detector->frame_bytes_touched += 16 * stride * height * sizeof(uint32_t);
+}
+
+// Convert a component labeled on a grid of 2^shift square cells (tiles or pyramid blocks) into pixel
+// coordinates
+static MotionComponent grid_component_to_pixels(MotionComponent cell, unsigned shift, size_t width, size_t height)
+{
+    size_t size = (size_t)1 << shift;
+    size_t cell_pixels = size * size;
+    size_t x_max = (cell.x_max << shift) + size - 1;
+    size_t y_max = (cell.y_max << shift) + size - 1;
+    MotionComponent pixels = {
+        .x_min = cell.x_min << shift,
+        .y_min = cell.y_min << shift,
+        .x_max = x_max < width ? x_max : width - 1,
+        .y_max = y_max < height ? y_max : height - 1,
+        .pixel_count = cell.pixel_count * cell_pixels,
+        // Each cell contributes its centre, weighted by its pixel count
+        .sum_x = ((cell.sum_x << shift) + cell.pixel_count * (size / 2)) * cell_pixels,
+        .sum_y = ((cell.sum_y << shift) + cell.pixel_count * (size / 2)) * cell_pixels};
+    return pixels;
+}
 
-            // Simple bounding box creation by finding min/max x and y coordinates of nearby changed pixels
-            BoundingBox box = {
-                .x_min = pixel_x[i],
-                .y_min = pixel_y[i],
-                .x_max = pixel_x[i],
-                .y_max = pixel_y[i]};
+// Pyramid mode: tighten a box found on the block grid to the full-resolution pixels that differ from
+// the background by more than threshold. Only blocks set in the coarse mask are searched: on a
+// textured scene single pixels stray far from their block's mean, so searching the blocks around the
+// box would pull it out onto the texture. Boxes with no such pixel are kept.
+static BoundingBox refine_box(MotionDetector *detector, const uint8_t *frame, size_t width, BoundingBox box,
+                              uint8_t threshold)
+{
+    unsigned shift = detector->model.scale_shift;
+    const uint32_t *coarse_mask = detector->scratch.change_mask;
+    size_t coarse_stride = detector->scratch.coarse_stride;
 
-            for (size_t j = i + 1; j < changed_pixels; j++)
+    BoundingBox refined = {.x_min = box.x_max, .y_min = box.y_max, .x_max = box.x_min, .y_max = box.y_min};
+    bool found = false;
+    size_t searched = 0;
+    for (size_t y = box.y_min; y <= box.y_max; y++)
+    {
+        const uint8_t *frame_row = frame + y * width;
+        const uint32_t *mask_row = coarse_mask + (y >> shift) * coarse_stride;
+        for (size_t cx = box.x_min >> shift; cx <= box.x_max >> shift; cx++)
+        {
+            if (!((mask_row[cx >> 5] >> (cx & 31)) & 1))
+            {
+                continue;
+            }
+            size_t x_first = cx << shift > box.x_min ? cx << shift : box.x_min;
+            size_t x_last = ((cx + 1) << shift) - 1 < box.x_max ? ((cx + 1) << shift) - 1 : box.x_max;
+            searched += x_last - x_first + 1;
+            for (size_t x = x_first; x <= x_last; x++)
             {
-                if (abs((int)pixel_x[i] - (int)pixel_x[j]) < cluster_threshold &&
-                    abs((int)pixel_y[i] - (int)pixel_y[j]) < cluster_threshold)
+                int diff = frame_row[x] - background_luma(detector, x, y);
+                if ((diff > threshold || diff < -threshold) &&
+                    roi_contains(detector->active_roi, detector->scratch.mask_stride, x, y))
                 {
-                    // Expand the bounding box
-                    if (pixel_x[j] < box.x_min)
-                        box.x_min = pixel_x[j];
-                    if (pixel_y[j] < box.y_min)
-                        box.y_min = pixel_y[j];
-                    if (pixel_x[j] > box.x_max)
-                        box.x_max = pixel_x[j];
-                    if (pixel_y[j] > box.y_max)
-                        box.y_max = pixel_y[j];
+                    found = true;
+                    refined.x_min = x < refined.x_min ? x : refined.x_min;
+                    refined.x_max = x > refined.x_max ? x : refined.x_max;
+                    refined.y_min = y < refined.y_min ? y : refined.y_min;
+                    refined.y_max = y > refined.y_max ? y : refined.y_max;
                 }
             }
+        }
+    }
+    detector->frame_bytes_touched += searched;
+    return found ? refined : box;
+}
 
-            boxes[box_count] = box; // Store the bounding box
-            box_count++;            // Increment the box count
+// Find the first pixel at or after x whose mask bit equals want_set, or width if there is none
+static size_t find_next_bit(const uint32_t *mask_row, size_t stride, size_t width, size_t x, bool want_set)
+{
+    uint32_t flip = want_set ? 0 : ~0u;
+    size_t w = x >> 5;
+    if (w >= stride)
+    {
+        return width;
+    }
+    uint32_t bits = (mask_row[w] ^ flip) & (~0u << (x & 31));
+    while (bits == 0)
+    {
+        if (++w >= stride)
+        {
+            return width;
         }
+        bits = mask_row[w] ^ flip;
     }
+    size_t found = (w << 5) + __builtin_ctz(bits);
+    return found < width ? found : width;
+}
+
+// Forget the stripe's labels before a new frame
+static void reset_stripe_labels(StripeScratch *stripe)
+{
+    stripe->first_count = 0;
+    stripe->first_row_pending = true;
+    stripe->last_runs = stripe->runs[0];
+    stripe->last_count = 0;
+    stripe->label_count = 0;
+    stripe->labels_exhausted = false;
+}
 
-    free(pixel_x);
-    free(pixel_y);
+// Label the 8-connected regions of rows [y_begin, y_end) of a packed mask with the stripe's share of the
+// label table, continuing from the rows the stripe labeled before. Regions that cross into the next
+// stripe are joined by merge_stripe_labels().
+static void label_change_mask(MotionDetector *detector, StripeScratch *stripe, const uint32_t *mask, size_t stride,
+                              size_t width, size_t y_begin, size_t y_end)
+{
+    // Run-based single-pass labeling: every run of changed pixels gets a provisional label and is
+    // unioned with the 8-connected runs of the previous row. Statistics live on the union-find roots,
+    // so the cost is linear in the frame size no matter how many pixels changed.
+    uint32_t *parent = detector->scratch.label_parent;
+    MotionComponent *stats = detector->scratch.label_stats;
+    PixelRun *prev_runs = stripe->last_runs;
+    PixelRun *curr_runs = prev_runs == stripe->runs[0] ? stripe->runs[1] : stripe->runs[0];
+    size_t prev_count = stripe->last_count;
+    uint32_t label_base = stripe->label_base;
+    uint32_t label_limit = label_base + detector->scratch.labels_per_stripe;
+    uint32_t label_count = label_base + stripe->label_count;
+    bool labels_exhausted = stripe->labels_exhausted;
 
-    if (box_count > 0)
+    for (size_t y = y_begin; y < y_end; y++)
     {
-        // ESP_LOGI(detectorTag, "unfiltered boxes.: %zu", box_count);
+        const uint32_t *mask_row = mask + y * stride;
+        size_t curr_count = 0;
+        size_t prev_index = 0;
+        size_t x = 0;
 
-        // ESP_LOGI(detectorTag, "edge touching filtered out.: %zu", box_count);
-        // Filter and merge boxes based on IoU threshold and max_area
-        filter_and_merge_boxes(boxes, &box_count, iou_threshold, max_area);
-        filter_small_boxes(boxes, &box_count, min_area);
-        // ESP_LOGI(detectorTag, "small filtered out.: %zu", box_count);
-        filter_edge_touching_boxes(boxes, &box_count, width, height);
+        while ((x = find_next_bit(mask_row, stride, width, x, true)) < width)
+        {
+            size_t x_start = x;
+            x = find_next_bit(mask_row, stride, width, x, false);
+            size_t x_end = x - 1;
+
+            // Skip previous-row runs that end before this run can touch them
+            while (prev_index < prev_count && (size_t)prev_runs[prev_index].x_end + 1 < x_start)
+            {
+                prev_index++;
+            }
+
+            uint32_t label;
+            if (label_count < label_limit)
+            {
+                label = label_count++;
+                parent[label] = label;
+                MotionComponent run_stats = {
+                    .x_min = x_start,
+                    .y_min = y,
+                    .x_max = x_end,
+                    .y_max = y,
+                    .pixel_count = x_end - x_start + 1,
+                    .sum_x = (x_start + x_end) * (x_end - x_start + 1) / 2,
+                    .sum_y = y * (x_end - x_start + 1)};
+                stats[label] = run_stats;
+            }
+            else if (prev_index < prev_count && prev_runs[prev_index].x_start <= x_end + 1)
+            {
+                // Out of labels, but the run still extends an existing component
+                label = prev_runs[prev_index].label;
+                uint32_t root = find_root(parent, label);
+                if (x_start < stats[root].x_min)
+                    stats[root].x_min = x_start;
+                if (x_end > stats[root].x_max)
+                    stats[root].x_max = x_end;
+                stats[root].y_max = y;
+                stats[root].pixel_count += x_end - x_start + 1;
+                stats[root].sum_x += (x_start + x_end) * (x_end - x_start + 1) / 2;
+                stats[root].sum_y += y * (x_end - x_start + 1);
+            }
+            else
+            {
+                labels_exhausted = true;
+                continue;
+            }
+
+            // Union with every previous-row run that overlaps (including diagonally)
+            for (size_t k = prev_index; k < prev_count && prev_runs[k].x_start <= x_end + 1; k++)
+            {
+                union_labels(parent, stats, label, prev_runs[k].label);
+            }
+            // The last overlapping run may also touch the next run on this row
+            while (prev_index + 1 < prev_count && (size_t)prev_runs[prev_index + 1].x_start <= x_end + 1)
+            {
+                prev_index++;
+            }
+
+            PixelRun run = {.x_start = (uint16_t)x_start, .x_end = (uint16_t)x_end, .label = label};
+            curr_runs[curr_count++] = run;
+        }
+
+        // The first row's runs are kept for joining with the stripe above
+        if (stripe->first_row_pending)
+        {
+            memcpy(stripe->first_runs, curr_runs, curr_count * sizeof(PixelRun));
+            stripe->first_count = curr_count;
+            stripe->first_row_pending = false;
+        }
+
+        PixelRun *swap = prev_runs;
+        prev_runs = curr_runs;
+        curr_runs = swap;
+        prev_count = curr_count;
+    }
+
+    stripe->last_runs = prev_runs;
+    stripe->last_count = prev_count;
+    stripe->label_count = label_count - label_base;
+    stripe->labels_exhausted = labels_exhausted;
+}
+
+// Join the regions that cross each stripe border, then collect every root as one connected component.
+// Stripes label top to bottom with increasing label ranges and unions keep the lower label as root, so
+// the components come out in the same order, with the same statistics, as from a single stripe.
+static size_t merge_stripe_labels(MotionDetector *detector)
+{
+    uint32_t *parent = detector->scratch.label_parent;
+    MotionComponent *stats = detector->scratch.label_stats;
+    size_t stripe_count = detector->config.stripes;
+    bool labels_exhausted = false;
+
+    for (size_t s = 0; s < stripe_count; s++)
+    {
+        const StripeScratch *stripe = &detector->scratch.stripes[s];
+        labels_exhausted |= stripe->labels_exhausted;
+        if (s == 0)
+        {
+            continue;
+        }
+        // Runs on the last row above the border and the first row below it, both sorted by x
+        const StripeScratch *above = &detector->scratch.stripes[s - 1];
+        size_t first_above = 0;
+        for (size_t i = 0; i < stripe->first_count; i++)
+        {
+            const PixelRun *run = &stripe->first_runs[i];
+            while (first_above < above->last_count && (size_t)above->last_runs[first_above].x_end + 1 < run->x_start)
+            {
+                first_above++;
+            }
+            for (size_t k = first_above; k < above->last_count && above->last_runs[k].x_start <= (size_t)run->x_end + 1; k++)
+            {
+                union_labels(parent, stats, run->label, above->last_runs[k].label);
+            }
+        }
+    }
+
+    if (labels_exhausted)
+    {
+        ESP_LOGW(detectorTag, "Label table full, some changed pixels were not labeled");
+    }
 
-        // Check if there are still any boxes after filtering and merging
-        if (box_count > 0)
+    // Every root is one connected component
+    size_t component_count = 0;
+    for (size_t s = 0; s < stripe_count; s++)
+    {
+        const StripeScratch *stripe = &detector->scratch.stripes[s];
+        for (uint32_t label = stripe->label_base;
+             label < stripe->label_base + stripe->label_count && component_count < MAX_COMPONENTS; label++)
         {
-            if (detection_timestamp != NULL)
+            if (parent[label] == label)
             {
-                *detection_timestamp = time(NULL);
+                detector->scratch.components[component_count++] = stats[label];
             }
-            ESP_LOGI(detectorTag, "Remaining boxes after filtering and merging: %zu", box_count);
-            char *json_string = boxes_to_json(boxes, box_count);
-            if (json_string != NULL)
+        }
+    }
+    return component_count;
+}
+
+char *boxes_to_json(const BoundingBox *boxes, const uint16_t *track_ids, size_t box_count)
+{
+    if (box_count == 0 || boxes == NULL)
+    {
+        char *empty = (char *)malloc(sizeof("[]"));
+        if (empty != NULL)
+        {
+            strcpy(empty, "[]"); // Return an empty JSON array if there are no boxes
+        }
+        return empty;
+    }
+
+    size_t estimated_size = box_count * 136; // Start with a larger estimate
+    char *json_string = (char *)malloc(estimated_size);
+    if (json_string == NULL)
+    {
+        ESP_LOGE("boxes_to_json", "Failed to allocate memory for JSON string");
+        return NULL;
+    }
+
+    char *current_position = json_string;
+    size_t remaining_size = estimated_size;
+
+    // Start the JSON array
+    int written = snprintf(current_position, remaining_size, "[");
+    current_position += written;
+    remaining_size -= written;
+
+    for (size_t i = 0; i < box_count; i++)
+    {
+        // Format each bounding box as a JSON object
+        written = snprintf(current_position, remaining_size,
+                           "{\"x_min\":%zu,\"y_min\":%zu,\"x_max\":%zu,\"y_max\":%zu,\"track_id\":%u}",
+                           boxes[i].x_min, boxes[i].y_min, boxes[i].x_max, boxes[i].y_max,
+                           track_ids ? track_ids[i] : 0);
+
+        if (written >= remaining_size)
+        {
+            // We’re out of space; double size with reallocation
+            size_t current_length = current_position - json_string;
+            estimated_size *= 2;
+            char *new_string = (char *)realloc(json_string, estimated_size);
+            if (new_string == NULL)
             {
-                // Create a complete sensor_data structure
-                sensor_data_t sensor_data = {
-                    .timestamp = time(NULL),
-                    .temperature = 0, // These will be set elsewhere
-                    .humidity = 0,
-                    .pressure = 0,
-                    .bboxes = json_string,
-                    .owns_bboxes = true // This instance owns the memory
-                };
-                ESP_LOGI("detector", "JSON string length: %zu", strlen(json_string));
-                ESP_LOGI("detector", "JSON string: %s", json_string);
-                if (xQueueSend(sensor_data_queue, &sensor_data, pdMS_TO_TICKS(10)) != pdTRUE)
-                {
-                    ESP_LOGE("detector", "Failed to send data to the queue");
-                    // Clean up if send fails
-                    free(json_string);
-                }
-                // Don't free json_string here - it's now owned by the queue
+                ESP_LOGE("boxes_to_json", "Failed to reallocate memory for JSON string");
+                free(json_string);
+                return NULL;
             }
-            return true;
+            json_string = new_string;
+            current_position = json_string + current_length;
+            remaining_size = estimated_size - current_length;
+
+            // Retry writing
+            written = snprintf(current_position, remaining_size,
+                               "{\"x_min\":%zu,\"y_min\":%zu,\"x_max\":%zu,\"y_max\":%zu,\"track_id\":%u}",
+                               boxes[i].x_min, boxes[i].y_min, boxes[i].x_max, boxes[i].y_max,
+                               track_ids ? track_ids[i] : 0);
+        }
+
+        current_position += written;
+        remaining_size -= written;
+
+        // Add a comma if it’s not the last box
+        if (i < box_count - 1)
+        {
+            written = snprintf(current_position, remaining_size, ",");
+            current_position += written;
+            remaining_size -= written;
+        }
+    }
+
+    // Close the JSON array
+    written = snprintf(current_position, remaining_size, "]");
+    current_position += written;
+
+    // Optional: Trim memory to actual size
+    size_t final_size = current_position - json_string + 1; // +1 for null terminator
+    char *final_json = (char *)realloc(json_string, final_size);
+    return final_json ? final_json : json_string; // Return final allocation or original
+}
+
+// One frame's work, shared by every stripe
+typedef struct
+{
+    MotionDetector *detector;
+    const uint8_t *frame;
+    size_t width, height;
+    float threshold;
+    MotionDetectionMode mode; // Pixel when adaptive mode has no variance plane
+} StripeJob;
+
+// Rows [begin, end) of stripe s when rows are split into stripes near-equal stripes
+static void stripe_range(size_t rows, size_t stripes, size_t s, size_t *begin, size_t *end)
+{
+    *begin = rows * s / stripes;
+    *end = rows * (s + 1) / stripes;
+}
+
+// Fused background update and change mask for one stripe; tile mode splits on tile rows
+static void update_stripe(void *context, size_t s)
+{
+    StripeJob *job = (StripeJob *)context;
+    MotionDetector *detector = job->detector;
+    StripeScratch *stripe = &detector->scratch.stripes[s];
+    size_t begin, end;
+    if (job->mode == MOTION_MODE_TILE)
+    {
+        stripe_range(detector->scratch.tiles_y, detector->config.stripes, s, &begin, &end);
+        update_and_build_tile_mask(detector, stripe, job->frame, job->width, job->height, begin, end, job->threshold);
+        return;
+    }
+    if (job->mode == MOTION_MODE_PYRAMID)
+    {
+        stripe_range(detector->scratch.coarse_height, detector->config.stripes, s, &begin, &end);
+        update_and_build_coarse_mask(detector, stripe, job->frame, job->width, job->height, begin, end,
+                                     job->threshold);
+        return;
+    }
+    stripe_range(job->height, detector->config.stripes, s, &begin, &end);
+    if (job->mode == MOTION_MODE_ADAPTIVE)
+    {
+        update_and_build_adaptive_mask(detector, job->frame, job->width, begin, end);
+    }
+    else
+    {
+        update_and_build_change_mask(detector, job->frame, job->width, begin, end, job->threshold);
+    }
+}
+
+// Component labeling of one stripe of the change mask, the coarse mask in pyramid mode, or the tile mask in tile mode
+static void label_stripe(void *context, size_t s)
+{
+    StripeJob *job = (StripeJob *)context;
+    MotionDetector *detector = job->detector;
+    StripeScratch *stripe = &detector->scratch.stripes[s];
+    size_t begin, end;
+    reset_stripe_labels(stripe);
+    if (job->mode == MOTION_MODE_TILE)
+    {
+        stripe_range(detector->scratch.tiles_y, detector->config.stripes, s, &begin, &end);
+        label_change_mask(detector, stripe, detector->scratch.tile_mask, detector->scratch.tile_stride,
+                          detector->scratch.tiles_x, begin, end);
+        return;
+    }
+    if (job->mode == MOTION_MODE_PYRAMID)
+    {
+        stripe_range(detector->scratch.coarse_height, detector->config.stripes, s, &begin, &end);
+        label_change_mask(detector, stripe, detector->scratch.change_mask, detector->scratch.coarse_stride,
+                          detector->scratch.coarse_width, begin, end);
+        return;
+    }
+    stripe_range(job->height, detector->config.stripes, s, &begin, &end);
+    label_change_mask(detector, stripe, detector->scratch.change_mask, detector->scratch.mask_stride, job->width,
+                      begin, end);
+}
+
+// Run a stripe job on every stripe, in parallel when the detector has workers
+static void run_stripes(MotionDetector *detector, MotionStripeJob job, void *context)
+{
+    if (detector->workers)
+    {
+        motion_workers_run(detector->workers, job, context);
+    }
+    else
+    {
+        job(context, 0);
+    }
+}
+
+// Add the frame's final mask to the heatmap: every tile with a changed pixel counts the frame once.
+// Pixel and adaptive masks give a tile TILE_SIZE rows of TILE_SIZE bits, the pyramid mask fewer of
+// each, and the tile mask one bit.
+static void accumulate_heatmap(MotionDetector *detector, MotionDetectionMode mode, size_t height)
+{
+    const DetectorScratch *scratch = &detector->scratch;
+    uint16_t *counts = detector->heatmap.counts;
+    if (mode == MOTION_MODE_TILE)
+    {
+        for (size_t ty = 0; ty < scratch->tiles_y; ty++)
+        {
+            motion_kernel_accumulate_activity(scratch->tile_mask + ty * scratch->tile_stride, scratch->tile_stride, 1,
+                                              0, scratch->tiles_x, counts + ty * scratch->tiles_x);
         }
-        // else
-        // {
-        //     // If no boxes remain after filtering and merging, log and return false
-        //     ESP_LOGI(detectorTag, "No boxes remain after filtering and merging");
-        // }
+        return;
     }
-    free(boxes);  // Always free the memory used for the boxes
-    return false; // Return false if no boxes are left
+
+    unsigned shift = mode == MOTION_MODE_PYRAMID ? detector->model.scale_shift : 0;
+    size_t stride = shift ? scratch->coarse_stride : scratch->mask_stride;
+    size_t rows = shift ? scratch->coarse_height : height;
+    size_t rows_per_tile = (size_t)TILE_SIZE >> shift;
+    for (size_t ty = 0; ty < scratch->tiles_y; ty++)
+    {
+        size_t y = ty * rows_per_tile;
+        motion_kernel_accumulate_activity(scratch->change_mask + y * stride, stride,
+                                          rows - y < rows_per_tile ? rows - y : rows_per_tile, TILE_SHIFT - shift,
+                                          scratch->tiles_x, counts + ty * scratch->tiles_x);
+    }
+    detector->frame_bytes_touched += stride * rows * sizeof(uint32_t);
 }
 
-void cleanup_background_model(void)
+// Turn the labeled components of a frame into filtered, merged boxes in the scratch box table.
+// Returns the number of boxes.
+static size_t boxes_from_labels(MotionDetector *detector, MotionDetectionMode mode, const uint8_t *frame,
+                                size_t width, size_t height)
 {
-    if (bg_model.background)
+    const MotionDetectorConfig *config = &detector->config;
+    BoundingBox *boxes = detector->scratch.boxes;
+    size_t box_count = 0;
+    accumulate_heatmap(detector, mode, height);
+    size_t component_count = merge_stripe_labels(detector);
+    MotionComponent *components = detector->scratch.components;
+    if (mode == MOTION_MODE_TILE || mode == MOTION_MODE_PYRAMID)
     {
-        free(bg_model.background);
-        bg_model.background = NULL;
+        unsigned shift = mode == MOTION_MODE_TILE ? TILE_SHIFT : detector->model.scale_shift;
+        for (size_t i = 0; i < component_count; i++)
+        {
+            components[i] = grid_component_to_pixels(components[i], shift, width, height);
+        }
     }
-    bg_model.width = 0;
-    bg_model.height = 0;
-    bg_model.initialized = false;
-    frame_counter = 0; // Reset the frame counter when cleaning up
-}
\ No newline at end of file
+
+    for (size_t i = 0; i < component_count && box_count < config->max_boxes; i++)
+    {
+        if (components[i].pixel_count < MIN_COMPONENT_PIXELS)
+        {
+            continue;
+        }
+        BoundingBox box = {
+            .x_min = components[i].x_min,
+            .y_min = components[i].y_min,
+            .x_max = components[i].x_max,
+            .y_max = components[i].y_max};
+        if (mode == MOTION_MODE_PYRAMID)
+        {
+            uint8_t threshold = config->threshold <= 0 ? 0 : (config->threshold >= 255 ? 255 : (uint8_t)config->threshold);
+            box = refine_box(detector, frame, width, box, threshold);
+        }
+        boxes[box_count] = box;
+        box_count++;
+    }
+
+    if (box_count > 0)
+    {
+        // Filter and merge boxes based on IoU threshold and max_area
+        filter_and_merge_boxes(boxes, detector->scratch.box_parent, &box_count, config->merge_iou, config->max_box_area);
+        filter_small_and_edge_touching_boxes(boxes, &box_count, config->min_box_area, width, height);
+    }
+    return box_count;
+}
+
+// Mode a frame actually runs in: adaptive falls back to pixel when the detector has no variance plane
+static MotionDetectionMode frame_mode(const MotionDetector *detector)
+{
+    if (detector->config.mode == MOTION_MODE_ADAPTIVE && !detector->model.variance)
+    {
+        return MOTION_MODE_PIXEL;
+    }
+    return detector->config.mode;
+}
+
+// Run the detection stages on an initialized model and leave the filtered boxes in the scratch box table.
+// Returns the number of boxes.
+static size_t find_motion_boxes(MotionDetector *detector, const camera_fb_t *current_frame)
+{
+    const MotionDetectorConfig *config = &detector->config;
+    float threshold = config->threshold;
+
+    size_t width = current_frame->width;
+    size_t height = current_frame->height;
+
+    select_active_roi(detector);
+    if (detector->roi_reseed_pending)
+    {
+        seed_background_from_frame(detector, current_frame);
+        detector->roi_reseed_pending = false;
+        return 0;
+    }
+
+    // Cloud cover and auto-exposure steps shift the whole frame. Follow moderate steps by rescaling
+    // the background; treat larger ones as a lighting event, reseed and skip this frame.
+    uint32_t gain = estimate_global_gain(detector, current_frame->buf, width, height);
+    if (gain < LIGHTING_MIN_GAIN || gain > LIGHTING_MAX_GAIN)
+    {
+        ESP_LOGI(detectorTag, "Lighting event (gain %.2f), reseeding background", gain / 256.0f);
+        seed_background_from_frame(detector, current_frame);
+        detector->stats.lighting_skipped++;
+        return 0;
+    }
+    if (gain + LIGHTING_GAIN_TOLERANCE < 256 || gain > 256 + LIGHTING_GAIN_TOLERANCE)
+    {
+        ESP_LOGD(detectorTag, "Compensating global gain %.2f", gain / 256.0f);
+        rescale_background(detector, gain);
+        detector->stats.lighting_compensated++;
+    }
+
+    // Most frames are empty; stop after the sparse check unless enough samples changed. Quiet frames
+    // leave the background untouched, so a periodic full pass keeps it following slow drift.
+    if (config->staging.sample_step > 1 && is_quiet_frame(detector, current_frame->buf, width, height, threshold))
+    {
+        detector->quiet_streak++;
+        if (config->staging.refresh_interval == 0 || detector->quiet_streak < config->staging.refresh_interval)
+        {
+            detector->stats.sparse_quiet++;
+            return 0;
+        }
+    }
+    detector->quiet_streak = 0;
+    detector->stats.full_passes++;
+
+    // Update the background model and threshold into a change mask in one fused pass, then turn each
+    // connected component into a box. Both the pass and the labeling run one stripe per worker.
+    StripeJob job = {
+        .detector = detector,
+        .frame = current_frame->buf,
+        .width = width,
+        .height = height,
+        .threshold = threshold,
+        .mode = frame_mode(detector)};
+    run_stripes(detector, update_stripe, &job);
+    detector->frame_bytes_touched += fused_pass_bytes(detector, job.mode, width, height);
+#if MASK_OPENING
+    if (job.mode != MOTION_MODE_TILE && job.mode != MOTION_MODE_PYRAMID)
+    {
+        filter_change_mask(detector, width, height);
+    }
+#endif
+    run_stripes(detector, label_stripe, &job);
+    ESP_LOGD(detectorTag, "Fused pass touched %zu bytes", detector->frame_bytes_touched);
+    return boxes_from_labels(detector, job.mode, current_frame->buf, width, height);
+}
+
+// Update the tracks with a frame's boxes and fill in the result. Time comes from the frame, so a replay
+// tracks the same way however fast it runs; frames without a timestamp fall back to the clock.
+static void report_boxes(MotionDetector *detector, const camera_fb_t *frame, size_t box_count,
+                         MotionResult *result)
+{
+    // Every processed frame ages the tracks, so a subject that left ends its track on time
+    time_t now = frame->timestamp.tv_sec != 0 ? frame->timestamp.tv_sec : time(NULL);
+    uint32_t ended_before = detector->tracker.ended_total;
+    result->capture_requested = motion_tracker_update(&detector->tracker, detector->scratch.boxes, box_count, now,
+                                                      detector->scratch.track_ids);
+    detector->heatmap.frames++;
+    if (detector->heatmap.start == 0 && now >= SNAPSHOT_MIN_CLOCK)
+    {
+        // A period that began before the clock was set is dated from its first frame with a set clock
+        detector->heatmap.start = now;
+    }
+    result->ended_tracks = detector->tracker.ended_total - ended_before;
+    detector->stats.tracks_ended += result->ended_tracks;
+    if (result->capture_requested)
+    {
+        detector->stats.captures_requested++;
+    }
+
+    result->timestamp = now;
+    result->box_count = box_count;
+    result->motion = box_count > 0;
+    result->allocations = detector->frame_allocations;
+    result->bytes_touched = detector->frame_bytes_touched;
+    if (result->motion)
+    {
+        ESP_LOGI(detectorTag, "Remaining boxes after filtering and merging: %zu", box_count);
+        detector->stats.detections++;
+    }
+}
+
+// Reset the per-frame counters and check the frame against the detector's geometry
+static esp_err_t start_frame(MotionDetector *detector, const camera_fb_t *frame)
+{
+    detector->frame_allocations = 0;
+    detector->frame_bytes_touched = 0;
+
+    if (detector->model.width != frame->width || detector->model.height != frame->height ||
+        frame->len < frame->width * frame->height)
+    {
+        ESP_LOGD(detectorTag, "Frame is %zux%zu, detector is %zux%zu", frame->width, frame->height,
+                 detector->model.width, detector->model.height);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    // Only frames that are actually processed count, so detections per frame stay meaningful
+    detector->stats.frames++;
+    return ESP_OK;
+}
+
+static void clear_result(const MotionDetector *detector, MotionResult *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->boxes = detector->scratch.boxes;
+    result->track_ids = detector->scratch.track_ids;
+}
+
+esp_err_t motion_detector_process(MotionDetector *detector, const camera_fb_t *frame, MotionResult *result)
+{
+    if (!detector || !frame || !result)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (detector->stream.frame)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    clear_result(detector, result);
+    esp_err_t err = start_frame(detector, frame);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    // Seed the background model until it is initialized
+    if (!detector->model.initialized)
+    {
+        initialize_background_from_frame(detector, frame);
+        return ESP_OK;
+    }
+
+    size_t box_count = find_motion_boxes(detector, frame);
+    report_boxes(detector, frame, box_count, result);
+    return ESP_OK;
+}
+
+// Label rows [from, to) of a mask, each row with the stripe that owns it in a whole-frame pass, so a
+// streamed frame ends with exactly the labels motion_detector_process() would give it
+static void label_streamed_rows(MotionDetector *detector, const uint32_t *mask, size_t stride, size_t width,
+                                size_t rows, size_t from, size_t to)
+{
+    for (size_t s = 0; s < detector->config.stripes; s++)
+    {
+        size_t begin, end;
+        stripe_range(rows, detector->config.stripes, s, &begin, &end);
+        begin = begin > from ? begin : from;
+        end = end < to ? end : to;
+        if (begin < end)
+        {
+            label_change_mask(detector, &detector->scratch.stripes[s], mask, stride, width, begin, end);
+        }
+    }
+}
+
+#if MASK_OPENING
+// Rows a vertical pass can finish once its source rows are done through source_end: all but the last,
+// whose row below is still missing, until the frame is complete
+static size_t vertical_pass_end(size_t source_end, size_t height)
+{
+    return source_end == height ? height : (source_end > 0 ? source_end - 1 : 0);
+}
+
+// Open then close the change mask as rows arrive. Each vertical pass needs the row below, so each
+// stage lags the one before by a row, and a row is filtered once the four rows under it are masked.
+// The close reuses the open's scratch rows once the open has moved past them. The result matches
+// filter_change_mask() on the whole frame.
+static void filter_streamed_rows(MotionDetector *detector, size_t width, size_t height, size_t from, size_t to)
+{
+    FrameStream *stream = &detector->stream;
+    size_t stride = detector->scratch.mask_stride;
+    uint32_t *change = detector->scratch.change_mask;
+    uint32_t *morph = detector->scratch.morph_mask;
+    uint32_t *eroded = detector->scratch.eroded_mask;
+    uint32_t *dilated = detector->scratch.dilated_mask;
+
+    // Horizontal erosion only needs the row itself
+    motion_kernel_mask_horizontal_pass(change + from * stride, morph + from * stride, stride, width, to - from,
+                                       false, false);
+
+    size_t end = vertical_pass_end(to, height);
+    if (end > stream->rows_eroded)
+    {
+        size_t first = stream->rows_eroded;
+        motion_kernel_mask_vertical_pass(morph, eroded, stride, first, end, height, false, false);
+        motion_kernel_mask_horizontal_pass(eroded + first * stride, dilated + first * stride, stride, width,
+                                           end - first, true, false);
+        stream->rows_eroded = end;
+    }
+
+    // The raw rows in the change mask are consumed by now, so opened rows go back into it. The close
+    // starts on them straight away, in morph rows the erosion above no longer reads.
+    end = vertical_pass_end(stream->rows_eroded, height);
+    if (end > stream->rows_opened)
+    {
+        size_t first = stream->rows_opened;
+        motion_kernel_mask_vertical_pass(dilated, change, stride, first, end, height, true, false);
+        motion_kernel_mask_horizontal_pass(change + first * stride, morph + first * stride, stride, width,
+                                           end - first, true, false);
+        stream->rows_opened = end;
+    }
+
+    // Likewise eroded and dilated rows the open has finished with
+    end = vertical_pass_end(stream->rows_opened, height);
+    if (end > stream->rows_dilated)
+    {
+        size_t first = stream->rows_dilated;
+        motion_kernel_mask_vertical_pass(morph, eroded, stride, first, end, height, true, false);
+        motion_kernel_mask_horizontal_pass(eroded + first * stride, dilated + first * stride, stride, width,
+                                           end - first, false, true);
+        stream->rows_dilated = end;
+    }
+
+    end = vertical_pass_end(stream->rows_dilated, height);
+    if (end > stream->rows_closed)
+    {
+        motion_kernel_mask_vertical_pass(dilated, change, stride, stream->rows_closed, end, height, false, true);
+        stream->rows_closed = end;
+    }
+    detector->frame_bytes_touched += 16 * stride * (to - from) * sizeof(uint32_t);
+}
+#endif
+
+// Run every stage that the rows landed so far allow
+static void stream_rows(MotionDetector *detector, size_t rows)
+{
+    FrameStream *stream = &detector->stream;
+    const uint8_t *frame = stream->frame->buf;
+    size_t width = stream->frame->width;
+    size_t height = stream->frame->height;
+    float threshold = detector->config.threshold;
+    stream->rows_landed = rows;
+    if (!stream->full_pass)
+    {
+        return;
+    }
+
+    if (stream->mode == MOTION_MODE_TILE)
+    {
+        // A tile row is complete once its last pixel row has landed
+        size_t tile_rows = rows == height ? detector->scratch.tiles_y : rows >> TILE_SHIFT;
+        if (tile_rows <= stream->rows_updated)
+        {
+            return;
+        }
+        size_t y_end = tile_rows << TILE_SHIFT;
+        stream->gain_samples = collect_gain_samples(detector, frame, width, stream->rows_updated << TILE_SHIFT,
+                                                    y_end < height ? y_end : height, stream->gain_samples);
+        update_and_build_tile_mask(detector, &detector->scratch.stripes[0], frame, width, height,
+                                   stream->rows_updated, tile_rows, threshold);
+        label_streamed_rows(detector, detector->scratch.tile_mask, detector->scratch.tile_stride,
+                            detector->scratch.tiles_x, detector->scratch.tiles_y, stream->rows_labeled, tile_rows);
+        stream->rows_updated = tile_rows;
+        stream->rows_labeled = tile_rows;
+        return;
+    }
+
+    if (stream->mode == MOTION_MODE_PYRAMID)
+    {
+        // Likewise a coarse row, with the partial block at the bottom done once the frame is in
+        unsigned shift = detector->model.scale_shift;
+        size_t coarse_rows = rows == height ? detector->scratch.coarse_height : rows >> shift;
+        if (coarse_rows <= stream->rows_updated)
+        {
+            return;
+        }
+        size_t y_end = coarse_rows << shift;
+        stream->gain_samples = collect_gain_samples(detector, frame, width, stream->rows_updated << shift,
+                                                    y_end < height ? y_end : height, stream->gain_samples);
+        update_and_build_coarse_mask(detector, &detector->scratch.stripes[0], frame, width, height,
+                                     stream->rows_updated, coarse_rows, threshold);
+        label_streamed_rows(detector, detector->scratch.change_mask, detector->scratch.coarse_stride,
+                            detector->scratch.coarse_width, detector->scratch.coarse_height, stream->rows_labeled,
+                            coarse_rows);
+        stream->rows_updated = coarse_rows;
+        stream->rows_labeled = coarse_rows;
+        return;
+    }
+
+    if (rows <= stream->rows_updated)
+    {
+        return;
+    }
+    size_t from = stream->rows_updated;
+    stream->gain_samples = collect_gain_samples(detector, frame, width, from, rows, stream->gain_samples);
+    if (stream->mode == MOTION_MODE_ADAPTIVE)
+    {
+        update_and_build_adaptive_mask(detector, frame, width, from, rows);
+    }
+    else
+    {
+        update_and_build_change_mask(detector, frame, width, from, rows, threshold);
+    }
+    stream->rows_updated = rows;
+#if MASK_OPENING
+    filter_streamed_rows(detector, width, height, from, rows);
+#else
+    stream->rows_closed = rows;
+#endif
+    label_streamed_rows(detector, detector->scratch.change_mask, detector->scratch.mask_stride, width, height,
+                        stream->rows_labeled, stream->rows_closed);
+    stream->rows_labeled = stream->rows_closed;
+}
+
+esp_err_t motion_detector_begin_frame(MotionDetector *detector, const camera_fb_t *frame)
+{
+    if (!detector || !frame)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (detector->stream.frame)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = start_frame(detector, frame);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    FrameStream *stream = &detector->stream;
+    memset(stream, 0, sizeof(*stream));
+    stream->frame = frame;
+    stream->mode = frame_mode(detector);
+    if (!detector->model.initialized)
+    {
+        return ESP_OK;
+    }
+    select_active_roi(detector);
+    if (detector->roi_reseed_pending)
+    {
+        return ESP_OK;
+    }
+    stream->full_pass = true;
+    for (size_t s = 0; s < detector->config.stripes; s++)
+    {
+        reset_stripe_labels(&detector->scratch.stripes[s]);
+    }
+    return ESP_OK;
+}
+
+esp_err_t motion_detector_push_rows(MotionDetector *detector, size_t rows)
+{
+    if (!detector)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!detector->stream.frame)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (rows > detector->stream.frame->height)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (rows > detector->stream.rows_landed)
+    {
+        stream_rows(detector, rows);
+    }
+    return ESP_OK;
+}
+
+esp_err_t motion_detector_finish_frame(MotionDetector *detector, MotionResult *result)
+{
+    if (!detector || !result)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    FrameStream *stream = &detector->stream;
+    if (!stream->frame)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    clear_result(detector, result);
+    const camera_fb_t *frame = stream->frame;
+    size_t width = frame->width;
+    size_t height = frame->height;
+    if (stream->rows_landed < height)
+    {
+        stream_rows(detector, height);
+    }
+    stream->frame = NULL;
+
+    // Seed the background model until it is initialized
+    if (!detector->model.initialized)
+    {
+        initialize_background_from_frame(detector, frame);
+        return ESP_OK;
+    }
+
+    size_t box_count = 0;
+    if (!stream->full_pass)
+    {
+        seed_background_from_frame(detector, frame);
+        detector->roi_reseed_pending = false;
+    }
+    else
+    {
+        detector->frame_bytes_touched += fused_pass_bytes(detector, stream->mode, width, height);
+        detector->quiet_streak = 0;
+        detector->stats.full_passes++;
+
+        // The gain is only known once the last row has landed, after the rows were compared against the
+        // background. A lighting event reseeds as in a whole-frame pass; a moderate step rescales the
+        // background for the next frame and drops this frame's boxes, which saw the uncompensated model.
+        uint32_t gain = median_gain(detector, stream->gain_samples);
+        if (gain < LIGHTING_MIN_GAIN || gain > LIGHTING_MAX_GAIN)
+        {
+            ESP_LOGI(detectorTag, "Lighting event (gain %.2f), reseeding background", gain / 256.0f);
+            seed_background_from_frame(detector, frame);
+            detector->stats.lighting_skipped++;
+        }
+        else if (gain + LIGHTING_GAIN_TOLERANCE < 256 || gain > 256 + LIGHTING_GAIN_TOLERANCE)
+        {
+            ESP_LOGD(detectorTag, "Compensating global gain %.2f after the frame", gain / 256.0f);
+            rescale_background(detector, gain);
+            detector->stats.lighting_compensated++;
+        }
+        else
+        {
+            box_count = boxes_from_labels(detector, stream->mode, frame->buf, width, height);
+        }
+    }
+    report_boxes(detector, frame, box_count, result);
+    return ESP_OK;
+}
+
+esp_err_t motion_detector_set_mode(MotionDetector *detector, MotionDetectionMode mode)
+{
+    static const char *mode_names[] = {"pixel", "tile", "adaptive", "pyramid"};
+    if (!detector || mode > MOTION_MODE_PYRAMID)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Resampling the background under a half-streamed frame would mix two models in one frame
+    if (detector->stream.frame)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (mode == detector->config.mode)
+    {
+        return ESP_OK;
+    }
+
+    // The adaptive model needs a variance plane; start it from the seed value
+    if (mode == MOTION_MODE_ADAPTIVE && !detector->model.variance)
+    {
+        size_t pixels = detector->model.width * detector->model.height;
+        detector->model.variance = (uint16_t *)detector_malloc(detector, pixels * sizeof(uint16_t));
+        if (!detector->model.variance)
+        {
+            ESP_LOGE(detectorTag, "Failed to allocate variance model, keeping the current mode");
+            return ESP_ERR_NO_MEM;
+        }
+        for (size_t i = 0; i < pixels; i++)
+        {
+            detector->model.variance[i] = ADAPTIVE_SEED_VARIANCE;
+        }
+    }
+
+    detector->config.mode = mode;
+    ESP_LOGI(detectorTag, "Detection mode set to %s", mode_names[mode]);
+
+    // Pyramid mode keeps its background at block resolution; the others at full resolution
+    resample_background(detector, mode == MOTION_MODE_PYRAMID ? detector->config.pyramid_shift : 0);
+
+    // Pixel, tile and pyramid paths skip different areas outside the region of interest
+    if (detector->active_roi)
+    {
+        detector->roi_reseed_pending = true;
+    }
+    return ESP_OK;
+}
+
+MotionDetectionMode motion_detector_get_mode(const MotionDetector *detector)
+{
+    return detector->config.mode;
+}
+
+void motion_detector_get_stats(const MotionDetector *detector, MotionDetectorStats *stats)
+{
+    *stats = detector->stats;
+}
+
+void motion_detector_reset_stats(MotionDetector *detector)
+{
+    memset(&detector->stats, 0, sizeof(detector->stats));
+}
+
+esp_err_t motion_detector_set_roi(MotionDetector *detector, size_t slot, const uint8_t *mask, uint16_t start_minute,
+                                  uint16_t end_minute)
+{
+    if (slot >= MAX_ROI_MASKS || !mask || start_minute >= 24 * 60 || end_minute >= 24 * 60)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t width = detector->model.width;
+    size_t height = detector->model.height;
+    RoiMask *roi = &detector->roi_masks[slot];
+    if (!roi->pixels)
+    {
+        roi->pixels = (uint32_t *)detector_malloc(detector, detector->scratch.mask_stride * height * sizeof(uint32_t));
+        roi->tiles = (uint32_t *)detector_malloc(detector, detector->scratch.tile_stride * detector->scratch.tiles_y * sizeof(uint32_t));
+        roi->coarse = (uint32_t *)detector_malloc(detector, detector->scratch.coarse_stride * detector->scratch.coarse_height * sizeof(uint32_t));
+        if (!roi->pixels || !roi->tiles || !roi->coarse)
+        {
+            free(roi->pixels);
+            free(roi->tiles);
+            free(roi->coarse);
+            roi->pixels = NULL;
+            roi->tiles = NULL;
+            roi->coarse = NULL;
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    unsigned coarse_shift = detector->config.pyramid_shift;
+    memset(roi->pixels, 0, detector->scratch.mask_stride * height * sizeof(uint32_t));
+    memset(roi->tiles, 0, detector->scratch.tile_stride * detector->scratch.tiles_y * sizeof(uint32_t));
+    memset(roi->coarse, 0, detector->scratch.coarse_stride * detector->scratch.coarse_height * sizeof(uint32_t));
+    for (size_t y = 0; y < height; y++)
+    {
+        uint32_t *pixel_row = roi->pixels + y * detector->scratch.mask_stride;
+        uint32_t *tile_row = roi->tiles + (y >> TILE_SHIFT) * detector->scratch.tile_stride;
+        uint32_t *coarse_row = roi->coarse + (y >> coarse_shift) * detector->scratch.coarse_stride;
+        for (size_t x = 0; x < width; x++)
+        {
+            if (mask[y * width + x])
+            {
+                size_t tx = x >> TILE_SHIFT;
+                size_t cx = x >> coarse_shift;
+                pixel_row[x >> 5] |= 1u << (x & 31);
+                tile_row[tx >> 5] |= 1u << (tx & 31);
+                coarse_row[cx >> 5] |= 1u << (cx & 31);
+            }
+        }
+    }
+    roi->start_minute = start_minute;
+    roi->end_minute = end_minute;
+
+    // Force select_active_roi() to treat the edited mask as a change
+    if (detector->active_roi == roi)
+    {
+        detector->active_roi = NULL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t motion_detector_load_roi(MotionDetector *detector, size_t slot, const char *path, uint16_t start_minute,
+                                   uint16_t end_minute)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        ESP_LOGE(detectorTag, "Failed to open region of interest %s", path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    unsigned width = 0, height = 0, max_value = 0;
+    if (fscanf(fp, "P5 %u %u %u", &width, &height, &max_value) != 3 || fgetc(fp) == EOF ||
+        max_value == 0 || max_value > 255)
+    {
+        ESP_LOGE(detectorTag, "%s is not an 8-bit binary PGM", path);
+        fclose(fp);
+        return ESP_FAIL;
+    }
+    if (width != detector->model.width || height != detector->model.height)
+    {
+        ESP_LOGE(detectorTag, "Region of interest %s is %ux%u, frames are %zux%zu",
+                 path, width, height, detector->model.width, detector->model.height);
+        fclose(fp);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    size_t size = (size_t)width * height;
+    uint8_t *mask = (uint8_t *)malloc(size);
+    if (!mask)
+    {
+        fclose(fp);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_FAIL;
+    if (fread(mask, 1, size, fp) == size)
+    {
+        err = motion_detector_set_roi(detector, slot, mask, start_minute, end_minute);
+    }
+    else
+    {
+        ESP_LOGE(detectorTag, "Region of interest %s is truncated", path);
+    }
+    free(mask);
+    fclose(fp);
+    return err;
+}
+
+void motion_detector_clear_roi(MotionDetector *detector, size_t slot)
+{
+    if (slot >= MAX_ROI_MASKS)
+    {
+        return;
+    }
+    if (detector->active_roi == &detector->roi_masks[slot])
+    {
+        detector->active_roi = NULL;
+        detector->roi_reseed_pending = true;
+    }
+    free(detector->roi_masks[slot].pixels);
+    free(detector->roi_masks[slot].tiles);
+    free(detector->roi_masks[slot].coarse);
+    memset(&detector->roi_masks[slot], 0, sizeof(detector->roi_masks[slot]));
+}
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+#define FNV1A_SEED 2166136261u
+
+// Check a snapshot header against the model and the clock. An unsynced clock, as after a brownout
+// before SNTP runs, cannot date the snapshot; it is accepted and the background adapts from there.
+static esp_err_t check_snapshot_header(const MotionDetector *detector, const BackgroundSnapshotHeader *header,
+                                       uint32_t max_age_seconds)
+{
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (header->width != detector->model.width || header->height != detector->model.height)
+    {
+        ESP_LOGW(detectorTag, "Snapshot is %lux%lu, model is %zux%zu", (unsigned long)header->width,
+                 (unsigned long)header->height, detector->model.width, detector->model.height);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    time_t now = time(NULL);
+    if (now < SNAPSHOT_MIN_CLOCK)
+    {
+        ESP_LOGW(detectorTag, "Clock not set, cannot check snapshot age");
+        return ESP_OK;
+    }
+    if (header->timestamp > now || now - header->timestamp > (int64_t)max_age_seconds)
+    {
+        ESP_LOGI(detectorTag, "Snapshot from %lld is stale", (long long)header->timestamp);
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+// Mark the model as learned so detection starts on the next frame
+static void finish_warm_start(MotionDetector *detector, bool has_variance)
+{
+    if (detector->model.variance && !has_variance)
+    {
+        size_t pixels = detector->model.width * detector->model.height;
+        for (size_t i = 0; i < pixels; i++)
+        {
+            detector->model.variance[i] = ADAPTIVE_SEED_VARIANCE;
+        }
+    }
+    detector->model.initialized = true;
+    detector->frame_counter = detector->config.init_frames;
+}
+
+esp_err_t motion_detector_save_snapshot(const MotionDetector *detector, const char *path)
+{
+    if (!detector->model.initialized)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t width = detector->model.width;
+    size_t height = detector->model.height;
+    uint8_t *row = (uint8_t *)malloc(width);
+    if (!row)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Write to a temporary file and rename, so a reset mid-write never leaves a torn snapshot
+    char temp_path[MAX_FILE_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *fp = fopen(temp_path, "wb");
+    if (!fp)
+    {
+        ESP_LOGE(detectorTag, "Failed to create %s", temp_path);
+        free(row);
+        return ESP_FAIL;
+    }
+
+    BackgroundSnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .flags = detector->model.variance ? SNAPSHOT_HAS_VARIANCE : 0,
+        .width = (uint32_t)width,
+        .height = (uint32_t)height,
+        .timestamp = (int64_t)time(NULL),
+        .checksum = 0};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    // The checksum is only known after the planes are written, so it is patched into the header last
+    uint32_t checksum = FNV1A_SEED;
+    for (size_t y = 0; y < height && ok; y++)
+    {
+        // Pyramid mode saves its block means expanded, so a snapshot loads in any mode
+        for (size_t x = 0; x < width; x++)
+        {
+            row[x] = background_luma(detector, x, y);
+        }
+        checksum = fnv1a(checksum, row, width);
+        ok = fwrite(row, 1, width, fp) == width;
+    }
+    if (ok && detector->model.variance)
+    {
+        size_t plane_size = width * height * sizeof(uint16_t);
+        checksum = fnv1a(checksum, detector->model.variance, plane_size);
+        ok = fwrite(detector->model.variance, 1, plane_size, fp) == plane_size;
+    }
+    header.checksum = checksum;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = (fclose(fp) == 0) && ok;
+    free(row);
+
+    if (!ok)
+    {
+        ESP_LOGE(detectorTag, "Failed to write background snapshot %s", temp_path);
+        remove(temp_path);
+        return ESP_FAIL;
+    }
+    remove(path);
+    if (rename(temp_path, path) != 0)
+    {
+        ESP_LOGE(detectorTag, "Failed to rename %s", temp_path);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(detectorTag, "Saved background snapshot to %s", path);
+    return ESP_OK;
+}
+
+esp_err_t motion_detector_load_snapshot(MotionDetector *detector, const char *path, uint32_t max_age_seconds)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    BackgroundSnapshotHeader header;
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (fread(&header, sizeof(header), 1, fp) == 1)
+    {
+        err = check_snapshot_header(detector, &header, max_age_seconds);
+    }
+    if (err != ESP_OK)
+    {
+        fclose(fp);
+        return err;
+    }
+
+    // Stage the planes in the model itself: luma bytes at the end of the background buffer expand
+    // forwards into Q8.8 without overlap, and the model is reset below if anything fails
+    size_t pixels = detector->model.width * detector->model.height;
+    uint8_t *luma = (uint8_t *)detector->model.background + pixels;
+    bool has_variance = (header.flags & SNAPSHOT_HAS_VARIANCE) != 0;
+    bool ok = fread(luma, 1, pixels, fp) == pixels;
+    uint32_t checksum = fnv1a(FNV1A_SEED, luma, pixels);
+    if (ok && has_variance)
+    {
+        // Read the variance even when the model has no plane for it, to verify the checksum
+        uint16_t buffer[64];
+        size_t remaining = pixels;
+        size_t offset = 0;
+        while (ok && remaining > 0)
+        {
+            size_t count = remaining < 64 ? remaining : 64;
+            ok = fread(buffer, sizeof(uint16_t), count, fp) == count;
+            checksum = fnv1a(checksum, buffer, count * sizeof(uint16_t));
+            if (ok && detector->model.variance)
+            {
+                memcpy(detector->model.variance + offset, buffer, count * sizeof(uint16_t));
+            }
+            offset += count;
+            remaining -= count;
+        }
+    }
+    fclose(fp);
+
+    if (!ok || checksum != header.checksum)
+    {
+        ESP_LOGW(detectorTag, "Background snapshot %s is corrupt", path);
+        detector->model.initialized = false;
+        detector->frame_counter = 0;
+        return ESP_ERR_INVALID_CRC;
+    }
+    set_background_from_luma(detector, luma);
+    finish_warm_start(detector, has_variance && detector->model.variance);
+    ESP_LOGI(detectorTag, "Warm-started background from %s", path);
+    return ESP_OK;
+}
+
+esp_err_t motion_detector_retain_snapshot(const MotionDetector *detector)
+{
+#if CONFIG_SPIRAM_ALLOW_NOINIT_SEG_EXTERNAL_MEMORY
+    size_t pixels = detector->model.width * detector->model.height;
+    if (!detector->model.initialized)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (pixels > SNAPSHOT_RETAINED_PIXELS)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t y = 0; y < detector->model.height; y++)
+    {
+        for (size_t x = 0; x < detector->model.width; x++)
+        {
+            retained_snapshot.luma[y * detector->model.width + x] = background_luma(detector, x, y);
+        }
+    }
+    BackgroundSnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .flags = 0,
+        .width = (uint32_t)detector->model.width,
+        .height = (uint32_t)detector->model.height,
+        .timestamp = (int64_t)time(NULL),
+        .checksum = fnv1a(FNV1A_SEED, retained_snapshot.luma, pixels)};
+    retained_snapshot.header = header;
+    return ESP_OK;
+#else
+    (void)detector;
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t motion_detector_restore_retained_snapshot(MotionDetector *detector, uint32_t max_age_seconds)
+{
+#if CONFIG_SPIRAM_ALLOW_NOINIT_SEG_EXTERNAL_MEMORY
+    // After a power-on the retained memory holds noise, which the magic and checksum reject
+    esp_err_t err = check_snapshot_header(detector, &retained_snapshot.header, max_age_seconds);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    size_t pixels = detector->model.width * detector->model.height;
+    if (fnv1a(FNV1A_SEED, retained_snapshot.luma, pixels) != retained_snapshot.header.checksum)
+    {
+        return ESP_ERR_INVALID_CRC;
+    }
+    set_background_from_luma(detector, retained_snapshot.luma);
+    finish_warm_start(detector, false);
+    ESP_LOGI(detectorTag, "Warm-started background from retained memory");
+    return ESP_OK;
+#else
+    (void)detector;
+    (void)max_age_seconds;
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+time_t motion_detector_heatmap_start(const MotionDetector *detector)
+{
+    return detector->heatmap.start;
+}
+
+esp_err_t motion_detector_save_heatmap(MotionDetector *detector, const char *path)
+{
+    size_t tiles_x = detector->scratch.tiles_x;
+    size_t tiles_y = detector->scratch.tiles_y;
+    uint8_t *row = (uint8_t *)malloc(tiles_x * 2);
+    if (!row)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        ESP_LOGE(detectorTag, "Failed to create %s", path);
+        free(row);
+        return ESP_FAIL;
+    }
+
+    // 16-bit PGM samples are big-endian; the comment lets readers normalize by the frame count
+    bool ok = fprintf(fp, "P5\n# frames %lu start %lld\n%zu %zu\n65535\n", (unsigned long)detector->heatmap.frames,
+                      (long long)detector->heatmap.start, tiles_x, tiles_y) > 0;
+    for (size_t ty = 0; ty < tiles_y && ok; ty++)
+    {
+        const uint16_t *counts = detector->heatmap.counts + ty * tiles_x;
+        for (size_t tx = 0; tx < tiles_x; tx++)
+        {
+            row[2 * tx] = (uint8_t)(counts[tx] >> 8);
+            row[2 * tx + 1] = (uint8_t)counts[tx];
+        }
+        ok = fwrite(row, 1, tiles_x * 2, fp) == tiles_x * 2;
+    }
+    ok = (fclose(fp) == 0) && ok;
+    free(row);
+    if (!ok)
+    {
+        ESP_LOGE(detectorTag, "Failed to write heatmap %s", path);
+        return ESP_FAIL;
+    }
+
+    // Only a saved period is cleared; after a failed write the next file covers both periods
+    memset(detector->heatmap.counts, 0, tiles_x * tiles_y * sizeof(uint16_t));
+    detector->heatmap.frames = 0;
+    detector->heatmap.start = synced_clock();
+    ESP_LOGI(detectorTag, "Saved motion heatmap to %s", path);
+    return ESP_OK;
+}
+
+void motion_detector_set_staging_config(MotionDetector *detector, const MotionStagingConfig *config)
+{
+    detector->config.staging = normalize_staging_config(config);
+    detector->quiet_streak = 0;
+}
+
+void motion_detector_get_staging_config(const MotionDetector *detector, MotionStagingConfig *config)
+{
+    *config = detector->config.staging;
+}
+
+size_t motion_detector_take_ended_tracks(MotionDetector *detector, MotionTrack *tracks, size_t max_tracks)
+{
+    return motion_tracker_take_ended(&detector->tracker, tracks, max_tracks);
+}
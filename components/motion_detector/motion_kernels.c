@@ -0,0 +1,553 @@
+#include "motion_kernels.h"
+#include <string.h>
+
+#if defined(MOTION_KERNEL_AVX2)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Compare pixels [x_first, x_last) of a row against the background and update it, returning their mask bits from bit 0
+static inline uint32_t update_diff_word(uint16_t *background, const uint8_t *frame, size_t x_first, size_t x_last,
+                                        uint8_t threshold, unsigned shift, unsigned foreground_shift)
+{
+    uint32_t bits = 0;
+    for (size_t x = x_first; x < x_last; x++)
+    {
+        uint16_t bg = background[x];
+        int diff = (int)((bg + 128) >> 8) - (int)frame[x];
+        if (diff < 0)
+        {
+            diff = -diff;
+        }
+        uint32_t changed = diff > threshold;
+        unsigned rate = changed ? foreground_shift : shift;
+        background[x] = (uint16_t)(bg - ((bg + (1u << (rate - 1))) >> rate) + (frame[x] << (8 - rate)));
+        bits |= changed << (x - x_first);
+    }
+    return bits;
+}
+
+void motion_kernel_update_diff_row_scalar(uint16_t *background, const uint8_t *frame, uint32_t *mask_row,
+                                          const uint32_t *roi_row, size_t width, uint8_t threshold,
+                                          unsigned shift, unsigned foreground_shift)
+{
+    for (size_t x = 0, w = 0; x < width; x += 32, w++)
+    {
+        if (roi_row && roi_row[w] == 0)
+        {
+            mask_row[w] = 0;
+            continue;
+        }
+        size_t x_last = (x + 32 < width) ? x + 32 : width;
+        uint32_t bits = update_diff_word(background, frame, x, x_last, threshold, shift, foreground_shift);
+        mask_row[w] = roi_row ? bits & roi_row[w] : bits;
+    }
+}
+
+// Scalar tail for the tile kernel: update pixels [x_first, x_last) and add their differences to tile_sums
+static inline void update_tile_span(uint16_t *background, const uint8_t *frame, uint32_t *tile_sums,
+                                    size_t x_first, size_t x_last, unsigned tile_shift,
+                                    uint8_t threshold, unsigned shift, unsigned foreground_shift)
+{
+    for (size_t x = x_first; x < x_last; x++)
+    {
+        uint16_t bg = background[x];
+        int diff = (int)((bg + 128) >> 8) - (int)frame[x];
+        if (diff < 0)
+        {
+            diff = -diff;
+        }
+        unsigned rate = diff > threshold ? foreground_shift : shift;
+        background[x] = (uint16_t)(bg - ((bg + (1u << (rate - 1))) >> rate) + (frame[x] << (8 - rate)));
+        tile_sums[x >> tile_shift] += (uint32_t)diff;
+    }
+}
+
+// Like update_tile_span(), but tile by tile so tiles clear in roi_tiles are skipped entirely
+static inline void update_tile_span_roi(uint16_t *background, const uint8_t *frame, uint32_t *tile_sums,
+                                        const uint32_t *roi_tiles, size_t x_first, size_t x_last,
+                                        unsigned tile_shift, uint8_t threshold, unsigned shift,
+                                        unsigned foreground_shift)
+{
+    if (!roi_tiles)
+    {
+        update_tile_span(background, frame, tile_sums, x_first, x_last, tile_shift, threshold, shift, foreground_shift);
+        return;
+    }
+    size_t x = x_first;
+    while (x < x_last)
+    {
+        size_t tile = x >> tile_shift;
+        size_t tile_end = (tile + 1) << tile_shift;
+        size_t span_end = tile_end < x_last ? tile_end : x_last;
+        if ((roi_tiles[tile >> 5] >> (tile & 31)) & 1)
+        {
+            update_tile_span(background, frame, tile_sums, x, span_end, tile_shift, threshold, shift, foreground_shift);
+        }
+        x = span_end;
+    }
+}
+
+void motion_kernel_update_tile_row_scalar(uint16_t *background, const uint8_t *frame, uint32_t *tile_sums,
+                                          const uint32_t *roi_tiles, size_t width, unsigned tile_shift,
+                                          uint8_t threshold, unsigned shift, unsigned foreground_shift)
+{
+    update_tile_span_roi(background, frame, tile_sums, roi_tiles, 0, width, tile_shift,
+                         threshold, shift, foreground_shift);
+}
+
+void motion_kernel_update_diff_variance_row(uint16_t *background, uint16_t *variance, const uint8_t *frame,
+                                            uint32_t *mask_row, const uint32_t *roi_row, size_t width,
+                                            uint8_t min_threshold, uint32_t k_squared, unsigned shift,
+                                            unsigned foreground_shift, unsigned variance_shift)
+{
+    for (size_t x = 0, w = 0; x < width; x += 32, w++)
+    {
+        if (roi_row && roi_row[w] == 0)
+        {
+            mask_row[w] = 0;
+            continue;
+        }
+        size_t x_last = (x + 32 < width) ? x + 32 : width;
+        uint32_t bits = 0;
+        for (size_t i = x; i < x_last; i++)
+        {
+            uint16_t bg = background[i];
+            int diff = (int)((bg + 128) >> 8) - (int)frame[i];
+            uint32_t diff_squared = (uint32_t)(diff * diff);
+            uint32_t changed = (diff_squared > (uint32_t)min_threshold * min_threshold) &
+                               (diff_squared > k_squared * variance[i]);
+            if (changed)
+            {
+                background[i] = (uint16_t)(bg - ((bg + (1u << (foreground_shift - 1))) >> foreground_shift) +
+                                           (frame[i] << (8 - foreground_shift)));
+            }
+            else
+            {
+                // Only background pixels feed the variance, so a subject does not inflate its own threshold
+                background[i] = (uint16_t)(bg - ((bg + (1u << (shift - 1))) >> shift) + (frame[i] << (8 - shift)));
+                variance[i] = (uint16_t)(variance[i] - (variance[i] >> variance_shift) + (diff_squared >> variance_shift));
+            }
+            bits |= changed << (i - x);
+        }
+        mask_row[w] = roi_row ? bits & roi_row[w] : bits;
+    }
+}
+
+// Mean of the pixels of each block whose columns lie in [x_first, x_last) of a group of rows
+static inline void downscale_span(const uint8_t *frame, size_t width, size_t rows, unsigned shift, size_t x_first,
+                                  size_t x_last, uint8_t *out)
+{
+    size_t block = (size_t)1 << shift;
+    for (size_t x = x_first; x < x_last; x += block)
+    {
+        size_t x_end = x + block < width ? x + block : width;
+        uint32_t sum = 0;
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t i = x; i < x_end; i++)
+            {
+                sum += frame[r * width + i];
+            }
+        }
+        uint32_t count = (uint32_t)(rows * (x_end - x));
+        out[x >> shift] = (uint8_t)((sum + count / 2) / count);
+    }
+}
+
+void motion_kernel_downscale_rows_scalar(const uint8_t *frame, size_t width, size_t rows, unsigned shift,
+                                         uint8_t *out)
+{
+    downscale_span(frame, width, rows, shift, 0, width, out);
+}
+
+// Activity counters for cells [cell_first, cell_last). Branch-free: a cell adds the truth value of
+// "any bit set and not saturated", so counters never wrap.
+static inline void accumulate_activity_span(const uint32_t *mask, size_t stride, size_t rows, unsigned cell_shift,
+                                            size_t cell_first, size_t cell_last, uint16_t *counts)
+{
+    uint32_t cell_bits = (uint32_t)(((uint64_t)1 << (1u << cell_shift)) - 1);
+    for (size_t i = cell_first; i < cell_last; i++)
+    {
+        size_t bit = i << cell_shift;
+        uint32_t any = 0;
+        for (size_t r = 0; r < rows; r++)
+        {
+            any |= mask[r * stride + (bit >> 5)];
+        }
+        uint32_t active = ((any >> (bit & 31)) & cell_bits) != 0;
+        counts[i] = (uint16_t)(counts[i] + (active & (counts[i] != UINT16_MAX)));
+    }
+}
+
+void motion_kernel_accumulate_activity_scalar(const uint32_t *mask, size_t stride, size_t rows,
+                                              unsigned cell_shift, size_t cells, uint16_t *counts)
+{
+    accumulate_activity_span(mask, stride, rows, cell_shift, 0, cells, counts);
+}
+
+// One horizontal 1x3 pass. Bit i of a word is the pixel at x = 32 * word + i, so a pixel's left
+// neighbour is shifted in from below and its right neighbour from above. Padding bits past width stand
+// in for the pixels outside the frame on the right.
+void motion_kernel_mask_horizontal_pass(const uint32_t *src, uint32_t *dst, size_t stride, size_t width,
+                                        size_t height, bool dilate, bool outside_changed)
+{
+    uint32_t last_word_mask = (width & 31) ? (1u << (width & 31)) - 1 : UINT32_MAX;
+    uint32_t outside = outside_changed ? UINT32_MAX : 0;
+    uint32_t padding = outside & ~last_word_mask;
+    for (size_t y = 0; y < height; y++)
+    {
+        const uint32_t *src_row = src + y * stride;
+        uint32_t *dst_row = dst + y * stride;
+        uint32_t previous = outside;
+        uint32_t current = src_row[0] | (stride == 1 ? padding : 0);
+        for (size_t w = 0; w < stride; w++)
+        {
+            uint32_t next = w + 1 < stride ? src_row[w + 1] | (w + 2 == stride ? padding : 0) : outside;
+            uint32_t left = (current << 1) | (previous >> 31);
+            uint32_t right = (current >> 1) | (next << 31);
+            dst_row[w] = dilate ? (current | left | right) : (current & left & right);
+            previous = current;
+            current = next;
+        }
+        dst_row[stride - 1] &= last_word_mask;
+    }
+}
+
+void motion_kernel_mask_vertical_pass(const uint32_t *src, uint32_t *dst, size_t stride, size_t y_begin,
+                                      size_t y_end, size_t height, bool dilate, bool outside_changed)
+{
+    uint32_t outside = outside_changed ? UINT32_MAX : 0;
+    for (size_t y = y_begin; y < y_end; y++)
+    {
+        const uint32_t *above = y > 0 ? src + (y - 1) * stride : NULL;
+        const uint32_t *row = src + y * stride;
+        const uint32_t *below = y + 1 < height ? src + (y + 1) * stride : NULL;
+        uint32_t *dst_row = dst + y * stride;
+        for (size_t w = 0; w < stride; w++)
+        {
+            uint32_t up = above ? above[w] : outside;
+            uint32_t down = below ? below[w] : outside;
+            dst_row[w] = dilate ? (row[w] | up | down) : (row[w] & up & down);
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Per-lane EMA step for eight Q8.8 values. The background never exceeds 0xFF7F, so adding the
+// rounding term cannot wrap.
+static inline __m128i ema_sse2(__m128i bg, __m128i pixels16, __m128i shift_v, __m128i pixel_shift_v)
+{
+    __m128i half = _mm_srli_epi16(_mm_sll_epi16(_mm_set1_epi16(1), shift_v), 1);
+    __m128i step = _mm_srl_epi16(_mm_add_epi16(bg, half), shift_v);
+    return _mm_add_epi16(_mm_sub_epi16(bg, step), _mm_sll_epi16(pixels16, pixel_shift_v));
+}
+
+// 16 pixels: compare against the background, update it and return one mask bit per pixel.
+// The absolute differences are left in diff_out.
+static inline uint32_t update_diff_16_sse2(uint16_t *background, const uint8_t *frame, __m128i threshold_v,
+                                           __m128i shift_v, __m128i pixel_shift_v,
+                                           __m128i fg_shift_v, __m128i fg_pixel_shift_v, __m128i *diff_out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+
+    __m128i pixels = _mm_loadu_si128((const __m128i *)frame);
+    __m128i bg_lo = _mm_loadu_si128((const __m128i *)background);
+    __m128i bg_hi = _mm_loadu_si128((const __m128i *)(background + 8));
+
+    __m128i luma = _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(bg_lo, half), 8),
+                                    _mm_srli_epi16(_mm_add_epi16(bg_hi, half), 8));
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(luma, pixels), _mm_subs_epu8(pixels, luma));
+    __m128i quiet = _mm_cmpeq_epi8(_mm_subs_epu8(diff, threshold_v), zero);
+
+    // Background pixels learn at shift, foreground pixels at foreground_shift
+    __m128i pixels_lo = _mm_unpacklo_epi8(pixels, zero);
+    __m128i pixels_hi = _mm_unpackhi_epi8(pixels, zero);
+    __m128i quiet_lo = _mm_unpacklo_epi8(quiet, quiet);
+    __m128i quiet_hi = _mm_unpackhi_epi8(quiet, quiet);
+    bg_lo = _mm_or_si128(_mm_and_si128(quiet_lo, ema_sse2(bg_lo, pixels_lo, shift_v, pixel_shift_v)),
+                         _mm_andnot_si128(quiet_lo, ema_sse2(bg_lo, pixels_lo, fg_shift_v, fg_pixel_shift_v)));
+    bg_hi = _mm_or_si128(_mm_and_si128(quiet_hi, ema_sse2(bg_hi, pixels_hi, shift_v, pixel_shift_v)),
+                         _mm_andnot_si128(quiet_hi, ema_sse2(bg_hi, pixels_hi, fg_shift_v, fg_pixel_shift_v)));
+    _mm_storeu_si128((__m128i *)background, bg_lo);
+    _mm_storeu_si128((__m128i *)(background + 8), bg_hi);
+
+    *diff_out = diff;
+    return ~(uint32_t)_mm_movemask_epi8(quiet) & 0xFFFFu;
+}
+
+// Tile sums for both the SSE2 and AVX2 builds; psadbw yields one 8-pixel sum per 64-bit half
+void motion_kernel_update_tile_row(uint16_t *background, const uint8_t *frame, uint32_t *tile_sums,
+                                   const uint32_t *roi_tiles, size_t width, unsigned tile_shift,
+                                   uint8_t threshold, unsigned shift, unsigned foreground_shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i threshold_v = _mm_set1_epi8((char)threshold);
+    const __m128i shift_v = _mm_cvtsi32_si128((int)shift);
+    const __m128i pixel_shift_v = _mm_cvtsi32_si128((int)(8 - shift));
+    const __m128i fg_shift_v = _mm_cvtsi32_si128((int)foreground_shift);
+    const __m128i fg_pixel_shift_v = _mm_cvtsi32_si128((int)(8 - foreground_shift));
+
+    size_t x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        if (roi_tiles)
+        {
+            // 16 pixels cover one or two tiles; only a fully enabled chunk takes the vector path
+            size_t tile_lo = x >> tile_shift;
+            size_t tile_hi = (x + 15) >> tile_shift;
+            uint32_t enabled_lo = (roi_tiles[tile_lo >> 5] >> (tile_lo & 31)) & 1;
+            uint32_t enabled_hi = (roi_tiles[tile_hi >> 5] >> (tile_hi & 31)) & 1;
+            if (!(enabled_lo & enabled_hi))
+            {
+                if (enabled_lo | enabled_hi)
+                {
+                    update_tile_span_roi(background, frame, tile_sums, roi_tiles, x, x + 16, tile_shift,
+                                         threshold, shift, foreground_shift);
+                }
+                continue;
+            }
+        }
+        __m128i diff;
+        update_diff_16_sse2(background + x, frame + x, threshold_v,
+                            shift_v, pixel_shift_v, fg_shift_v, fg_pixel_shift_v, &diff);
+        __m128i sad = _mm_sad_epu8(diff, zero);
+        uint32_t sum_lo = (uint32_t)_mm_cvtsi128_si32(sad);
+        uint32_t sum_hi = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+        tile_sums[x >> tile_shift] += sum_lo;
+        tile_sums[(x + 8) >> tile_shift] += sum_hi;
+    }
+    update_tile_span_roi(background, frame, tile_sums, roi_tiles, x, width, tile_shift,
+                         threshold, shift, foreground_shift);
+}
+#else
+void motion_kernel_update_tile_row(uint16_t *background, const uint8_t *frame, uint32_t *tile_sums,
+                                   const uint32_t *roi_tiles, size_t width, unsigned tile_shift,
+                                   uint8_t threshold, unsigned shift, unsigned foreground_shift)
+{
+    motion_kernel_update_tile_row_scalar(background, frame, tile_sums, roi_tiles, width, tile_shift,
+                                         threshold, shift, foreground_shift);
+}
+#endif
+
+#if defined(__SSE2__)
+// Box filter for both the SSE2 and AVX2 builds: byte pairs are summed in 16-bit lanes, then pairs of
+// lanes in 32-bit lanes for 4x4 blocks. Partial blocks at the right and bottom edges stay scalar.
+void motion_kernel_downscale_rows(const uint8_t *frame, size_t width, size_t rows, unsigned shift, uint8_t *out)
+{
+    size_t x = 0;
+    if ((shift == 1 || shift == 2) && rows == ((size_t)1 << shift))
+    {
+        const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+        const __m128i low_words = _mm_set1_epi32(0xFFFF);
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i sums = zero;
+            for (size_t r = 0; r < rows; r++)
+            {
+                __m128i pixels = _mm_loadu_si128((const __m128i *)(frame + r * width + x));
+                sums = _mm_add_epi16(sums, _mm_add_epi16(_mm_and_si128(pixels, low_bytes), _mm_srli_epi16(pixels, 8)));
+            }
+            if (shift == 1)
+            {
+                __m128i means = _mm_srli_epi16(_mm_add_epi16(sums, _mm_set1_epi16(2)), 2);
+                _mm_storel_epi64((__m128i *)(out + (x >> 1)), _mm_packus_epi16(means, zero));
+            }
+            else
+            {
+                __m128i quads = _mm_add_epi32(_mm_and_si128(sums, low_words), _mm_srli_epi32(sums, 16));
+                __m128i means = _mm_srli_epi32(_mm_add_epi32(quads, _mm_set1_epi32(8)), 4);
+                int packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(means, zero), zero));
+                memcpy(out + (x >> 2), &packed, sizeof(packed));
+            }
+        }
+    }
+    downscale_span(frame, width, rows, shift, x, width, out);
+}
+#else
+void motion_kernel_downscale_rows(const uint8_t *frame, size_t width, size_t rows, unsigned shift, uint8_t *out)
+{
+    motion_kernel_downscale_rows_scalar(frame, width, rows, shift, out);
+}
+#endif
+
+#if defined(__SSE2__)
+// Activity counters for both the SSE2 and AVX2 builds: the rows are ORed 128 bits at a time, each
+// byte (8-bit cells) or 16-bit lane (16-bit cells) compared against zero, and the 0/1 results added
+// with unsigned saturation. Narrower cells, as on the tile grid, are few enough to stay scalar.
+void motion_kernel_accumulate_activity(const uint32_t *mask, size_t stride, size_t rows, unsigned cell_shift,
+                                       size_t cells, uint16_t *counts)
+{
+    size_t i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    if (cell_shift == 3)
+    {
+        const __m128i ones = _mm_set1_epi8(1);
+        for (; i + 16 <= cells; i += 16)
+        {
+            __m128i any = zero;
+            for (size_t r = 0; r < rows; r++)
+            {
+                any = _mm_or_si128(any, _mm_loadu_si128((const __m128i *)(mask + r * stride + (i >> 2))));
+            }
+            __m128i active = _mm_andnot_si128(_mm_cmpeq_epi8(any, zero), ones);
+            __m128i *low = (__m128i *)(counts + i);
+            __m128i *high = (__m128i *)(counts + i + 8);
+            _mm_storeu_si128(low, _mm_adds_epu16(_mm_loadu_si128(low), _mm_unpacklo_epi8(active, zero)));
+            _mm_storeu_si128(high, _mm_adds_epu16(_mm_loadu_si128(high), _mm_unpackhi_epi8(active, zero)));
+        }
+    }
+    else if (cell_shift == 4)
+    {
+        const __m128i ones = _mm_set1_epi16(1);
+        for (; i + 8 <= cells; i += 8)
+        {
+            __m128i any = zero;
+            for (size_t r = 0; r < rows; r++)
+            {
+                any = _mm_or_si128(any, _mm_loadu_si128((const __m128i *)(mask + r * stride + (i >> 1))));
+            }
+            __m128i active = _mm_andnot_si128(_mm_cmpeq_epi16(any, zero), ones);
+            __m128i *lanes = (__m128i *)(counts + i);
+            _mm_storeu_si128(lanes, _mm_adds_epu16(_mm_loadu_si128(lanes), active));
+        }
+    }
+    accumulate_activity_span(mask, stride, rows, cell_shift, i, cells, counts);
+}
+#else
+void motion_kernel_accumulate_activity(const uint32_t *mask, size_t stride, size_t rows, unsigned cell_shift,
+                                       size_t cells, uint16_t *counts)
+{
+    motion_kernel_accumulate_activity_scalar(mask, stride, rows, cell_shift, cells, counts);
+}
+#endif
+
+#if defined(MOTION_KERNEL_SSE2)
+
+void motion_kernel_update_diff_row(uint16_t *background, const uint8_t *frame, uint32_t *mask_row,
+                                   const uint32_t *roi_row, size_t width, uint8_t threshold,
+                                   unsigned shift, unsigned foreground_shift)
+{
+    const __m128i threshold_v = _mm_set1_epi8((char)threshold);
+    const __m128i shift_v = _mm_cvtsi32_si128((int)shift);
+    const __m128i pixel_shift_v = _mm_cvtsi32_si128((int)(8 - shift));
+    const __m128i fg_shift_v = _mm_cvtsi32_si128((int)foreground_shift);
+    const __m128i fg_pixel_shift_v = _mm_cvtsi32_si128((int)(8 - foreground_shift));
+
+    size_t x = 0;
+    size_t w = 0;
+    for (; x + 32 <= width; x += 32, w++)
+    {
+        if (roi_row && roi_row[w] == 0)
+        {
+            mask_row[w] = 0;
+            continue;
+        }
+        __m128i diff;
+        uint32_t lo = update_diff_16_sse2(background + x, frame + x, threshold_v,
+                                          shift_v, pixel_shift_v, fg_shift_v, fg_pixel_shift_v, &diff);
+        uint32_t hi = update_diff_16_sse2(background + x + 16, frame + x + 16, threshold_v,
+                                          shift_v, pixel_shift_v, fg_shift_v, fg_pixel_shift_v, &diff);
+        mask_row[w] = roi_row ? (lo | (hi << 16)) & roi_row[w] : lo | (hi << 16);
+    }
+    if (x < width && !(roi_row && roi_row[w] == 0))
+    {
+        uint32_t bits = update_diff_word(background, frame, x, width, threshold, shift, foreground_shift);
+        mask_row[w] = roi_row ? bits & roi_row[w] : bits;
+    }
+    else if (x < width)
+    {
+        mask_row[w] = 0;
+    }
+}
+
+const char *motion_kernel_name(void)
+{
+    return "sse2";
+}
+#elif defined(MOTION_KERNEL_AVX2)
+// Per-lane EMA step for sixteen Q8.8 values, rounded as in ema_sse2()
+static inline __m256i ema_avx2(__m256i bg, __m256i pixels16, __m128i shift_v, __m128i pixel_shift_v)
+{
+    __m256i half = _mm256_srli_epi16(_mm256_sll_epi16(_mm256_set1_epi16(1), shift_v), 1);
+    __m256i step = _mm256_srl_epi16(_mm256_add_epi16(bg, half), shift_v);
+    return _mm256_add_epi16(_mm256_sub_epi16(bg, step), _mm256_sll_epi16(pixels16, pixel_shift_v));
+}
+
+void motion_kernel_update_diff_row(uint16_t *background, const uint8_t *frame, uint32_t *mask_row,
+                                   const uint32_t *roi_row, size_t width, uint8_t threshold,
+                                   unsigned shift, unsigned foreground_shift)
+{
+    const __m256i half = _mm256_set1_epi16(128);
+    const __m256i threshold_v = _mm256_set1_epi8((char)threshold);
+    const __m128i shift_v = _mm_cvtsi32_si128((int)shift);
+    const __m128i pixel_shift_v = _mm_cvtsi32_si128((int)(8 - shift));
+    const __m128i fg_shift_v = _mm_cvtsi32_si128((int)foreground_shift);
+    const __m128i fg_pixel_shift_v = _mm_cvtsi32_si128((int)(8 - foreground_shift));
+
+    size_t x = 0;
+    size_t w = 0;
+    for (; x + 32 <= width; x += 32, w++)
+    {
+        if (roi_row && roi_row[w] == 0)
+        {
+            mask_row[w] = 0;
+            continue;
+        }
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(frame + x));
+        __m256i bg_lo = _mm256_loadu_si256((const __m256i *)(background + x));
+        __m256i bg_hi = _mm256_loadu_si256((const __m256i *)(background + x + 16));
+
+        // packus works per 128-bit lane, so restore pixel order afterwards
+        __m256i luma = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_add_epi16(bg_lo, half), 8),
+                                           _mm256_srli_epi16(_mm256_add_epi16(bg_hi, half), 8));
+        luma = _mm256_permute4x64_epi64(luma, 0xD8);
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(luma, pixels), _mm256_subs_epu8(pixels, luma));
+        __m256i quiet = _mm256_cmpeq_epi8(_mm256_subs_epu8(diff, threshold_v), _mm256_setzero_si256());
+
+        // Background pixels learn at shift, foreground pixels at foreground_shift
+        __m256i pixels_lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(pixels));
+        __m256i pixels_hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(pixels, 1));
+        __m256i quiet_lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(quiet));
+        __m256i quiet_hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(quiet, 1));
+        bg_lo = _mm256_blendv_epi8(ema_avx2(bg_lo, pixels_lo, fg_shift_v, fg_pixel_shift_v),
+                                   ema_avx2(bg_lo, pixels_lo, shift_v, pixel_shift_v), quiet_lo);
+        bg_hi = _mm256_blendv_epi8(ema_avx2(bg_hi, pixels_hi, fg_shift_v, fg_pixel_shift_v),
+                                   ema_avx2(bg_hi, pixels_hi, shift_v, pixel_shift_v), quiet_hi);
+        _mm256_storeu_si256((__m256i *)(background + x), bg_lo);
+        _mm256_storeu_si256((__m256i *)(background + x + 16), bg_hi);
+
+        uint32_t bits = ~(uint32_t)_mm256_movemask_epi8(quiet);
+        mask_row[w] = roi_row ? bits & roi_row[w] : bits;
+    }
+    if (x < width && !(roi_row && roi_row[w] == 0))
+    {
+        uint32_t bits = update_diff_word(background, frame, x, width, threshold, shift, foreground_shift);
+        mask_row[w] = roi_row ? bits & roi_row[w] : bits;
+    }
+    else if (x < width)
+    {
+        mask_row[w] = 0;
+    }
+}
+
+const char *motion_kernel_name(void)
+{
+    return "avx2";
+}
+#else
+void motion_kernel_update_diff_row(uint16_t *background, const uint8_t *frame, uint32_t *mask_row,
+                                   const uint32_t *roi_row, size_t width, uint8_t threshold,
+                                   unsigned shift, unsigned foreground_shift)
+{
+    motion_kernel_update_diff_row_scalar(background, frame, mask_row, roi_row, width, threshold, shift, foreground_shift);
+}
+
+const char *motion_kernel_name(void)
+{
+    return "scalar";
+}
+#endif
@@ -0,0 +1,187 @@
+#ifndef MOTION_KERNELS_H
+#define MOTION_KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernel implementation selected at compile time
+#if defined(__AVX2__)
+#define MOTION_KERNEL_AVX2 1
+#elif defined(__SSE2__)
+#define MOTION_KERNEL_SSE2 1
+#else
+#define MOTION_KERNEL_SCALAR 1
+#endif
+
+/**
+ * @brief Fused per-row absolute difference, threshold, mask packing and background update
+ *
+ * Each pixel is compared against its rounded Q8.8 background value. Bit (x % 32) of mask_row[x / 32]
+ * is set when the difference exceeds threshold; padding bits past width are cleared. The background
+ * value is then moved towards the pixel by bg - ((bg + 2^(rate - 1)) >> rate) + (pixel << (8 - rate)),
+ * where rate is shift for unchanged pixels and foreground_shift for changed ones. With the step rounded,
+ * a value settled on a static pixel is within 2^(rate - 1) / 256 of a grey level of it on either side,
+ * so it rounds back to the pixel at every rate. Each byte is read and written once.
+ * With a region of interest, 32-pixel words that are clear in roi_row are skipped without touching
+ * the frame or background, and the remaining mask words are ANDed with roi_row.
+ *
+ * @param background Q8.8 background row, width values, updated in place
+ * @param frame Luminance row, width bytes
+ * @param mask_row Output change mask row, (width + 31) / 32 words
+ * @param roi_row Region of interest in the change mask layout, or NULL for the whole row
+ * @param width Pixels in the row
+ * @param threshold A pixel is changed when its difference is strictly greater than this
+ * @param shift Learning rate shift for background pixels, 1..8
+ * @param foreground_shift Learning rate shift for changed pixels, 1..8; equal to shift for a blind update
+ */
+void motion_kernel_update_diff_row(uint16_t *background, const uint8_t *frame, uint32_t *mask_row,
+                                   const uint32_t *roi_row, size_t width, uint8_t threshold,
+                                   unsigned shift, unsigned foreground_shift);
+
+/**
+ * @brief Portable reference for motion_kernel_update_diff_row(), always compiled
+ */
+void motion_kernel_update_diff_row_scalar(uint16_t *background, const uint8_t *frame, uint32_t *mask_row,
+                                          const uint32_t *roi_row, size_t width, uint8_t threshold,
+                                          unsigned shift, unsigned foreground_shift);
+
+/**
+ * @brief Per-row absolute difference accumulated into tile sums, with the same selective background update
+ *
+ * Adds each pixel's absolute difference against its rounded background value to tile_sums[x >> tile_shift].
+ * Background values are updated exactly as in motion_kernel_update_diff_row(). Tiles clear in roi_tiles
+ * are skipped: their sums and background values are left as they are.
+ *
+ * @param background Q8.8 background row, width values, updated in place
+ * @param frame Luminance row, width bytes
+ * @param tile_sums Running per-tile sums, (width + tile size - 1) >> tile_shift values
+ * @param roi_tiles Region of interest, 1 bit per tile in the tile mask layout, or NULL for every tile
+ * @param width Pixels in the row
+ * @param tile_shift log2 of the tile width, at least 3
+ * @param threshold Per-pixel threshold that selects the foreground learning rate
+ * @param shift Learning rate shift for background pixels, 1..8
+ * @param foreground_shift Learning rate shift for changed pixels, 1..8
+ */
+void motion_kernel_update_tile_row(uint16_t *background, const uint8_t *frame, uint32_t *tile_sums,
+                                   const uint32_t *roi_tiles, size_t width, unsigned tile_shift,
+                                   uint8_t threshold, unsigned shift, unsigned foreground_shift);
+
+/**
+ * @brief Portable reference for motion_kernel_update_tile_row(), always compiled
+ */
+void motion_kernel_update_tile_row_scalar(uint16_t *background, const uint8_t *frame, uint32_t *tile_sums,
+                                          const uint32_t *roi_tiles, size_t width, unsigned tile_shift,
+                                          uint8_t threshold, unsigned shift, unsigned foreground_shift);
+
+/**
+ * @brief Per-row change detection against a per-pixel running variance, with background and variance update
+ *
+ * A pixel is changed when its difference d from the rounded background exceeds min_threshold and
+ * d^2 > k_squared * variance. Changed pixels update the background at foreground_shift and leave the
+ * variance alone; other pixels update the background at shift and move the variance towards d^2 at
+ * variance_shift. Scalar on every target, since the k_squared * variance product needs 32-bit lanes.
+ * roi_row is applied as in motion_kernel_update_diff_row(); skipped words leave the variance alone too.
+ *
+ * @param background Q8.8 background row, width values, updated in place
+ * @param variance Running variance row in grey levels squared, width values, updated in place
+ * @param frame Luminance row, width bytes
+ * @param mask_row Output change mask row, (width + 31) / 32 words
+ * @param roi_row Region of interest in the change mask layout, or NULL for the whole row
+ * @param width Pixels in the row
+ * @param min_threshold Differences at or below this never count as change
+ * @param k_squared Square of the number of standard deviations a change must exceed
+ * @param shift Learning rate shift for background pixels, 1..8
+ * @param foreground_shift Learning rate shift for changed pixels, 1..8
+ * @param variance_shift Learning rate shift for the variance
+ */
+void motion_kernel_update_diff_variance_row(uint16_t *background, uint16_t *variance, const uint8_t *frame,
+                                            uint32_t *mask_row, const uint32_t *roi_row, size_t width,
+                                            uint8_t min_threshold, uint32_t k_squared, unsigned shift,
+                                            unsigned foreground_shift, unsigned variance_shift);
+
+/**
+ * @brief Box-filter a group of rows into one row of block means
+ *
+ * out[x >> shift] is the rounded mean of the pixels in columns [x, x + 2^shift) of all rows. Blocks
+ * cut off by the right edge average the pixels they have; passing fewer than 2^shift rows at the
+ * bottom edge does the same vertically.
+ *
+ * @param frame First of rows consecutive luminance rows, width bytes each
+ * @param width Pixels per row
+ * @param rows Rows in the group, 1..2^shift
+ * @param shift log2 of the block size, 1 or 2
+ * @param out Output row, (width + 2^shift - 1) >> shift bytes
+ */
+void motion_kernel_downscale_rows(const uint8_t *frame, size_t width, size_t rows, unsigned shift, uint8_t *out);
+
+/**
+ * @brief Portable reference for motion_kernel_downscale_rows(), always compiled
+ */
+void motion_kernel_downscale_rows_scalar(const uint8_t *frame, size_t width, size_t rows, unsigned shift,
+                                         uint8_t *out);
+
+/**
+ * @brief Count, per cell, whether any bit of a group of packed mask rows is set
+ *
+ * Cell i covers bits [i << cell_shift, (i + 1) << cell_shift) of every row in the group. counts[i]
+ * goes up by one when any of them is set, saturating at UINT16_MAX. Branch-free on every target.
+ *
+ * @param mask First mask row of the group, bit x & 31 of word x >> 5
+ * @param stride Words per mask row
+ * @param rows Rows in the group
+ * @param cell_shift log2 of the bits per cell, 0..4
+ * @param cells Cells per row; cells << cell_shift must not exceed stride * 32
+ * @param counts Counters, cells values, updated in place
+ */
+void motion_kernel_accumulate_activity(const uint32_t *mask, size_t stride, size_t rows, unsigned cell_shift,
+                                       size_t cells, uint16_t *counts);
+
+/**
+ * @brief Portable reference for motion_kernel_accumulate_activity(), always compiled
+ */
+void motion_kernel_accumulate_activity_scalar(const uint32_t *mask, size_t stride, size_t rows,
+                                              unsigned cell_shift, size_t cells, uint16_t *counts);
+
+/**
+ * @brief One horizontal 1x3 erosion or dilation of a packed mask, 32 pixels per word
+ *
+ * A pixel of dst is set when all three (erosion) or any (dilation) of the pixel and its left and right
+ * neighbours are set in src. Padding bits past width are cleared. Scalar on every target; each word
+ * takes a handful of shifts, so there is nothing left to vectorize.
+ *
+ * @param src Source mask, height rows of stride words, bit x & 31 of word x >> 5
+ * @param dst Output mask, same layout; must not overlap src
+ * @param stride Words per row
+ * @param width Pixels per row
+ * @param height Rows to process
+ * @param dilate Dilate instead of erode
+ * @param outside_changed Pixels outside the frame count as set, rather than clear
+ */
+void motion_kernel_mask_horizontal_pass(const uint32_t *src, uint32_t *dst, size_t stride, size_t width,
+                                        size_t height, bool dilate, bool outside_changed);
+
+/**
+ * @brief One vertical 3x1 erosion or dilation of rows [y_begin, y_end) of a packed mask
+ *
+ * As motion_kernel_mask_horizontal_pass() with the rows above and below as neighbours. Rows outside
+ * [y_begin, y_end) are read, never written, so a mask can be processed a few rows at a time.
+ *
+ * @param src Source mask, height rows of stride words
+ * @param dst Output mask, same layout; must not overlap src
+ * @param stride Words per row
+ * @param y_begin First row to write
+ * @param y_end Row after the last one to write
+ * @param height Rows in the frame; rows 0 and height - 1 have a neighbour outside it
+ * @param dilate Dilate instead of erode
+ * @param outside_changed Rows outside the frame count as set, rather than clear
+ */
+void motion_kernel_mask_vertical_pass(const uint32_t *src, uint32_t *dst, size_t stride, size_t y_begin,
+                                      size_t y_end, size_t height, bool dilate, bool outside_changed);
+
+/**
+ * @brief Name of the kernel implementation selected at compile time
+ */
+const char *motion_kernel_name(void);
+
+#endif // MOTION_KERNELS_H
@@ -0,0 +1,231 @@
+#include "motion_tracker.h"
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+
+static const char *trackerTag = "tracker";
+
+#define TRACK_MIN_IOU 0.1f          // Predicted box overlap that counts as the same subject
+#define TRACK_GATE_PIXELS 16        // Centroid distance allowed beyond half the track's larger side
+#define TRACK_MAX_MISSES 15         // Frames a track survives without a box before it ends
+#define TRACK_CONFIRM_HITS 2        // Hits before a track requests its first capture; filters one-frame flicker
+#define TRACK_RECAPTURE_SECONDS 10  // Minimum time between captures of the same track
+#define TRACK_CHANGE_IOU 0.3f       // A track whose box overlaps its captured box less than this has changed
+#define TRACK_VELOCITY_SMOOTHING 0.5f
+
+void motion_tracker_reset(MotionTracker *tracker)
+{
+    tracker->track_count = 0;
+    tracker->ended_count = 0;
+    // Ids keep counting across resets so a restarted track is never mistaken for an old one
+    if (tracker->next_id == 0)
+    {
+        tracker->next_id = 1;
+    }
+}
+
+static float box_center_x(BoundingBox box)
+{
+    return (box.x_min + box.x_max) * 0.5f;
+}
+
+static float box_center_y(BoundingBox box)
+{
+    return (box.y_min + box.y_max) * 0.5f;
+}
+
+// The track's last box moved along its velocity for the frames since it was last seen
+static BoundingBox predict_box(const MotionTrack *track)
+{
+    float steps = (float)(track->misses + 1);
+    float dx = track->vx * steps;
+    float dy = track->vy * steps;
+    BoundingBox box = track->box;
+    // Keep the prediction inside the first quadrant; boxes are unsigned
+    if (dx < -(float)box.x_min)
+        dx = -(float)box.x_min;
+    if (dy < -(float)box.y_min)
+        dy = -(float)box.y_min;
+    box.x_min = (size_t)((float)box.x_min + dx);
+    box.x_max = (size_t)((float)box.x_max + dx);
+    box.y_min = (size_t)((float)box.y_min + dy);
+    box.y_max = (size_t)((float)box.y_max + dy);
+    return box;
+}
+
+// Association score of a box with a track's prediction: IoU when they overlap enough, otherwise a
+// small score that falls with centroid distance inside the gate. Zero means no match.
+static float association_score(BoundingBox predicted, BoundingBox box)
+{
+    float iou = calculate_iou(predicted, box);
+    if (iou >= TRACK_MIN_IOU)
+    {
+        return iou;
+    }
+    float dx = box_center_x(predicted) - box_center_x(box);
+    float dy = box_center_y(predicted) - box_center_y(box);
+    size_t width = predicted.x_max - predicted.x_min;
+    size_t height = predicted.y_max - predicted.y_min;
+    float gate = (width > height ? width : height) * 0.5f + TRACK_GATE_PIXELS;
+    float distance_squared = dx * dx + dy * dy;
+    if (distance_squared >= gate * gate)
+    {
+        return 0;
+    }
+    return TRACK_MIN_IOU * (1.0f - distance_squared / (gate * gate));
+}
+
+// Decide whether a track's new state is worth a high-resolution capture, and record it if so
+static bool track_wants_capture(MotionTrack *track, time_t now)
+{
+    if (track->hits < TRACK_CONFIRM_HITS)
+    {
+        return false;
+    }
+    if (track->captures > 0 &&
+        (now - track->last_capture < TRACK_RECAPTURE_SECONDS ||
+         calculate_iou(track->box, track->captured_box) >= TRACK_CHANGE_IOU))
+    {
+        return false;
+    }
+    track->captured_box = track->box;
+    track->last_capture = now;
+    track->captures++;
+    return true;
+}
+
+static void associate(MotionTrack *track, BoundingBox box, time_t now)
+{
+    float dx = box_center_x(box) - box_center_x(track->box);
+    float dy = box_center_y(box) - box_center_y(track->box);
+    float steps = (float)(track->misses + 1);
+    track->vx = track->vx * TRACK_VELOCITY_SMOOTHING + (dx / steps) * (1.0f - TRACK_VELOCITY_SMOOTHING);
+    track->vy = track->vy * TRACK_VELOCITY_SMOOTHING + (dy / steps) * (1.0f - TRACK_VELOCITY_SMOOTHING);
+    track->box = box;
+    track->last_seen = now;
+    track->hits++;
+    track->misses = 0;
+}
+
+bool motion_tracker_update(MotionTracker *tracker, const BoundingBox *boxes, size_t box_count, time_t now,
+                           uint16_t *track_ids)
+{
+    MotionTrack *tracks = tracker->tracks;
+    bool capture = false;
+    bool track_matched[MAX_TRACKS] = {false};
+    BoundingBox predicted[MAX_TRACKS];
+    for (size_t t = 0; t < tracker->track_count; t++)
+    {
+        predicted[t] = predict_box(&tracks[t]);
+    }
+    for (size_t b = 0; b < box_count; b++)
+    {
+        track_ids[b] = 0;
+    }
+
+    // Greedy association: repeatedly take the best remaining track and box pair. Box and track
+    // counts are small after filtering, so the repeated scan is cheaper than building a cost matrix.
+    while (true)
+    {
+        float best_score = 0;
+        size_t best_track = 0;
+        size_t best_box = 0;
+        for (size_t t = 0; t < tracker->track_count; t++)
+        {
+            if (track_matched[t])
+            {
+                continue;
+            }
+            for (size_t b = 0; b < box_count; b++)
+            {
+                if (track_ids[b] != 0)
+                {
+                    continue;
+                }
+                float score = association_score(predicted[t], boxes[b]);
+                if (score > best_score)
+                {
+                    best_score = score;
+                    best_track = t;
+                    best_box = b;
+                }
+            }
+        }
+        if (best_score <= 0)
+        {
+            break;
+        }
+        track_matched[best_track] = true;
+        track_ids[best_box] = tracks[best_track].id;
+        associate(&tracks[best_track], boxes[best_box], now);
+        capture |= track_wants_capture(&tracks[best_track], now);
+    }
+
+    // Age unmatched tracks and end the stale ones, compacting the table in place
+    size_t kept = 0;
+    for (size_t t = 0; t < tracker->track_count; t++)
+    {
+        if (!track_matched[t] && ++tracks[t].misses > TRACK_MAX_MISSES)
+        {
+            ESP_LOGD(trackerTag, "Track %u ended after %lu hits", tracks[t].id, (unsigned long)tracks[t].hits);
+            if (tracker->ended_count < MAX_TRACKS)
+            {
+                tracker->ended[tracker->ended_count++] = tracks[t];
+            }
+            tracker->ended_total++;
+            continue;
+        }
+        tracks[kept++] = tracks[t];
+    }
+    tracker->track_count = kept;
+
+    // Unmatched boxes start new tracks while slots remain
+    for (size_t b = 0; b < box_count && tracker->track_count < MAX_TRACKS; b++)
+    {
+        if (track_ids[b] != 0)
+        {
+            continue;
+        }
+        MotionTrack *track = &tracks[tracker->track_count++];
+        memset(track, 0, sizeof(*track));
+        track->id = tracker->next_id++;
+        if (tracker->next_id == 0)
+        {
+            tracker->next_id = 1;
+        }
+        track->box = boxes[b];
+        track->first_seen = now;
+        track->last_seen = now;
+        track->hits = 1;
+        track_ids[b] = track->id;
+        ESP_LOGD(trackerTag, "Track %u started", track->id);
+        capture |= track_wants_capture(track, now);
+    }
+    return capture;
+}
+
+size_t motion_tracker_take_ended(MotionTracker *tracker, MotionTrack *out, size_t max_tracks)
+{
+    size_t count = tracker->ended_count < max_tracks ? tracker->ended_count : max_tracks;
+    memcpy(out, tracker->ended, count * sizeof(MotionTrack));
+    tracker->ended_count = 0;
+    return count;
+}
+
+size_t motion_tracker_get_tracks(const MotionTracker *tracker, MotionTrack *out, size_t max_tracks)
+{
+    size_t count = tracker->track_count < max_tracks ? tracker->track_count : max_tracks;
+    memcpy(out, tracker->tracks, count * sizeof(MotionTrack));
+    return count;
+}
+
+int motion_track_to_json(const MotionTrack *track, char *buffer, size_t size)
+{
+    return snprintf(buffer, size,
+                    "{\"track_id\":%u,\"ended\":true,\"first_seen\":%lld,\"last_seen\":%lld,\"hits\":%lu,"
+                    "\"captures\":%lu,\"x_min\":%zu,\"y_min\":%zu,\"x_max\":%zu,\"y_max\":%zu,\"vx\":%.1f,\"vy\":%.1f}",
+                    track->id, (long long)track->first_seen, (long long)track->last_seen,
+                    (unsigned long)track->hits, (unsigned long)track->captures,
+                    track->box.x_min, track->box.y_min, track->box.x_max, track->box.y_max,
+                    track->vx, track->vy);
+}
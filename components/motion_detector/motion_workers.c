@@ -0,0 +1,290 @@
+#include "motion_workers.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include "esp_log.h"
+
+#if MOTION_WORKERS_FREERTOS
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#else
+#include <pthread.h>
+#endif
+
+static const char *workersTag = "workers";
+
+#define MOTION_WORKER_STACK_SIZE 3072                // Labeling and the row kernels keep their state in scratch buffers
+#define MOTION_WORKER_PRIORITY (tskIDLE_PRIORITY + 1) // Above idle, below the data log and upload tasks; a
+                                                     // helper they keep off the core has its stripe run
+                                                     // by the caller instead
+
+typedef struct
+{
+    MotionWorkers *workers;
+    size_t stripe;
+#if MOTION_WORKERS_FREERTOS
+    TaskHandle_t task;
+    atomic_bool claimed; // Stripe of the current run taken, by the helper or by the caller
+#else
+    pthread_t thread;
+    bool claimed; // As above, guarded by lock
+#endif
+} MotionWorker;
+
+struct MotionWorkers
+{
+    size_t helper_count;
+    MotionWorker *helpers;
+    MotionStripeJob job; // Job of the current run
+    void *context;
+    bool stopping;
+#if MOTION_WORKERS_FREERTOS
+    SemaphoreHandle_t done; // Given once by each helper when its stripe is finished
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t start;    // Signalled when a run begins or the helpers should stop
+    pthread_cond_t finished; // Signalled when the last helper finishes its stripe
+    unsigned generation;     // Incremented per run so a helper never runs the same one twice
+    size_t pending;          // Helpers that claimed their stripe of the current run and are still on it
+#endif
+};
+
+#if MOTION_WORKERS_FREERTOS
+
+static void motion_worker_task(void *parameter)
+{
+    MotionWorker *worker = (MotionWorker *)parameter;
+    MotionWorkers *workers = worker->workers;
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (workers->stopping)
+        {
+            break;
+        }
+        // Woken too late, the caller has run this stripe itself and is not waiting for it
+        if (!atomic_exchange(&worker->claimed, true))
+        {
+            workers->job(workers->context, worker->stripe);
+            xSemaphoreGive(workers->done);
+        }
+    }
+    xSemaphoreGive(workers->done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t motion_workers_create(size_t helper_count, MotionWorkers **out_workers)
+{
+    MotionWorkers *workers = (MotionWorkers *)calloc(1, sizeof(MotionWorkers));
+    if (!workers)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    workers->helpers = (MotionWorker *)calloc(helper_count, sizeof(MotionWorker));
+    workers->done = xSemaphoreCreateCounting(helper_count, 0);
+    if (!workers->helpers || !workers->done)
+    {
+        motion_workers_destroy(workers);
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < helper_count; i++)
+    {
+        MotionWorker *worker = &workers->helpers[i];
+        worker->workers = workers;
+        worker->stripe = i + 1;
+        atomic_init(&worker->claimed, true);
+        if (xTaskCreatePinnedToCore(motion_worker_task, "motion_worker", MOTION_WORKER_STACK_SIZE, worker,
+                                    MOTION_WORKER_PRIORITY, &worker->task, PRO_CPU_NUM) != pdPASS)
+        {
+            ESP_LOGE(workersTag, "Failed to create motion worker %zu", i);
+            motion_workers_destroy(workers);
+            return ESP_ERR_NO_MEM;
+        }
+        workers->helper_count++;
+    }
+    *out_workers = workers;
+    return ESP_OK;
+}
+
+void motion_workers_run(MotionWorkers *workers, MotionStripeJob job, void *context)
+{
+    workers->job = job;
+    workers->context = context;
+    for (size_t i = 0; i < workers->helper_count; i++)
+    {
+        atomic_store(&workers->helpers[i].claimed, false);
+        xTaskNotifyGive(workers->helpers[i].task);
+    }
+    job(context, 0);
+    // A helper that has not started by now, say because an upload holds its core, loses its stripe to
+    // the caller, so a busy core makes the frame no slower than a single stripe would be
+    for (size_t i = 0; i < workers->helper_count; i++)
+    {
+        if (!atomic_exchange(&workers->helpers[i].claimed, true))
+        {
+            job(context, workers->helpers[i].stripe);
+        }
+        else
+        {
+            xSemaphoreTake(workers->done, portMAX_DELAY);
+        }
+    }
+}
+
+void motion_workers_destroy(MotionWorkers *workers)
+{
+    if (!workers)
+    {
+        return;
+    }
+    workers->stopping = true;
+    for (size_t i = 0; i < workers->helper_count; i++)
+    {
+        xTaskNotifyGive(workers->helpers[i].task);
+    }
+    // Each helper gives done once more on its way out, so nothing it uses is freed under it
+    for (size_t i = 0; i < workers->helper_count; i++)
+    {
+        xSemaphoreTake(workers->done, portMAX_DELAY);
+    }
+    if (workers->done)
+    {
+        vSemaphoreDelete(workers->done);
+    }
+    free(workers->helpers);
+    free(workers);
+}
+
+#else
+
+static void *motion_worker_thread(void *parameter)
+{
+    MotionWorker *worker = (MotionWorker *)parameter;
+    MotionWorkers *workers = worker->workers;
+    unsigned seen = 0;
+    pthread_mutex_lock(&workers->lock);
+    while (true)
+    {
+        while (!workers->stopping && workers->generation == seen)
+        {
+            pthread_cond_wait(&workers->start, &workers->lock);
+        }
+        if (workers->stopping)
+        {
+            break;
+        }
+        seen = workers->generation;
+        if (worker->claimed)
+        {
+            continue; // The caller has run this stripe itself
+        }
+        worker->claimed = true;
+        workers->pending++;
+        MotionStripeJob job = workers->job;
+        void *context = workers->context;
+        pthread_mutex_unlock(&workers->lock);
+
+        job(context, worker->stripe);
+
+        pthread_mutex_lock(&workers->lock);
+        if (--workers->pending == 0)
+        {
+            pthread_cond_signal(&workers->finished);
+        }
+    }
+    pthread_mutex_unlock(&workers->lock);
+    return NULL;
+}
+
+esp_err_t motion_workers_create(size_t helper_count, MotionWorkers **out_workers)
+{
+    MotionWorkers *workers = (MotionWorkers *)calloc(1, sizeof(MotionWorkers));
+    if (!workers)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->start, NULL);
+    pthread_cond_init(&workers->finished, NULL);
+    workers->helpers = (MotionWorker *)calloc(helper_count, sizeof(MotionWorker));
+    if (!workers->helpers)
+    {
+        motion_workers_destroy(workers);
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < helper_count; i++)
+    {
+        MotionWorker *worker = &workers->helpers[i];
+        worker->workers = workers;
+        worker->stripe = i + 1;
+        worker->claimed = true;
+        if (pthread_create(&worker->thread, NULL, motion_worker_thread, worker) != 0)
+        {
+            ESP_LOGE(workersTag, "Failed to create motion worker %zu", i);
+            motion_workers_destroy(workers);
+            return ESP_ERR_NO_MEM;
+        }
+        workers->helper_count++;
+    }
+    *out_workers = workers;
+    return ESP_OK;
+}
+
+void motion_workers_run(MotionWorkers *workers, MotionStripeJob job, void *context)
+{
+    pthread_mutex_lock(&workers->lock);
+    workers->job = job;
+    workers->context = context;
+    for (size_t i = 0; i < workers->helper_count; i++)
+    {
+        workers->helpers[i].claimed = false;
+    }
+    workers->generation++;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    job(context, 0);
+
+    // As on the device, stripes whose helper has not started yet are run here
+    pthread_mutex_lock(&workers->lock);
+    for (size_t i = 0; i < workers->helper_count; i++)
+    {
+        MotionWorker *worker = &workers->helpers[i];
+        if (!worker->claimed)
+        {
+            worker->claimed = true;
+            pthread_mutex_unlock(&workers->lock);
+            job(context, worker->stripe);
+            pthread_mutex_lock(&workers->lock);
+        }
+    }
+    while (workers->pending > 0)
+    {
+        pthread_cond_wait(&workers->finished, &workers->lock);
+    }
+    pthread_mutex_unlock(&workers->lock);
+}
+
+void motion_workers_destroy(MotionWorkers *workers)
+{
+    if (!workers)
+    {
+        return;
+    }
+    pthread_mutex_lock(&workers->lock);
+    workers->stopping = true;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+    for (size_t i = 0; i < workers->helper_count; i++)
+    {
+        pthread_join(workers->helpers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&workers->finished);
+    pthread_cond_destroy(&workers->start);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers->helpers);
+    free(workers);
+}
+
+#endif
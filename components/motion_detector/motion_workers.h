@@ -0,0 +1,52 @@
+#ifndef MOTION_WORKERS_H
+#define MOTION_WORKERS_H
+
+#include <stddef.h>
+#include "esp_err.h"
+
+// Stripe workers selected at compile time: FreeRTOS tasks on the device, pthreads on the host
+#if defined(ESP_PLATFORM)
+#define MOTION_WORKERS_FREERTOS 1
+#else
+#define MOTION_WORKERS_PTHREAD 1
+#endif
+
+// Work on one horizontal stripe of a frame; stripe 0 is the top
+typedef void (*MotionStripeJob)(void *context, size_t stripe);
+
+typedef struct MotionWorkers MotionWorkers;
+
+/**
+ * @brief Start the helpers that run stripes 1..helper_count in parallel with the caller
+ *
+ * On the device the helpers are pinned to the PRO core, which otherwise only runs logging and uploads.
+ *
+ * @param helper_count Number of helpers, one per stripe after the first
+ * @param out_workers Receives the workers
+ * @return ESP_OK or ESP_ERR_NO_MEM
+ */
+esp_err_t motion_workers_create(size_t helper_count, MotionWorkers **out_workers);
+
+/**
+ * @brief Run job on every stripe and wait for all of them
+ *
+ * The caller runs stripe 0 itself and helper i runs stripe i + 1. Once stripe 0 is done, the caller
+ * also runs any stripe whose helper has not started on it yet: the helpers sit at low priority on a
+ * core shared with uploads and SNTP, and while those run the frame then takes as long as with a single
+ * stripe rather than waiting for them. job must not touch memory another stripe writes, and must not
+ * depend on which task runs a stripe.
+ *
+ * @param workers The workers
+ * @param job Function run once per stripe
+ * @param context Passed to job
+ */
+void motion_workers_run(MotionWorkers *workers, MotionStripeJob job, void *context);
+
+/**
+ * @brief Stop the helpers and free the workers
+ *
+ * @param workers The workers, or NULL
+ */
+void motion_workers_destroy(MotionWorkers *workers);
+
+#endif // MOTION_WORKERS_H
@@ -27,6 +27,7 @@ extern QueueHandle_t sensor_data_queue;
 void initialize_sdcard(void);
 void deinitialise_sdcard(void);
 esp_err_t saveJpegToSdcard(camera_fb_t *fb, time_t timestamp);
+esp_err_t saveJpegBurstToSdcard(const camera_fb_t *frames, size_t count, size_t key_frame, time_t timestamp);
 void create_data_log_queue(void);
 void append_data_to_csv(time_t timestamp, float temperature, float humidity, float pressure, const char *bboxes);
 void log_sensor_data_task(void *pvParameters);
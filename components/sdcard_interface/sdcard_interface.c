@@ -101,6 +101,26 @@ void upload_folder()
     free(file_list); // Free allocated memory
 }
 
+static esp_err_t write_jpeg_file(const char *filename, const camera_fb_t *image)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        ESP_LOGE(sdcardTag, "Failed to create file: %s", filename);
+        return ESP_FAIL;
+    }
+
+    size_t bytes_written = fwrite(image->buf, 1, image->len, fp);
+    fclose(fp);
+
+    if (bytes_written != image->len)
+    {
+        ESP_LOGE(sdcardTag, "Failed to write all data to file: %s", filename);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
 esp_err_t saveJpegToSdcard(camera_fb_t *captureImage, time_t timestamp)
 {
     if (captureImage == NULL)
@@ -114,19 +134,8 @@ esp_err_t saveJpegToSdcard(camera_fb_t *captureImage, time_t timestamp)
     snprintf(filename, sizeof(filename), "%s/spaia/%lld.jpg", MOUNT_POINT, (long long)timestamp);
 
     // Create the file and write the JPEG data
-    FILE *fp = fopen(filename, "wb");
-    if (fp == NULL)
-    {
-        ESP_LOGE(sdcardTag, "Failed to create file: %s", filename);
-        return ESP_FAIL;
-    }
-
-    size_t bytes_written = fwrite(captureImage->buf, 1, captureImage->len, fp);
-    fclose(fp);
-
-    if (bytes_written != captureImage->len)
+    if (write_jpeg_file(filename, captureImage) != ESP_OK)
     {
-        ESP_LOGE(sdcardTag, "Failed to write all data to file: %s", filename);
         return ESP_FAIL;
     }
 
@@ -142,6 +151,55 @@ esp_err_t saveJpegToSdcard(camera_fb_t *captureImage, time_t timestamp)
 
     return ESP_OK;
 }
+
+esp_err_t saveJpegBurstToSdcard(const camera_fb_t *frames, size_t count, size_t key_frame, time_t timestamp)
+{
+    if (frames == NULL || key_frame >= count)
+    {
+        ESP_LOGE(sdcardTag, "Invalid burst");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Frames are numbered in capture order, e.g. /sd/spaia/1760000000-07.jpg
+    char filename[40];
+    char key_filename[40] = "";
+    size_t saved = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        snprintf(filename, sizeof(filename), "%s/spaia/%lld-%02u.jpg", MOUNT_POINT, (long long)timestamp,
+                 (unsigned)i);
+        if (write_jpeg_file(filename, &frames[i]) != ESP_OK)
+        {
+            continue;
+        }
+        saved++;
+        if (i == key_frame)
+        {
+            strcpy(key_filename, filename);
+        }
+    }
+    ESP_LOGI(sdcardTag, "Burst of %u/%u JPEGs saved as %s/spaia/%lld-NN.jpg", (unsigned)saved, (unsigned)count,
+             MOUNT_POINT, (long long)timestamp);
+    if (saved == 0)
+    {
+        return ESP_FAIL;
+    }
+    vTaskDelay(pdMS_TO_TICKS(500));
+
+    // Only the caller's key frame is uploaded, the triggering frame of a pre-roll burst or the sharpest of
+    // a high-resolution one; the rest stay on the card
+    if (key_filename[0] != '\0')
+    {
+        esp_err_t upload_result = queue_file_upload(key_filename, "https://device.spaia.earth/upload");
+        if (upload_result != ESP_OK)
+        {
+            ESP_LOGE(sdcardTag, "Failed to queue file upload for %s", key_filename);
+            return upload_result;
+        }
+    }
+
+    return saved == count ? ESP_OK : ESP_FAIL;
+}
 void log_sensor_data_task(void *pvParameters)
 {
     sensor_data_t sensor_data;